@@ -1,4 +1,5 @@
 #include "any_tensor.hpp"
+#include <new>
 
 int product(const std::vector<int>& a) {
   int r = 1;
@@ -56,6 +57,10 @@ TensorType AnyTensor::type(const std::vector<AnyTensor>& v) {
 }
 
 AnyScalar& AnyScalar::operator+=(const AnyScalar& rhs) {
+  if (t==TENSOR_DOUBLE && rhs.t==TENSOR_DOUBLE) {
+    data_double += rhs.data_double;
+    return *this;
+  }
   AnyScalar ret;
   switch (AnyScalar::merge(t, rhs.t)) {
     case TENSOR_DOUBLE:
@@ -90,41 +95,65 @@ AnyScalar pow(const AnyScalar&x, int i) {
   return 0;
 }
 
-AnyScalar::AnyScalar(const AnyScalar& s) {
+void AnyScalar::construct(const AnyScalar& s) {
+  switch (s.t) {
+    case TENSOR_DOUBLE: data_double = s.data_double; break;
+    case TENSOR_SX: new (&data_sx) SX(s.data_sx); break;
+    case TENSOR_MX: new (&data_mx) MX(s.data_mx); break;
+    default: break;
+  }
   t = s.t;
-  data_double = s.data_double;
-  data_sx = s.data_sx;
-  data_mx = s.data_mx;
 }
 
-AnyScalar& AnyScalar::operator=(const AnyScalar& s) {
+void AnyScalar::construct(AnyScalar&& s) {
+  switch (s.t) {
+    case TENSOR_DOUBLE: data_double = s.data_double; break;
+    case TENSOR_SX: new (&data_sx) SX(std::move(s.data_sx)); break;
+    case TENSOR_MX: new (&data_mx) MX(std::move(s.data_mx)); break;
+    default: break;
+  }
   t = s.t;
-  data_double = s.data_double;
-  data_sx = s.data_sx;
-  data_mx = s.data_mx;
+}
+
+AnyScalar& AnyScalar::assign(const AnyScalar& s) {
+  if (this==&s) return *this;
+  if (t==s.t && t==TENSOR_SX) {
+    data_sx = s.data_sx;
+  } else if (t==s.t && t==TENSOR_MX) {
+    data_mx = s.data_mx;
+  } else {
+    clear();
+    construct(s);
+  }
   return *this;
 }
 
-AnyScalar::AnyScalar(double s) {
-  t = TENSOR_DOUBLE;
-  data_double = s;
+AnyScalar& AnyScalar::assign(AnyScalar&& s) {
+  if (this==&s) return *this;
+  if (t==s.t && t==TENSOR_SX) {
+    data_sx = std::move(s.data_sx);
+  } else if (t==s.t && t==TENSOR_MX) {
+    data_mx = std::move(s.data_mx);
+  } else {
+    clear();
+    construct(std::move(s));
+  }
+  return *this;
 }
 
-AnyScalar::AnyScalar(const SX& s) {
-  t = TENSOR_SX;
-  data_sx = s;
+void AnyScalar::clear() {
+  switch (t) {
+    case TENSOR_SX: data_sx.~SX(); break;
+    case TENSOR_MX: data_mx.~MX(); break;
+    default: break;
+  }
+  t = TENSOR_NULL;
 }
 
-AnyScalar::AnyScalar(const MX& s) {
-  t = TENSOR_MX;
-  data_mx = s;
+AnyScalar::AnyScalar(const SX& s) : t(TENSOR_SX), data_sx(s) {
 }
 
-AnyScalar::AnyScalar() {
-  t = TENSOR_NULL;
-  data_double = 0;
-  data_sx = 0;
-  data_mx = 0;
+AnyScalar::AnyScalar(const MX& s) : t(TENSOR_MX), data_mx(s) {
 }
 
 AnyScalar::operator double() const {
@@ -145,47 +174,77 @@ AnyScalar::operator MX() const {
 }
 
 AnyTensor& AnyTensor::operator=(const AnyTensor& s) {
-  t = s.t;
-  data_double = s.data_double;
-  data_sx = s.data_sx;
-  data_mx = s.data_mx;
+  if (this==&s) return *this;
+  if (t==s.t) {
+    switch (t) {
+      case TENSOR_DOUBLE: data_double = s.data_double; break;
+      case TENSOR_SX: data_sx = s.data_sx; break;
+      case TENSOR_MX: data_mx = s.data_mx; break;
+      default: break;
+    }
+    return *this;
+  }
+  clear();
+  construct(s);
+  return *this;
+}
+
+AnyTensor& AnyTensor::operator=(AnyTensor&& s) {
+  if (this==&s) return *this;
+  if (t==s.t) {
+    switch (t) {
+      case TENSOR_DOUBLE: data_double = std::move(s.data_double); break;
+      case TENSOR_SX: data_sx = std::move(s.data_sx); break;
+      case TENSOR_MX: data_mx = std::move(s.data_mx); break;
+      default: break;
+    }
+    return *this;
+  }
+  clear();
+  construct(std::move(s));
   return *this;
 }
 
-AnyTensor::AnyTensor(const AnyScalar& s) : data_double(0), data_sx(0), data_mx(0) {
-  t = s.type();
+AnyTensor::AnyTensor(AnyTensor&& s) : t(TENSOR_NULL) {
+  construct(std::move(s));
+}
+
+AnyTensor::AnyTensor(DT&& s) : t(TENSOR_DOUBLE), data_double(std::move(s)) {
+}
+
+AnyTensor::AnyTensor(ST&& s) : t(TENSOR_SX), data_sx(std::move(s)) {
+}
+
+AnyTensor::AnyTensor(MT&& s) : t(TENSOR_MX), data_mx(std::move(s)) {
+}
+
+AnyTensor::AnyTensor(const AnyScalar& s) : t(s.type()) {
   switch (t) {
     case TENSOR_DOUBLE:
-      data_double = DT(s.as_double(), {1});
+      new (&data_double) DT(s.as_double(), {1});
       break;
     case TENSOR_SX:
-      data_sx = ST(s.as_SX(), {1});
+      new (&data_sx) ST(s.as_SX(), {1});
       break;
     case TENSOR_MX:
-      data_mx = MT(s.as_MX(), {1});
+      new (&data_mx) MT(s.as_MX(), {1});
       break;
     default:
       tensor_assert(false);
   }
 }
 
-AnyTensor::AnyTensor(const AnyTensor& s) : data_double(0), data_sx(0), data_mx(0) {
-  t = s.t;
-  data_double = s.data_double;
-  data_sx = s.data_sx;
-  data_mx = s.data_mx;
+AnyTensor::AnyTensor(const AnyTensor& s) : t(TENSOR_NULL) {
+  construct(s);
 }
 
-AnyTensor::AnyTensor(const DT & s) : data_double(s), data_sx(0), data_mx(0) {
-  t = TENSOR_DOUBLE;
+AnyTensor::AnyTensor(const DT & s) : t(TENSOR_DOUBLE), data_double(s) {
 }
 
-AnyTensor::AnyTensor(const ST & s) : data_double(0), data_sx(s), data_mx(0) {
-  t = TENSOR_SX;
+AnyTensor::AnyTensor(const ST & s) : t(TENSOR_SX), data_sx(s) {
 }
 
-AnyTensor::AnyTensor(const MT & s) : data_double(0), data_sx(0), data_mx(s) {
-  t = TENSOR_MX;
+AnyTensor::AnyTensor(const MT & s) : t(TENSOR_MX), data_mx(s) {
 }
 
 //AnyTensor::AnyTensor(const AnyScalar& s) {
@@ -194,7 +253,41 @@ AnyTensor::AnyTensor(const MT & s) : data_double(0), data_sx(0), data_mx(s) {
 //  }
 //}
 
-AnyTensor::AnyTensor() : data_double(0), data_sx(0), data_mx(0) {
+AnyTensor::AnyTensor() : t(TENSOR_NULL) {
+}
+
+AnyTensor::~AnyTensor() {
+  clear();
+}
+
+void AnyTensor::construct(const AnyTensor& s) {
+  switch (s.t) {
+    case TENSOR_DOUBLE: new (&data_double) DT(s.data_double); break;
+    case TENSOR_SX: new (&data_sx) ST(s.data_sx); break;
+    case TENSOR_MX: new (&data_mx) MT(s.data_mx); break;
+    default: break;
+  }
+  // Only once the tensor is constructed, so that a throwing copy leaves TENSOR_NULL
+  t = s.t;
+}
+
+void AnyTensor::construct(AnyTensor&& s) {
+  switch (s.t) {
+    case TENSOR_DOUBLE: new (&data_double) DT(std::move(s.data_double)); break;
+    case TENSOR_SX: new (&data_sx) ST(std::move(s.data_sx)); break;
+    case TENSOR_MX: new (&data_mx) MT(std::move(s.data_mx)); break;
+    default: break;
+  }
+  t = s.t;
+}
+
+void AnyTensor::clear() {
+  switch (t) {
+    case TENSOR_DOUBLE: data_double.~DT(); break;
+    case TENSOR_SX: data_sx.~ST(); break;
+    case TENSOR_MX: data_mx.~MT(); break;
+    default: break;
+  }
   t = TENSOR_NULL;
 }
 
@@ -215,33 +308,151 @@ AnyTensor::operator MT() const {
   return data_mx;
 }
 
+namespace {
+  struct ReorderDims {
+    const std::vector<int>& order;
+    template <class T>
+    AnyTensor operator()(const Tensor<T>& x) const { return x.reorder_dims(order).materialize(); }
+  };
+
+  struct Shape {
+    const std::vector<int>& dims;
+    template <class T>
+    AnyTensor operator()(const Tensor<T>& x) const { return x.shape(dims).materialize(); }
+  };
+
+  struct Negate {
+    template <class T>
+    AnyTensor operator()(const Tensor<T>& x) const { return -x; }
+  };
+
+  struct Dims {
+    template <class T>
+    std::vector<int> operator()(const Tensor<T>& x) const { return x.dims(); }
+  };
+
+  struct NDims {
+    template <class T>
+    int operator()(const Tensor<T>& x) const { return x.n_dims(); }
+  };
+
+  struct Representation {
+    template <class T>
+    std::string operator()(const Tensor<T>& x) const { return "AnyTensor:" + x.getRepresentation(); }
+  };
+
+  #define ANYTENSOR_VISITOR(NAME, EXPR) \
+  struct NAME { \
+    template <class T> \
+    AnyTensor operator()(const Tensor<T>& x, const Tensor<T>& y) const { return EXPR; } \
+  };
+
+  ANYTENSOR_VISITOR(GreaterEqual, x>=y)
+  ANYTENSOR_VISITOR(LessEqual, x<=y)
+  ANYTENSOR_VISITOR(OuterProduct, Tensor<T>(x).outer_product(y))
+  ANYTENSOR_VISITOR(Inner, Tensor<T>(x).inner(y))
+  ANYTENSOR_VISITOR(Solve, x.solve(y))
+  ANYTENSOR_VISITOR(Plus, x+y)
+  ANYTENSOR_VISITOR(Times, x*y)
+
+  #undef ANYTENSOR_VISITOR
+}
+
+AnyTensor AnyTensor::reorder_dims(const std::vector<int>& order) const {
+  return visit(ReorderDims{order});
+}
+
+AnyTensor AnyTensor::shape(const std::vector<int>& dims) const {
+  return visit(Shape{dims});
+}
+
+AnyTensor AnyTensor::operator-() const {
+  return visit(Negate());
+}
+
+std::vector<int> AnyTensor::dims() const {
+  return visit(Dims());
+}
+
+int AnyTensor::n_dims() const {
+  return visit(NDims());
+}
+
+std::string AnyTensor::getRepresentation() const {
+  if (t==TENSOR_NULL) return "";
+  return visit(Representation());
+}
+
+AnyTensor AnyTensor::operator>=(const AnyTensor &b) const {
+  return visit(*this, b, GreaterEqual());
+}
+
+AnyTensor AnyTensor::operator<=(const AnyTensor &b) const {
+  return visit(*this, b, LessEqual());
+}
+
+AnyTensor AnyTensor::outer_product(const AnyTensor &b) const {
+  return visit(*this, b, OuterProduct());
+}
+
+AnyTensor AnyTensor::inner(const AnyTensor &b) const {
+  return visit(*this, b, Inner());
+}
+
+AnyTensor AnyTensor::solve(const AnyTensor &b) const {
+  return visit(*this, b, Solve());
+}
+
+AnyTensor AnyTensor::operator+(const AnyTensor &b) const {
+  return visit(*this, b, Plus());
+}
+
+AnyTensor AnyTensor::operator*(const AnyTensor &b) const {
+  return visit(*this, b, Times());
+}
+
 
 AnyTensor AnyTensor::concat(const std::vector<AnyTensor>& v, int axis) {
-  tensor_assert_message(false, "Not implemented");
-  return DT();
+  switch (AnyTensor::type(v)) {
+    case TENSOR_DOUBLE: return DT::concat(AnyTensor::as_DT(v), axis);
+    case TENSOR_SX: return ST::concat(AnyTensor::as_ST(v), axis);
+    case TENSOR_MX: return MT::concat(AnyTensor::as_MT(v), axis);
+    default: tensor_assert(false); return DT();
+  }
 }
 
 std::vector<double> AnyScalar::as_double(const std::vector<AnyScalar>& v) {
-  std::vector<double> ret;
-  ret.reserve(v.size());
-  for (auto & i : v)
-    ret.push_back(i.as_double());
+  std::vector<double> ret(v.size());
+  for (int i=0;i<v.size();++i) {
+    tensor_assert(v[i].t==TENSOR_DOUBLE);
+    ret[i] = v[i].data_double;
+  }
   return ret;
 }
 
 std::vector<SX> AnyScalar::as_SX(const std::vector<AnyScalar>& v) {
   std::vector<SX> ret;
   ret.reserve(v.size());
-  for (auto & i : v)
-    ret.push_back(i.as_SX());
+  for (auto & i : v) {
+    if (i.t==TENSOR_SX) {
+      ret.push_back(i.data_sx);
+    } else {
+      ret.push_back(i.as_SX());
+    }
+  }
   return ret;
 }
 
 std::vector<MX> AnyScalar::as_MX(const std::vector<AnyScalar>& v) {
   std::vector<MX> ret;
   ret.reserve(v.size());
-  for (auto & i : v)
-    ret.push_back(i.as_MX());
+  for (auto & i : v) {
+    if (i.t==TENSOR_MX) {
+      ret.push_back(i.data_mx);
+    } else {
+      ret.push_back(i.as_MX());
+    }
+  }
   return ret;
 }
 
@@ -278,16 +489,65 @@ AnyTensor AnyTensor::pack(const std::vector<AnyTensor>& v, int axis) {
   }
 }
 
+AnyTensor AnyTensor::einsum(const std::vector<AnyTensor>& v,
+    const std::vector< std::vector<int> >& labels, const std::vector<int>& c) {
+  switch (AnyTensor::type(v)) {
+    case TENSOR_DOUBLE: return DT::einsum(AnyTensor::as_DT(v), labels, c);
+    case TENSOR_SX: return ST::einsum(AnyTensor::as_ST(v), labels, c);
+    case TENSOR_MX: return MT::einsum(AnyTensor::as_MT(v), labels, c);
+    default: tensor_assert(false); return DT();
+  }
+}
+
+namespace {
+  struct Unpack {
+    int axis;
+    template <class T>
+    std::vector<AnyTensor> operator()(const Tensor<T>& x) const {
+      std::vector<AnyTensor> ret;
+      for (auto& s : Tensor<T>::unpack(x, axis)) ret.push_back(s.materialize());
+      return ret;
+    }
+  };
+}
+
+std::vector<AnyTensor> AnyTensor::unpack(const AnyTensor& v, int axis) {
+  return v.visit(Unpack{axis});
+}
+
 std::vector<AnyTensor> unpack(const AnyTensor& v, int axis) {
-  tensor_assert_message(false, "Not implemented yet");
-  return {DT()};
+  return AnyTensor::unpack(v, axis);
 }
 
 
 AnyTensor AnyTensor::vertcat(const std::vector<AnyScalar>& v) {
+  int n = v.size();
   switch (AnyScalar::type(v)) {
-    case TENSOR_DOUBLE: return DT(AnyScalar::as_double(v), {static_cast<int>(v.size())});
-    case TENSOR_SX: return ST(SX::vertcat(AnyScalar::as_SX(v)), {static_cast<int>(v.size())});
+    case TENSOR_DOUBLE:
+      {
+        // Fill the numeric storage in place, no per-element conversion
+        DM r = DM::zeros(n, 1);
+        double* d = r.ptr();
+        for (int i=0;i<n;++i) {
+          tensor_assert(v[i].t==TENSOR_DOUBLE);
+          d[i] = v[i].data_double;
+        }
+        return DT(std::move(r), {n});
+      }
+    case TENSOR_SX:
+      {
+        // Scalar entries are gathered directly; doubles become constants
+        SX r = SX::zeros(n, 1);
+        for (int i=0;i<n;++i) {
+          if (v[i].t==TENSOR_SX) {
+            r.nz(i) = v[i].data_sx;
+          } else {
+            tensor_assert(v[i].t==TENSOR_DOUBLE);
+            r.nz(i) = SX(v[i].data_double);
+          }
+        }
+        return ST(std::move(r), {n});
+      }
     case TENSOR_MX: return MT(MX::vertcat(AnyScalar::as_MX(v)), {static_cast<int>(v.size())});
     default: tensor_assert(false); return DT();
   }
@@ -1,6 +1,7 @@
 #ifndef ANY_TENSOR_HPP_INCLUDE
 #define ANY_TENSOR_HPP_INCLUDE
 
+#include <utility>
 #include "tensor.hpp"
 
 
@@ -9,6 +10,8 @@ enum TensorType {TENSOR_NULL, TENSOR_DOUBLE, TENSOR_SX, TENSOR_MX};
 
 
 #define ANYSCALAR_BINARY_OP(OP) \
+if (x.t==TENSOR_DOUBLE && y.t==TENSOR_DOUBLE) \
+  return AnyScalar(static_cast<double>(x.data_double OP y.data_double)); \
 switch (AnyScalar::merge(x.t, y.t)) { \
   case TENSOR_DOUBLE: \
     return x.as_double() OP y.as_double();break; \
@@ -20,35 +23,51 @@ switch (AnyScalar::merge(x.t, y.t)) { \
      assert(false); return 0;\
 }
 
-#define ANYTENSOR_BINARY(X, Y, FUN) \
-switch (AnyScalar::merge(X.t, Y.t)) { \
-  case TENSOR_DOUBLE: \
-    return X.as_DT().FUN(Y.as_DT()); \
-  case TENSOR_SX: \
-    return X.as_ST().FUN(Y.as_ST()); \
-  case TENSOR_MX: \
-    return X.as_MT().FUN(Y.as_MT()); \
-  default:\
-     assert(false); return DT();\
-}
-
-#define ANYTENSOR_METHOD(METHOD) \
-if (is_DT()) return as_DT().METHOD; \
-if (is_ST()) return as_ST().METHOD; \
-if (is_MT()) return as_MT().METHOD; \
-tensor_assert(false);
+/** \brief Scalar of any of the types double, SX or MX
 
+  Only the active value is constructed. The double case is handled inline,
+  so pure numeric arithmetic never touches a casadi object.
+*/
 class AnyScalar {
 
   public:
 #ifndef SWIG
-    AnyScalar& operator=(const AnyScalar&);
+    AnyScalar& operator=(const AnyScalar& s) {
+      if (t==TENSOR_DOUBLE && s.t==TENSOR_DOUBLE) {
+        data_double = s.data_double;
+        return *this;
+      }
+      return assign(s);
+    }
+    AnyScalar& operator=(AnyScalar&& s) {
+      if (t==TENSOR_DOUBLE && s.t==TENSOR_DOUBLE) {
+        data_double = s.data_double;
+        return *this;
+      }
+      return assign(std::move(s));
+    }
+    AnyScalar(AnyScalar&& s) : t(TENSOR_NULL) {
+      switch (s.t) {
+        case TENSOR_DOUBLE: t = TENSOR_DOUBLE; data_double = s.data_double; break;
+        case TENSOR_NULL: break;
+        default: construct(std::move(s));
+      }
+    }
 #endif
-    AnyScalar(const AnyScalar& s);
-    AnyScalar(double s);
+    AnyScalar(const AnyScalar& s) : t(TENSOR_NULL) {
+      switch (s.t) {
+        case TENSOR_DOUBLE: t = TENSOR_DOUBLE; data_double = s.data_double; break;
+        case TENSOR_NULL: break;
+        default: construct(s);
+      }
+    }
+    AnyScalar(double s) : t(TENSOR_DOUBLE), data_double(s) {}
     AnyScalar(const SX& s);
     AnyScalar(const MX& s);
-    AnyScalar();
+    AnyScalar() : t(TENSOR_NULL), data_double(0) {}
+    ~AnyScalar() {
+      if (t==TENSOR_SX || t==TENSOR_MX) clear();
+    }
 
 #ifndef SWIG
     explicit operator double() const;
@@ -110,18 +129,45 @@ class AnyScalar {
     static bool is_MX(const std::vector<AnyScalar>& v) {return type(v)==TENSOR_MX;}
 
   private:
+    friend class AnyTensor;
+#ifndef SWIG
+    /// Construct the active value of s; *this must hold no SX or MX
+    void construct(const AnyScalar& s);
+    void construct(AnyScalar&& s);
+    AnyScalar& assign(const AnyScalar& s);
+    AnyScalar& assign(AnyScalar&& s);
+#endif
+    /// Destroy the active value, leaving TENSOR_NULL
+    void clear();
+
     TensorType t;
-    double data_double;
-    SX data_sx;
-    MX data_mx;
+    union {
+      double data_double;
+      SX data_sx;
+      MX data_mx;
+    };
 };
 
 AnyScalar pow(const AnyScalar&x, int i);
 
+/** \brief Tensor of any of the types DT, ST or MT
+
+  Only the active tensor is constructed; the other members of the union
+  are never accessed.
+  Operations dispatch on the active type through visit().
+*/
 class AnyTensor {
   public:
 #ifndef SWIG
     AnyTensor& operator=(const AnyTensor&);
+    AnyTensor& operator=(AnyTensor&&);
+    AnyTensor(AnyTensor&& s);
+    AnyTensor(DT&& t);
+    AnyTensor(ST&& t);
+    AnyTensor(MT&& t);
+    /// Evaluate an elementwise expression
+    template <class T, class E>
+    AnyTensor(const TensorExpr<T, E>& e) : AnyTensor(Tensor<T>(e)) {}
 #endif
     AnyTensor(const AnyScalar& s);
     AnyTensor(const AnyTensor& s);
@@ -131,6 +177,7 @@ class AnyTensor {
     AnyTensor(const MT & t);
     static AnyTensor unity();
     AnyTensor();
+    ~AnyTensor();
     bool is_DT() const;
     bool is_ST() const;
     bool is_MT() const;
@@ -152,55 +199,57 @@ class AnyTensor {
     explicit operator DT() const;
     explicit operator ST() const;
     explicit operator MT() const;
+
+    /** \brief Call f with the active tensor
+    *
+    *   f must accept a DT, an ST and an MT, with a common return type.
+    */
+    template <class F>
+    auto visit(F f) const -> decltype(f(std::declval<const DT&>())) {
+      switch (t) {
+        case TENSOR_DOUBLE: return f(data_double);
+        case TENSOR_SX: return f(data_sx);
+        case TENSOR_MX: return f(data_mx);
+        default: tensor_assert_message(false, "AnyTensor holds no tensor");
+      }
+      return f(DT());
+    }
+
+    /** \brief Call f with both tensors, converted to their common type
+    */
+    template <class F>
+    static auto visit(const AnyTensor& x, const AnyTensor& y, F f) ->
+        decltype(f(std::declval<const DT&>(), std::declval<const DT&>())) {
+      switch (AnyScalar::merge(x.t, y.t)) {
+        case TENSOR_DOUBLE: return f(x.as_DT(), y.as_DT());
+        case TENSOR_SX: return f(x.as_ST(), y.as_ST());
+        case TENSOR_MX: return f(x.as_MT(), y.as_MT());
+        default: tensor_assert_message(false, "AnyTensor holds no tensor");
+      }
+      return f(DT(), DT());
+    }
 #endif
     static AnyTensor vertcat(const std::vector<AnyScalar>& v);
     static AnyTensor concat(const std::vector<AnyTensor>& v, int axis);
 
     static AnyTensor pack(const std::vector<AnyTensor>& v, int axis);
+    static AnyTensor einsum(const std::vector<AnyTensor>& v,
+      const std::vector< std::vector<int> >& labels, const std::vector<int>& c);
     static std::vector<AnyTensor> unpack(const AnyTensor& v, int axis);
 
-    AnyTensor reorder_dims(const std::vector<int>& order) const {
-      ANYTENSOR_METHOD(reorder_dims(order));
-      return DT();
-    }
-    AnyTensor shape(const std::vector<int>& dims) const {
-      ANYTENSOR_METHOD(shape(dims));
-      return DT();
-    }
-    AnyTensor operator-() const {
-      ANYTENSOR_METHOD(operator-());
-      return DT();
-    }
-    std::vector<int> dims() const {
-      ANYTENSOR_METHOD(dims());
-      return std::vector<int>();
-    }
-    int n_dims() const {
-      ANYTENSOR_METHOD(n_dims());
-      return 0;
-    }
-
-    AnyTensor operator>=(const AnyTensor &b) const {
-      ANYTENSOR_BINARY((*this), b, operator>=);
-    }
-    AnyTensor operator<=(const AnyTensor &b) const {
-      ANYTENSOR_BINARY((*this), b, operator<=);
-    }
-    AnyTensor outer_product(const AnyTensor &b) const {
-      ANYTENSOR_BINARY((*this), b, outer_product);
-    }
-    AnyTensor inner(const AnyTensor&b) const {
-      ANYTENSOR_BINARY((*this), b, inner);
-    }
-    AnyTensor solve(const AnyTensor&b) const {
-      ANYTENSOR_BINARY((*this), b, solve);
-    }
-    AnyTensor operator+(const AnyTensor&b) const {
-      ANYTENSOR_BINARY((*this), b, operator+);
-    }
-    AnyTensor operator*(const AnyTensor&b) const {
-      ANYTENSOR_BINARY((*this), b, operator*);
-    }
+    AnyTensor reorder_dims(const std::vector<int>& order) const;
+    AnyTensor shape(const std::vector<int>& dims) const;
+    AnyTensor operator-() const;
+    std::vector<int> dims() const;
+    int n_dims() const;
+
+    AnyTensor operator>=(const AnyTensor &b) const;
+    AnyTensor operator<=(const AnyTensor &b) const;
+    AnyTensor outer_product(const AnyTensor &b) const;
+    AnyTensor inner(const AnyTensor&b) const;
+    AnyTensor solve(const AnyTensor&b) const;
+    AnyTensor operator+(const AnyTensor&b) const;
+    AnyTensor operator*(const AnyTensor&b) const;
     AnyTensor& operator+=(const AnyTensor&b) {
       return this->operator=((*this) + b);
     }
@@ -214,27 +263,32 @@ class AnyTensor {
         }
     #endif // SWIG
 
-    std::string getRepresentation() const {
-      if (is_DT()) return "AnyTensor:" + as_DT().getRepresentation();
-      if (is_ST()) return "AnyTensor:" + as_ST().getRepresentation();
-      if (is_MT()) return "AnyTensor:" + as_MT().getRepresentation();
-      return "";
-    }
+    std::string getRepresentation() const;
 
 
   private:
+#ifndef SWIG
+    /// Construct the active tensor of s; *this must hold none
+    void construct(const AnyTensor& s);
+    void construct(AnyTensor&& s);
+#endif
+    /// Destroy the active tensor, leaving TENSOR_NULL
+    void clear();
+
     TensorType t;
-    DT data_double;
-    ST data_sx;
-    MT data_mx;
+    union {
+      DT data_double;
+      ST data_sx;
+      MT data_mx;
+    };
 };
 
 
 AnyTensor vertcat(const std::vector<AnyScalar> & v);
 AnyTensor vertcat(const std::vector<double> & v);
+AnyTensor concat(const std::vector<AnyTensor> & v, int axis);
+std::vector<AnyTensor> unpack(const AnyTensor& v, int axis);
 
 #undef ANYSCALAR_BINARY_OP
-#undef ANYTENSOR_BINARY
-#undef ANYTENSOR_METHOD
 
 #endif
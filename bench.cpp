@@ -0,0 +1,241 @@
+#include <tensor.hpp>
+#include <tensor_function.hpp>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+
+// Count heap allocations made by the benchmarked operations
+std::atomic<long> n_allocations(0);
+
+void* operator new(std::size_t n) {
+  n_allocations++;
+  void* p = std::malloc(n ? n : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+struct Result {
+  std::string op;
+  std::string type;
+  int rank;
+  int numel;
+  int reps;
+  double time_us;
+  double throughput;
+  double allocations;
+  int graph_size;
+  double function_us;
+};
+
+static std::vector<Result> results;
+
+double seconds_since(const Clock::time_point& t0) {
+  return std::chrono::duration<double>(Clock::now()-t0).count();
+}
+
+/// Repeat f for at least min_time seconds; returns {seconds per call, allocations per call, calls}
+std::vector<double> measure(const std::function<void()>& f, double min_time) {
+  f();
+  int reps = 0;
+  long before = n_allocations;
+  Clock::time_point t0 = Clock::now();
+  do {
+    f();
+    reps++;
+  } while (seconds_since(t0)<min_time);
+  double t = seconds_since(t0);
+  return {t/reps, static_cast<double>(n_allocations-before)/reps, static_cast<double>(reps)};
+}
+
+/// Number of elementary operations (SX) or nodes (MX) in f
+int graph_size(const Function& f) {
+  if (f.is_a("SXFunction")) return f.n_instructions();
+  return f.n_nodes();
+}
+
+template <class T>
+std::string type_name();
+template <> std::string type_name<DM>() { return "DT"; }
+template <> std::string type_name<SX>() { return "ST"; }
+template <> std::string type_name<MX>() { return "MT"; }
+
+template <class T>
+Tensor<T> operand(const std::string& name, const std::vector<int>& dims, int seed);
+
+template <>
+Tensor<DM> operand(const std::string& name, const std::vector<int>& dims, int seed) {
+  std::vector<double> v(product(dims));
+  for (int i=0;i<v.size();++i) v[i] = std::sin(i+seed);
+  return Tensor<DM>(DM(v), dims);
+}
+
+template <>
+Tensor<SX> operand(const std::string& name, const std::vector<int>& dims, int seed) {
+  return Tensor<SX>::sym(name, dims);
+}
+
+template <>
+Tensor<MX> operand(const std::string& name, const std::vector<int>& dims, int seed) {
+  return Tensor<MX>::sym(name, dims);
+}
+
+template <class T>
+void record(const std::string& op, const std::vector<int>& dims, const Tensor<T>& a,
+    const Tensor<T>& b, const std::function<Tensor<T>()>& f, double min_time) {
+  Tensor<T> r;
+  std::vector<double> m = measure([&]() { r = f(); }, min_time);
+
+  Result res;
+  res.op = op;
+  res.type = type_name<T>();
+  res.rank = dims.size();
+  res.numel = product(dims);
+  res.reps = m[2];
+  res.time_us = m[0]*1e6;
+  res.throughput = res.numel/m[0];
+  res.allocations = m[1];
+  res.graph_size = -1;
+  res.function_us = -1;
+
+  if (!std::is_same<T, DM>::value) {
+    // Inputs must be purely symbolic: use the operands themselves
+    Clock::time_point t0 = Clock::now();
+    Function fun("f", std::vector<T>{a.data(), b.data()}, std::vector<T>{r.data()});
+    res.function_us = seconds_since(t0)*1e6;
+    res.graph_size = graph_size(fun);
+  }
+  results.push_back(res);
+}
+
+/// Numeric evaluation of a TensorFunction, allocating and into preallocated outputs
+template <class T>
+void bench_function(const std::vector<int>& dims, double min_time) {
+  int r = dims.size();
+  Tensor<T> a = operand<T>("a", dims, 0);
+  Tensor<T> b = operand<T>("b", dims, 1);
+  TensorFunction f("f", std::vector< Tensor<T> >{a, b},
+    std::vector< Tensor<T> >{Tensor<T>((a+b)*a-b)});
+  std::vector<DT> args = {operand<DM>("a", dims, 0), operand<DM>("b", dims, 1)};
+  std::vector<DT> res;
+
+  auto add = [&](const std::string& op, const std::vector<double>& m) {
+    Result rs;
+    rs.op = op;
+    rs.type = type_name<T>();
+    rs.rank = r;
+    rs.numel = product(dims);
+    rs.reps = m[2];
+    rs.time_us = m[0]*1e6;
+    rs.throughput = rs.numel/m[0];
+    rs.allocations = m[1];
+    rs.graph_size = graph_size(f.function());
+    rs.function_us = -1;
+    results.push_back(rs);
+  };
+  add("function_call", measure([&]() { res = f(args); }, min_time));
+  add("function_eval", measure([&]() { f.eval(args, res); }, min_time));
+}
+
+template <class T>
+void bench_type(const std::vector<int>& dims, double min_time) {
+  int r = dims.size();
+  Tensor<T> a = operand<T>("a", dims, 0);
+  Tensor<T> b = operand<T>("b", dims, 1);
+
+  // Contract the last axis of a with the first axis of b
+  std::vector<int> la = mrange(r);
+  std::vector<int> lb = mrange(r-1, 2*r-1);
+  std::vector<int> lc = mrange(r-1);
+  std::vector<int> lc2 = mrange(r, 2*r-1);
+  lc.insert(lc.end(), lc2.begin(), lc2.end());
+
+  std::vector<int> reversed(r);
+  for (int i=0;i<r;++i) reversed[i] = r-1-i;
+  std::vector<int> first(r, -1);
+  first[0] = 0;
+
+  // Contracting one axis of each operand gives numel^2/extent^2 entries
+  double numel_c = static_cast<double>(product(dims))*product(dims)/(dims.front()*dims.back());
+  if (numel_c<=1e6) {
+    record<T>("einstein", dims, a, b, [&]() { return a.einstein(b, la, lb, lc); }, min_time);
+  }
+  record<T>("reorder_dims", dims, a, b, [&]() { return Tensor<T>(a.reorder_dims(reversed)); }, min_time);
+  record<T>("index", dims, a, b, [&]() { return Tensor<T>(a.index(first)); }, min_time);
+  if (numel_c<=1e6) {
+    record<T>("partial_product", dims, a, b, [&]() { return a.partial_product(b); }, min_time);
+  }
+  record<T>("inner", dims, a, b, [&]() { return a.inner(b); }, min_time);
+  if (product(dims)<=1000) {
+    record<T>("outer_product", dims, a, b, [&]() { return a.outer_product(b); }, min_time);
+  }
+  record<T>("pack", dims, a, b,
+    [&]() { return Tensor<T>::pack(std::vector< Tensor<T> >(16, a), 0); }, min_time);
+  record<T>("elementwise", dims, a, b, [&]() { return Tensor<T>((a+b)*a-b); }, min_time);
+}
+
+void print_csv() {
+  std::cout << "op,type,rank,numel,reps,time_us,throughput_per_s,allocations_per_op,"
+    "graph_size,function_us" << std::endl;
+  for (auto& r : results) {
+    std::cout << r.op << "," << r.type << "," << r.rank << "," << r.numel << "," << r.reps << ","
+      << r.time_us << "," << r.throughput << "," << r.allocations << "," << r.graph_size << ","
+      << r.function_us << std::endl;
+  }
+}
+
+void print_json() {
+  std::cout << "[" << std::endl;
+  for (int i=0;i<results.size();++i) {
+    const Result& r = results[i];
+    std::cout << "  {\"op\": \"" << r.op << "\", \"type\": \"" << r.type << "\", \"rank\": " << r.rank
+      << ", \"numel\": " << r.numel << ", \"reps\": " << r.reps << ", \"time_us\": " << r.time_us
+      << ", \"throughput_per_s\": " << r.throughput << ", \"allocations_per_op\": " << r.allocations
+      << ", \"graph_size\": " << r.graph_size << ", \"function_us\": " << r.function_us << "}"
+      << (i+1<results.size() ? "," : "") << std::endl;
+  }
+  std::cout << "]" << std::endl;
+}
+
+/** Usage: tensor_bench [csv|json] [min_time_seconds]
+
+  Numeric rows report time per op, entries per second and allocations per op.
+  Symbolic rows additionally report the size of the resulting graph and the
+  time to construct a casadi Function from it; -1 marks fields that do not apply.
+*/
+int main(int argc, char* argv[]) {
+  bool json = argc>1 && std::strcmp(argv[1], "json")==0;
+  double min_time = argc>2 ? std::atof(argv[2]) : 0.2;
+
+  // Shapes per rank, with cubic extents
+  std::vector< std::vector<int> > numeric = {
+    {10, 10}, {100, 100}, {1000, 1000},
+    {5, 5, 5}, {20, 20, 20}, {100, 100, 100},
+    {4, 4, 4, 4}, {10, 10, 10, 10}, {30, 30, 30, 30}};
+  std::vector< std::vector<int> > symbolic = {
+    {4, 4}, {10, 10}, {30, 30},
+    {3, 3, 3}, {6, 6, 6},
+    {3, 3, 3, 3}, {4, 4, 4, 4}};
+
+  for (auto& d : numeric) bench_type<DM>(d, min_time);
+  for (auto& d : symbolic) bench_type<SX>(d, min_time);
+  for (auto& d : symbolic) bench_type<MX>(d, min_time);
+  for (auto& d : symbolic) bench_function<SX>(d, min_time);
+  for (auto& d : symbolic) bench_function<MX>(d, min_time);
+
+  if (json) {
+    print_json();
+  } else {
+    print_csv();
+  }
+  return 0;
+}
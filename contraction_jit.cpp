@@ -0,0 +1,201 @@
+#include "contraction_jit.hpp"
+#include "dense_kernels.hpp"
+#include "private_dir.hpp"
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <unistd.h>
+
+namespace {
+  struct Library {
+    void* handle;
+    ContractionKernel::Function f;
+  };
+
+  typedef std::map< ArenaVector<int>, Library > KernelCache;
+
+  KernelCache& kernel_cache() {
+    static KernelCache cache;
+    return cache;
+  }
+
+  std::mutex& kernel_mutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  std::atomic<bool> jit_enabled(false);
+
+  std::string& dir_setting() {
+    static std::string dir;
+    return dir;
+  }
+
+  std::string& compiler_setting() {
+    static std::string command;
+    return command;
+  }
+
+  void append(ArenaVector<int>& key, const std::vector<int>& v) {
+    key.push_back(v.size());
+    key.insert(key.end(), v.begin(), v.end());
+  }
+
+  /// Everything the generated source depends on
+  ArenaVector<int> signature(const ContractionPlan& plan) {
+    ArenaVector<int> key;
+    append(key, plan.extents());
+    append(key, plan.strides_a());
+    append(key, plan.strides_b());
+    append(key, plan.strides_c());
+    key.push_back(plan.offset_a());
+    key.push_back(plan.offset_b());
+    return key;
+  }
+
+  /// Linear index expression: offset + sum_j i_j*stride[j]
+  std::string index_expr(int offset, const std::vector<int>& stride) {
+    std::stringstream ss;
+    ss << offset;
+    for (int j=0;j<stride.size();++j) {
+      if (stride[j]!=0) ss << "+" << stride[j] << "*i" << j;
+    }
+    return ss.str();
+  }
+
+  void* load(const std::string& path, ContractionKernel::Function& f) {
+    void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) return nullptr;
+    f = reinterpret_cast<ContractionKernel::Function>(dlsym(handle, "tensortools_contract"));
+    if (!f) {
+      dlclose(handle);
+      return nullptr;
+    }
+    return handle;
+  }
+}
+
+std::string ContractionKernel::source(const ContractionPlan& plan) {
+  const std::vector<int>& extents = plan.extents();
+  int n = extents.size();
+
+  std::stringstream ss;
+  // Rounded as dense_contract does
+  bool fused = dense_fma();
+  if (fused) ss << "#include <math.h>\n";
+  ss << "void tensortools_contract(const double* a, const double* b, double* c) {\n";
+  for (int j=0;j<n;++j) ss << "  int i" << j << ";\n";
+  // Slowest varying label outermost, as in ContractionPlan::for_each
+  std::string indent = "  ";
+  for (int j=n-1;j>=0;--j) {
+    ss << indent << "for (i" << j << "=0;i" << j << "<" << extents[j] << ";++i" << j << ")\n";
+    indent+= "  ";
+  }
+  std::string c = "c[" + index_expr(0, plan.strides_c()) + "]";
+  std::string a = "a[" + index_expr(plan.offset_a(), plan.strides_a()) + "]";
+  std::string b = "b[" + index_expr(plan.offset_b(), plan.strides_b()) + "]";
+  if (fused) {
+    ss << indent << c << " = fma(" << a << ", " << b << ", " << c << ");\n";
+  } else {
+    ss << indent << c << " += " << a << "*" << b << ";\n";
+  }
+  ss << "}\n";
+  return ss.str();
+}
+
+ContractionKernel::Function ContractionKernel::get(const ContractionPlan& plan) {
+  TensorArena scratch;
+  ArenaVector<int> key = signature(plan);
+
+  std::lock_guard<std::mutex> lock(kernel_mutex());
+  KernelCache& cache = kernel_cache();
+  auto it = cache.find(key);
+  if (it!=cache.end()) return it->second.f;
+
+  std::string code = source(plan);
+  std::string command = compiler();
+  std::string dir = cache_dir();
+  // Kernels built by another compiler or with other flags are never reused
+  std::string base = dir + "/contract_" + stable_hash(command + "\n" + code);
+  std::string lib = base + ".so";
+
+  Library l = {nullptr, nullptr};
+  // Libraries are only loaded from a directory no other user can write to
+  bool safe = make_private_dir(dir);
+  if (safe) l.handle = load(lib, l.f);
+  if (safe && !l.handle) {
+    // Build under private names, then publish atomically for concurrent processes
+    std::string tmp_c = base + ".XXXXXX.c";
+    std::string tmp_so = base + ".XXXXXX.so";
+    int fd_c = mkstemps(&tmp_c[0], 2);
+    int fd_so = fd_c>=0 ? mkstemps(&tmp_so[0], 3) : -1;
+    bool published = false;
+    if (fd_so>=0) {
+      close(fd_so);
+      std::string cmd = command + " -o " + shell_quote(tmp_so) + " " + shell_quote(tmp_c);
+      if (write(fd_c, code.data(), code.size())==static_cast<ssize_t>(code.size()) && std::system(cmd.c_str())==0 &&
+          std::rename(tmp_so.c_str(), lib.c_str())==0) {
+        published = true;
+        l.handle = load(lib, l.f);
+      }
+      if (!published) std::remove(tmp_so.c_str());
+    }
+    if (fd_c>=0) {
+      close(fd_c);
+      std::remove(tmp_c.c_str());
+    }
+  }
+
+  // Failures are remembered too, so that compilation is attempted once
+  cache[key] = l;
+  return l.f;
+}
+
+void ContractionKernel::set_enabled(bool enabled) {
+  jit_enabled = enabled;
+}
+
+bool ContractionKernel::enabled() {
+  return jit_enabled;
+}
+
+void ContractionKernel::set_cache_dir(const std::string& dir) {
+  std::lock_guard<std::mutex> lock(kernel_mutex());
+  dir_setting() = dir;
+}
+
+std::string ContractionKernel::cache_dir() {
+  if (!dir_setting().empty()) return dir_setting();
+  return env_or("TENSORTOOLS_JIT_DIR", user_cache_dir("jit"));
+}
+
+void ContractionKernel::set_compiler(const std::string& command) {
+  std::lock_guard<std::mutex> lock(kernel_mutex());
+  compiler_setting() = command;
+}
+
+std::string ContractionKernel::compiler() {
+  if (!compiler_setting().empty()) return compiler_setting();
+  // fma() is only inlined for processors known to have the instruction
+  return env_or("TENSORTOOLS_JIT_CC", dense_fma() ? "cc -O3 -shared -fPIC -mfma" :
+    "cc -O3 -shared -fPIC -ffp-contract=off");
+}
+
+void ContractionKernel::clear_cache() {
+  std::lock_guard<std::mutex> lock(kernel_mutex());
+  for (auto& e : kernel_cache()) {
+    if (e.second.handle) dlclose(e.second.handle);
+  }
+  kernel_cache().clear();
+}
+
+int ContractionKernel::cache_size() {
+  std::lock_guard<std::mutex> lock(kernel_mutex());
+  return kernel_cache().size();
+}
@@ -0,0 +1,65 @@
+#ifndef CONTRACTION_JIT_HPP_INCLUDE
+#define CONTRACTION_JIT_HPP_INCLUDE
+
+#include <string>
+#include "contraction_plan.hpp"
+
+/** \brief Numeric contraction kernels compiled for a fixed plan
+
+  For a ContractionPlan, a C function is generated whose loop bounds,
+  strides and offsets are all constants. It is compiled into a shared
+  library with the system compiler and loaded with dlopen.
+
+  Libraries are kept in a cache directory, named after a hash of their
+  source and the compiler command, so that later processes load them
+  without compiling. Kernels already loaded are looked up by the plan
+  signature. Nothing is loaded from a cache directory that is not owned by
+  the user or that group or others can write to.
+
+  Disabled by default. When enabled, serial numeric contractions use the
+  compiled kernel; if compilation fails, they fall back to dense_contract.
+*/
+class ContractionKernel {
+  public:
+    /// c += A_a * B_b, with a, b and c pointing at the start of the views
+    typedef void (*Function)(const double* a, const double* b, double* c);
+
+    /** \brief Kernel for a plan, compiled or loaded on first use
+    *
+    *   Returns null if it could not be built.
+    */
+    static Function get(const ContractionPlan& plan);
+
+    /// C source of the kernel for a plan
+    static std::string source(const ContractionPlan& plan);
+
+    static void set_enabled(bool enabled);
+    static bool enabled();
+
+    /** \brief Directory holding the compiled kernels
+    *
+    *   Defaults to $TENSORTOOLS_JIT_DIR, or $XDG_CACHE_HOME/tensortools/jit
+    *   (~/.cache/tensortools/jit). Created with mode 0700.
+    */
+    static void set_cache_dir(const std::string& dir);
+    static std::string cache_dir();
+
+    /** \brief Command compiling a C file into a shared library
+    *
+    *   Invoked as "<command> -o <library> <source>".
+    *   Defaults to $TENSORTOOLS_JIT_CC, or "cc -O3 -shared -fPIC" followed by
+    *   -mfma where the processor has FMA instructions (see dense_fma), and by
+    *   -ffp-contract=off elsewhere. Kernels accumulate with fma() from math.h
+    *   exactly when dense_fma() holds; a command without -mfma then makes it
+    *   a library call, correct but slow.
+    */
+    static void set_compiler(const std::string& command);
+    static std::string compiler();
+
+    /// Unload all kernels; libraries on disk are kept
+    static void clear_cache();
+    /// Number of loaded kernels
+    static int cache_size();
+};
+
+#endif
@@ -0,0 +1,584 @@
+#include "contraction_plan.hpp"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+
+namespace {
+  struct CachedPlan {
+    std::shared_ptr<const ContractionPlan> plan;
+    /// Position in PlanCache::use
+    std::list<const ArenaVector<int>*>::iterator use;
+  };
+
+  /// Plans by signature, bounded in bytes; the plan cache lock must be held
+  struct PlanCache {
+    /// Keys are copied to the heap on insertion, see ArenaAllocator
+    std::map< ArenaVector<int>, CachedPlan > plans;
+    /// Keys of plans, most recently used first
+    std::list<const ArenaVector<int>*> use;
+    std::size_t bytes = 0;
+
+    /// Drop least recently used plans beyond capacity bytes
+    void trim(std::size_t capacity) {
+      while (bytes>capacity) {
+        auto it = plans.find(*use.back());
+        bytes-= it->second.plan->bytes();
+        use.pop_back();
+        plans.erase(it);
+      }
+    }
+
+    void clear() {
+      use.clear();
+      plans.clear();
+      bytes = 0;
+    }
+  };
+
+  PlanCache& plan_cache() {
+    static PlanCache cache;
+    return cache;
+  }
+
+  std::atomic<std::size_t> plan_cache_capacity(std::size_t(1) << 26);
+
+  std::mutex& plan_cache_mutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  std::atomic<int> n_threads(std::max(1u, std::thread::hardware_concurrency()));
+  std::atomic<int> threshold(1 << 16);
+
+  void append_signature(ArenaVector<int>& key, const std::vector<int>& v) {
+    key.push_back(v.size());
+    key.insert(key.end(), v.begin(), v.end());
+  }
+
+  int numel(const std::vector<int>& dims) {
+    return std::accumulate(dims.begin(), dims.end(), 1, std::multiplies<int>());
+  }
+
+  /** Linear indices visited by a column-major walk over the given labels
+
+    Returns an empty vector if the walk is the identity 0, 1, ..., numel-1
+  */
+  std::vector<int> walk_indices(const std::vector<int>& labels, const std::vector<int>& extents,
+      const std::vector<int>& strides, int offset, int numel) {
+    int n = 1;
+    for (int l : labels) n*= extents[l];
+    std::vector<int> ret(n);
+    std::vector<int> ind(labels.size(), 0);
+    int sub = offset;
+    bool identity = true;
+    for (int i=0;i<n;++i) {
+      ret[i] = sub;
+      identity = identity && sub==i;
+      for (int j=0;j<labels.size();++j) {
+        int l = labels[j];
+        if (++ind[j]<extents[l]) {
+          sub+= strides[l];
+          break;
+        }
+        ind[j] = 0;
+        sub-= strides[l]*(extents[l]-1);
+      }
+    }
+    if (identity && n==numel) ret.clear();
+    return ret;
+  }
+
+  /// Positions of the labels, sorted by first occurrence in e
+  std::vector<int> by_occurrence(const std::vector<int>& e, const std::vector<int>& labels,
+      const std::vector<int>& selection) {
+    std::vector<int> ret;
+    for (int ei : e) {
+      for (int s : selection) {
+        if (labels[s]==ei && std::find(ret.begin(), ret.end(), s)==ret.end()) ret.push_back(s);
+      }
+    }
+    return ret;
+  }
+}
+
+ContractionPlan::ContractionPlan(const std::vector<int>& dims_a, const std::vector<int>& dims_b,
+    const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c) {
+  init(dims_a, contiguous_strides(dims_a), dims_b, contiguous_strides(dims_b), a, b, c);
+}
+
+ContractionPlan::ContractionPlan(const std::vector<int>& dims_a, const std::vector<int>& strides_a,
+    const std::vector<int>& dims_b, const std::vector<int>& strides_b,
+    const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c) {
+  init(dims_a, strides_a, dims_b, strides_b, a, b, c);
+}
+
+void ContractionPlan::init(const std::vector<int>& dims_a, const std::vector<int>& strides_a,
+    const std::vector<int>& dims_b, const std::vector<int>& strides_b,
+    const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c) {
+  offset_a_ = 0;
+  offset_b_ = 0;
+  n_iter_ = 1;
+
+  // Dimension check
+  tensor_assert(dims_a.size()==a.size());
+  tensor_assert(dims_b.size()==b.size());
+  tensor_assert(strides_a.size()==a.size());
+  tensor_assert(strides_b.size()==b.size());
+
+  tensor_assert(c.size()<=a.size()+b.size());
+
+  std::map<int, int> dim_map;
+
+  // Check if shared nodes dimensions match up
+  for (int i=0;i<a.size();++i) {
+    int ai = a[i];
+    if (ai>=0) {
+      tensor_assert(ai<dims_a[i]);
+      offset_a_+= ai*strides_a[i];
+    } else {
+      auto al = dim_map.find(ai);
+      if (al==dim_map.end()) {
+        dim_map[ai] = dims_a[i];
+      } else {
+        tensor_assert(al->second==dims_a[i]);
+      }
+    }
+  }
+
+  for (int i=0;i<b.size();++i) {
+    int bi = b[i];
+    if (bi>=0) {
+      tensor_assert(bi<dims_b[i]);
+      offset_b_+= bi*strides_b[i];
+    } else {
+      auto bl = dim_map.find(bi);
+      if (bl==dim_map.end()) {
+        dim_map[bi] = dims_b[i];
+      } else {
+        tensor_assert(bl->second==dims_b[i]);
+      }
+    }
+  }
+
+  for (int i=0;i<c.size();++i) {
+    int ci = c[i];
+    tensor_assert(ci<0);
+    auto cl = dim_map.find(ci);
+    tensor_assert(cl!=dim_map.end());
+    dims_.push_back(cl->second);
+  }
+
+  // Labels are walked in ascending order, like the original nested loop
+  for (const auto& e : dim_map) {
+    labels_.push_back(e.first);
+    extents_.push_back(e.second);
+    n_iter_*= e.second;
+  }
+
+  int n = labels_.size();
+  stride_a_.resize(n, 0);
+  stride_b_.resize(n, 0);
+  stride_c_.resize(n, 0);
+
+  // A label repeated within one operand contributes the sum of its strides
+  for (int i=0;i<a.size();++i) {
+    if (a[i]<0) stride_a_[std::distance(dim_map.begin(), dim_map.find(a[i]))]+= strides_a[i];
+  }
+  for (int i=0;i<b.size();++i) {
+    if (b[i]<0) stride_b_[std::distance(dim_map.begin(), dim_map.find(b[i]))]+= strides_b[i];
+  }
+  int cumprod = 1;
+  for (int i=0;i<c.size();++i) {
+    stride_c_[std::distance(dim_map.begin(), dim_map.find(c[i]))]+= cumprod;
+    cumprod*= dims_[i];
+  }
+
+  init_gemm(dims_a, dims_b, a, b, c);
+}
+
+void ContractionPlan::init_gemm(const std::vector<int>& dims_a, const std::vector<int>& dims_b,
+    const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c) {
+  gemm_ = true;
+  gemm_m_ = gemm_k_ = gemm_n_ = gemm_batch_ = 1;
+
+  // Classify the labels
+  std::vector<int> free_a, free_b, contracted, batch;
+  for (int i=0;i<labels_.size();++i) {
+    int l = labels_[i];
+    int na = std::count(a.begin(), a.end(), l);
+    int nb = std::count(b.begin(), b.end(), l);
+    int nc = std::count(c.begin(), c.end(), l);
+    if (nc>1) {
+      gemm_ = false;
+    } else if (na && nb && nc) {
+      batch.push_back(i);
+    } else if (na && nc) {
+      free_a.push_back(i);
+    } else if (nb && nc) {
+      free_b.push_back(i);
+    } else if (na && nb) {
+      contracted.push_back(i);
+    } else {
+      // Summation over a label of a single operand
+      gemm_ = false;
+    }
+  }
+  if (!gemm_) return;
+
+  // Keep operand order within each group, so that common layouts need no gather
+  free_a = by_occurrence(a, labels_, free_a);
+  free_b = by_occurrence(b, labels_, free_b);
+  contracted = by_occurrence(a, labels_, contracted);
+  batch = by_occurrence(a, labels_, batch);
+
+  for (int l : free_a) gemm_m_*= extents_[l];
+  for (int l : contracted) gemm_k_*= extents_[l];
+  for (int l : free_b) gemm_n_*= extents_[l];
+  for (int l : batch) gemm_batch_*= extents_[l];
+
+  std::vector<int> order_a = free_a;
+  order_a.insert(order_a.end(), contracted.begin(), contracted.end());
+  order_a.insert(order_a.end(), batch.begin(), batch.end());
+  gemm_index_a_ = walk_indices(order_a, extents_, stride_a_, offset_a_, numel(dims_a));
+
+  std::vector<int> order_b = contracted;
+  order_b.insert(order_b.end(), free_b.begin(), free_b.end());
+  order_b.insert(order_b.end(), batch.begin(), batch.end());
+  gemm_index_b_ = walk_indices(order_b, extents_, stride_b_, offset_b_, numel(dims_b));
+
+  std::vector<int> order_c = free_a;
+  order_c.insert(order_c.end(), free_b.begin(), free_b.end());
+  order_c.insert(order_c.end(), batch.begin(), batch.end());
+  std::vector<int> index_c = walk_indices(order_c, extents_, stride_c_, 0, numel(dims_));
+
+  // Invert: walk gives the position in C of each entry of C'
+  gemm_index_c_.resize(index_c.size());
+  for (int i=0;i<index_c.size();++i) gemm_index_c_[index_c[i]] = i;
+}
+
+std::shared_ptr<const ContractionPlan> ContractionPlan::get(
+    const std::vector<int>& dims_a, const std::vector<int>& dims_b,
+    const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c) {
+  return get(dims_a, contiguous_strides(dims_a), dims_b, contiguous_strides(dims_b), a, b, c);
+}
+
+std::shared_ptr<const ContractionPlan> ContractionPlan::get(
+    const std::vector<int>& dims_a, const std::vector<int>& strides_a,
+    const std::vector<int>& dims_b, const std::vector<int>& strides_b,
+    const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c) {
+  // The lookup key is scratch: a cache hit allocates nothing once the arena is warm
+  TensorArena scratch;
+  ArenaVector<int> key;
+  key.reserve(7+2*dims_a.size()+2*dims_b.size()+a.size()+b.size()+c.size());
+  append_signature(key, dims_a);
+  append_signature(key, strides_a);
+  append_signature(key, dims_b);
+  append_signature(key, strides_b);
+  append_signature(key, a);
+  append_signature(key, b);
+  append_signature(key, c);
+
+  std::lock_guard<std::mutex> lock(plan_cache_mutex());
+  PlanCache& cache = plan_cache();
+  auto it = cache.plans.find(key);
+  if (it!=cache.plans.end()) {
+    // Move to the front; iterators stay valid
+    cache.use.splice(cache.use.begin(), cache.use, it->second.use);
+    return it->second.plan;
+  }
+
+  std::shared_ptr<const ContractionPlan> plan =
+    std::make_shared<ContractionPlan>(dims_a, strides_a, dims_b, strides_b, a, b, c);
+  it = cache.plans.emplace(key, CachedPlan{plan, cache.use.end()}).first;
+  cache.use.push_front(&it->first);
+  it->second.use = cache.use.begin();
+  cache.bytes+= plan->bytes();
+  cache.trim(plan_cache_capacity);
+  return plan;
+}
+
+void ContractionPlan::clear_cache() {
+  std::lock_guard<std::mutex> lock(plan_cache_mutex());
+  plan_cache().clear();
+}
+
+int ContractionPlan::cache_size() {
+  std::lock_guard<std::mutex> lock(plan_cache_mutex());
+  return plan_cache().plans.size();
+}
+
+void ContractionPlan::set_cache_capacity(std::size_t bytes) {
+  std::lock_guard<std::mutex> lock(plan_cache_mutex());
+  plan_cache_capacity = bytes;
+  plan_cache().trim(bytes);
+}
+
+std::size_t ContractionPlan::cache_capacity() {
+  return plan_cache_capacity;
+}
+
+std::size_t ContractionPlan::cache_bytes() {
+  std::lock_guard<std::mutex> lock(plan_cache_mutex());
+  return plan_cache().bytes;
+}
+
+std::size_t ContractionPlan::bytes() const {
+  std::size_t n = dims_.size()+labels_.size()+extents_.size()+stride_a_.size()+
+    stride_b_.size()+stride_c_.size()+gemm_index_a_.size()+gemm_index_b_.size()+
+    gemm_index_c_.size();
+  return sizeof(ContractionPlan)+sizeof(int)*n;
+}
+
+std::vector<int> contiguous_strides(const std::vector<int>& dims) {
+  std::vector<int> ret(dims.size());
+  int cumprod = 1;
+  for (int i=0;i<dims.size();++i) {
+    ret[i] = cumprod;
+    cumprod*= dims[i];
+  }
+  return ret;
+}
+
+std::vector<int> strided_indices(const std::vector<int>& dims, const std::vector<int>& strides,
+    int offset) {
+  tensor_assert(dims.size()==strides.size());
+  std::vector<int> labels(dims.size());
+  std::iota(labels.begin(), labels.end(), 0);
+  // numel -1: never collapse to the empty identity marker
+  return walk_indices(labels, dims, strides, offset, -1);
+}
+
+std::vector<int> ContractionPlan::operand_labels(bool in_a) const {
+  const std::vector<int>& stride = in_a ? stride_a_ : stride_b_;
+  std::vector<int> order;
+  for (int j=0;j<stride.size();++j) {
+    if (stride[j]!=0) order.push_back(j);
+  }
+  std::stable_sort(order.begin(), order.end(),
+    [&](int i, int j) { return stride[i]>stride[j]; });
+  return order;
+}
+
+bool ContractionPlan::locate(int pos, bool in_a, const std::vector<int>& order,
+    int& sub_a, int& sub_b, int& sub_c) const {
+  const std::vector<int>& stride = in_a ? stride_a_ : stride_b_;
+  int rem = pos-(in_a ? offset_a_ : offset_b_);
+  if (rem<0) return false;
+  sub_a = offset_a_;
+  sub_b = offset_b_;
+  sub_c = 0;
+  for (int j : order) {
+    int i = rem/stride[j];
+    if (i>=extents_[j]) return false;
+    rem-= i*stride[j];
+    sub_a+= i*stride_a_[j];
+    sub_b+= i*stride_b_[j];
+    sub_c+= i*stride_c_[j];
+  }
+  return rem==0;
+}
+
+std::vector<int> strided_lookup(const std::vector<int>& dims, const std::vector<int>& strides,
+    int offset, const std::vector<int>& positions) {
+  tensor_assert(dims.size()==strides.size());
+  std::vector<int> order(dims.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+    [&](int i, int j) { return strides[i]>strides[j]; });
+  std::vector<int> cumprod = contiguous_strides(dims);
+
+  std::vector<int> ret(positions.size(), -1);
+  for (int k=0;k<positions.size();++k) {
+    int rem = positions[k]-offset;
+    if (rem<0) continue;
+    int sub = 0;
+    for (int j : order) {
+      int i = strides[j]==0 ? 0 : rem/strides[j];
+      if (i>=dims[j]) {
+        rem = -1;
+        break;
+      }
+      rem-= i*strides[j];
+      sub+= i*cumprod[j];
+    }
+    if (rem==0) ret[k] = sub;
+  }
+  return ret;
+}
+
+void ContractionPlan::set_num_threads(int n) {
+  tensor_assert(n>=1);
+  n_threads = n;
+}
+
+int ContractionPlan::num_threads() {
+  return n_threads;
+}
+
+void ContractionPlan::set_parallel_threshold(int n) {
+  threshold = n;
+}
+
+int ContractionPlan::parallel_threshold() {
+  return threshold;
+}
+
+namespace {
+  /// Union of two label lists, in order of first appearance
+  std::vector<int> merge_labels(const std::vector<int>& x, const std::vector<int>& y) {
+    std::vector<int> ret;
+    for (int l : x) if (std::find(ret.begin(), ret.end(), l)==ret.end()) ret.push_back(l);
+    for (int l : y) if (std::find(ret.begin(), ret.end(), l)==ret.end()) ret.push_back(l);
+    return ret;
+  }
+
+  bool has_label(const std::vector<int>& x, int l) {
+    return std::find(x.begin(), x.end(), l)!=x.end();
+  }
+}
+
+ContractionPath::ContractionPath(const std::vector< std::vector<int> >& dims,
+    const std::vector< std::vector<int> >& labels, const std::vector<int>& c) : cost_(0) {
+  tensor_assert(dims.size()==labels.size());
+  tensor_assert(!labels.empty());
+
+  for (int i=0;i<labels.size();++i) {
+    tensor_assert(dims[i].size()==labels[i].size());
+    for (int j=0;j<labels[i].size();++j) {
+      int l = labels[i][j];
+      tensor_assert_message(l<0, "Fixed indices must be resolved before planning a path");
+      auto it = extent_.find(l);
+      if (it==extent_.end()) {
+        extent_[l] = dims[i][j];
+      } else {
+        tensor_assert(it->second==dims[i][j]);
+      }
+    }
+  }
+  for (int l : c) tensor_assert(extent_.find(l)!=extent_.end());
+
+  for (const auto& l : labels) labels_.push_back(merge_labels(l, {}));
+
+  if (labels.size()<=exhaustive_limit) {
+    search_exhaustive(labels, c);
+  } else {
+    search_greedy(labels, c);
+  }
+}
+
+void ContractionPath::add_step(int i, int j, const std::vector<int>& labels) {
+  steps_.push_back({i, j});
+  labels_.push_back(labels);
+}
+
+void ContractionPath::search_exhaustive(const std::vector< std::vector<int> >& labels,
+    const std::vector<int>& c) {
+  int n = labels.size();
+  int n_sets = 1 << n;
+
+  auto volume = [this](const std::vector<int>& l) {
+    double v = 1;
+    for (int li : l) v*= extent_[li];
+    return v;
+  };
+
+  // Labels that survive when the operands in a subset have been contracted
+  std::vector< std::vector<int> > kept(n_sets);
+  for (int s=1;s<n_sets;++s) {
+    std::vector<int> inside, outside = c;
+    for (int i=0;i<n;++i) {
+      if (s & (1 << i)) {
+        inside = merge_labels(inside, labels_[i]);
+      } else {
+        outside = merge_labels(outside, labels_[i]);
+      }
+    }
+    for (int l : inside) {
+      if ((s & (s-1))==0 || has_label(outside, l)) kept[s].push_back(l);
+    }
+  }
+
+  // Cheapest way to contract each subset, over all splits in two
+  std::vector<double> cost(n_sets, 0);
+  std::vector<int> split(n_sets, 0);
+  for (int s=1;s<n_sets;++s) {
+    if ((s & (s-1))==0) continue;
+    int lowest = s & -s;
+    cost[s] = -1;
+    for (int l=(s-1) & s;l>0;l=(l-1) & s) {
+      if (!(l & lowest)) continue;
+      int r = s ^ l;
+      double cs = cost[l] + cost[r] + volume(merge_labels(kept[l], kept[r])) + volume(kept[s]);
+      if (cost[s]<0 || cs<cost[s]) {
+        cost[s] = cs;
+        split[s] = l;
+      }
+    }
+  }
+  cost_ = cost[n_sets-1];
+
+  // Emit the steps in post-order
+  std::function<int(int)> emit = [&](int s) -> int {
+    if ((s & (s-1))==0) {
+      int i = 0;
+      while (!(s & (1 << i))) i++;
+      return i;
+    }
+    int a = emit(split[s]);
+    int b = emit(s ^ split[s]);
+    std::vector<int> l;
+    for (int li : merge_labels(labels_[a], labels_[b])) {
+      if (has_label(kept[s], li)) l.push_back(li);
+    }
+    add_step(a, b, l);
+    return labels_.size()-1;
+  };
+  emit(n_sets-1);
+}
+
+void ContractionPath::search_greedy(const std::vector< std::vector<int> >& labels,
+    const std::vector<int>& c) {
+  auto volume = [this](const std::vector<int>& l) {
+    double v = 1;
+    for (int li : l) v*= extent_[li];
+    return v;
+  };
+
+  std::vector<int> active;
+  for (int i=0;i<labels.size();++i) active.push_back(i);
+
+  while (active.size()>1) {
+    double best = -1;
+    int best_i = 0, best_j = 1;
+    std::vector<int> best_labels;
+    for (int i=0;i<active.size();++i) {
+      for (int j=i+1;j<active.size();++j) {
+        std::vector<int> outside = c;
+        for (int k=0;k<active.size();++k) {
+          if (k!=i && k!=j) outside = merge_labels(outside, labels_[active[k]]);
+        }
+        std::vector<int> all = merge_labels(labels_[active[i]], labels_[active[j]]);
+        std::vector<int> l;
+        for (int li : all) if (has_label(outside, li)) l.push_back(li);
+        double cs = volume(all) + volume(l);
+        if (best<0 || cs<best) {
+          best = cs;
+          best_i = i;
+          best_j = j;
+          best_labels = l;
+        }
+      }
+    }
+    add_step(active[best_i], active[best_j], best_labels);
+    cost_+= best;
+    active.erase(active.begin()+best_j);
+    active.erase(active.begin()+best_i);
+    active.push_back(labels_.size()-1);
+  }
+}
@@ -0,0 +1,306 @@
+#ifndef CONTRACTION_PLAN_HPP_INCLUDE
+#define CONTRACTION_PLAN_HPP_INCLUDE
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include "tensor_exception.hpp"
+#include "tensor_arena.hpp"
+
+/** \brief Precomputed index bookkeeping for C_c = A_a * B_b
+
+  All einstein labels occurring in (a, b, c) are enumerated once.
+  For every label, the stride it contributes to the linear (column-major)
+  index of A, B and C is tabulated. Fixed (non-negative) indices in a or b
+  are folded into a constant offset.
+
+  Executing the contraction then amounts to an odometer walk over the labels,
+  without any allocation or map lookup per scalar product. The odometer
+  state is scratch on the current TensorArena scope, if any.
+
+  The operands may be strided views: strides_a and strides_b give the
+  distance in the underlying storage between neighbours along each axis.
+  Linear indices into A and B are relative to the start of the view.
+*/
+class ContractionPlan {
+  public:
+    ContractionPlan(const std::vector<int>& dims_a, const std::vector<int>& dims_b,
+      const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c);
+
+    ContractionPlan(const std::vector<int>& dims_a, const std::vector<int>& strides_a,
+      const std::vector<int>& dims_b, const std::vector<int>& strides_b,
+      const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c);
+
+    /** \brief Obtain a plan, reusing a cached one for an identical signature
+    *
+    *   The cache holds at most cache_capacity() bytes of plans, counted by
+    *   bytes(); the least recently used plans are dropped first.
+    */
+    static std::shared_ptr<const ContractionPlan> get(
+      const std::vector<int>& dims_a, const std::vector<int>& dims_b,
+      const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c);
+
+    static std::shared_ptr<const ContractionPlan> get(
+      const std::vector<int>& dims_a, const std::vector<int>& strides_a,
+      const std::vector<int>& dims_b, const std::vector<int>& strides_b,
+      const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c);
+
+    /// Drop all cached plans
+    static void clear_cache();
+    /// Number of cached plans
+    static int cache_size();
+    /// Bound on the bytes of cached plans; default 64 MiB
+    static void set_cache_capacity(std::size_t bytes);
+    static std::size_t cache_capacity();
+    /// Bytes of the cached plans
+    static std::size_t cache_bytes();
+
+    /// Memory held by the plan, mostly its gather index tables
+    std::size_t bytes() const;
+
+    /// Dimensions of the result C
+    const std::vector<int>& dims() const { return dims_; }
+    /// Number of scalar products the contraction performs
+    int n_iter() const { return n_iter_; }
+    /// Number of distinct labels
+    int n_labels() const { return labels_.size(); }
+
+    /// Labels, in odometer order (fastest varying first)
+    const std::vector<int>& labels() const { return labels_; }
+    const std::vector<int>& extents() const { return extents_; }
+    const std::vector<int>& strides_a() const { return stride_a_; }
+    const std::vector<int>& strides_b() const { return stride_b_; }
+    const std::vector<int>& strides_c() const { return stride_c_; }
+    int offset_a() const { return offset_a_; }
+    int offset_b() const { return offset_b_; }
+
+    /** \brief Whether the contraction is a batched matrix product
+
+      True when every label is either a batch label (in A, B and C),
+      free in A (A and C), free in B (B and C) or contracted (A and B).
+      Then C' = A' * B' for each batch entry, with
+        A' the permutation of A to [free A, contracted, batch],
+        B' the permutation of B to [contracted, free B, batch],
+        C' the permutation of C to [free A, free B, batch].
+    */
+    bool is_gemm() const { return gemm_; }
+    /// Rows of the matrix product (product of the free A extents)
+    int gemm_m() const { return gemm_m_; }
+    /// Inner dimension of the matrix product (product of the contracted extents)
+    int gemm_k() const { return gemm_k_; }
+    /// Columns of the matrix product (product of the free B extents)
+    int gemm_n() const { return gemm_n_; }
+    /// Number of matrix products (product of the batch extents)
+    int gemm_batch() const { return gemm_batch_; }
+    /** \brief Gather indices: A'[i] = A[gemm_index_a()[i]]
+
+      Empty if the gather is the identity.
+    */
+    const std::vector<int>& gemm_index_a() const { return gemm_index_a_; }
+    /// Gather indices: B'[i] = B[gemm_index_b()[i]], empty if identity
+    const std::vector<int>& gemm_index_b() const { return gemm_index_b_; }
+    /// Gather indices: C[i] = C'[gemm_index_c()[i]], empty if identity
+    const std::vector<int>& gemm_index_c() const { return gemm_index_c_; }
+
+    /** \brief Walk all label combinations
+
+      Calls f(sub_a, sub_b, sub_c) with the linear indices into A, B and C
+      of every scalar product, in the same order as a nested loop with the
+      first label varying fastest.
+    */
+    template <class F>
+    void for_each(F f) const;
+
+    /** \brief Walk the label combinations with label j restricted to [begin, end)
+    *
+    *   j is a position in labels()
+    */
+    template <class F>
+    void for_each(F f, int j, int begin, int end) const;
+
+    /** \brief Walk only the label combinations at the given entries of one operand
+    *
+    *   positions are linear indices into A (in_a) or B, relative to the start
+    *   of the view, e.g. those of its structural nonzeros. Calls f(sub_a, sub_b, sub_c)
+    *   as for_each does, except that the sub of the walked operand is replaced
+    *   by the index into positions. Positions outside the view are skipped.
+    *   The cost is proportional to positions.size() times the product of the
+    *   extents of the labels that do not occur in the walked operand.
+    */
+    template <class F>
+    void for_each_at(F f, const std::vector<int>& positions, bool in_a) const;
+
+    /** \brief Threads used for large numeric contractions
+    *
+    *   Defaults to the hardware concurrency; 1 disables threading.
+    */
+    static void set_num_threads(int n);
+    static int num_threads();
+
+    /** \brief Minimal number of scalar products before a numeric contraction is threaded */
+    static void set_parallel_threshold(int n);
+    static int parallel_threshold();
+
+  private:
+    std::vector<int> dims_;
+    std::vector<int> labels_;
+    std::vector<int> extents_;
+    std::vector<int> stride_a_;
+    std::vector<int> stride_b_;
+    std::vector<int> stride_c_;
+    int offset_a_;
+    int offset_b_;
+    int n_iter_;
+
+    /// ind is the odometer, one entry per label; it is reset on entry
+    template <class F>
+    void walk(F f, const int* extents, int n_iter,
+      int sub_a, int sub_b, int sub_c, int* ind) const;
+
+    /// Labels of A (in_a) or B, by decreasing stride
+    std::vector<int> operand_labels(bool in_a) const;
+
+    /** \brief Split a linear index into A or B over the labels of that operand
+    *
+    *   On success, sub_a, sub_b and sub_c hold the linear indices of the
+    *   first scalar product involving that entry.
+    */
+    bool locate(int pos, bool in_a, const std::vector<int>& order,
+      int& sub_a, int& sub_b, int& sub_c) const;
+
+    void init(const std::vector<int>& dims_a, const std::vector<int>& strides_a,
+      const std::vector<int>& dims_b, const std::vector<int>& strides_b,
+      const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c);
+
+    void init_gemm(const std::vector<int>& dims_a, const std::vector<int>& dims_b,
+      const std::vector<int>& a, const std::vector<int>& b, const std::vector<int>& c);
+
+    bool gemm_;
+    int gemm_m_;
+    int gemm_k_;
+    int gemm_n_;
+    int gemm_batch_;
+    std::vector<int> gemm_index_a_;
+    std::vector<int> gemm_index_b_;
+    std::vector<int> gemm_index_c_;
+};
+
+/// Column-major strides of a contiguous tensor with the given dimensions
+std::vector<int> contiguous_strides(const std::vector<int>& dims);
+
+/** \brief Linear indices of the entries of a strided view
+*
+*   Entries are enumerated in column-major order of dims.
+*/
+std::vector<int> strided_indices(const std::vector<int>& dims, const std::vector<int>& strides,
+  int offset);
+
+/** \brief Locate entries of the storage in a strided view
+*
+*   Returns, for every linear index in positions, the column-major index
+*   of that entry in the view, or -1 if the view does not contain it.
+*   The strides must nest, as those of slices and permutations of a
+*   contiguous tensor do.
+*/
+std::vector<int> strided_lookup(const std::vector<int>& dims, const std::vector<int>& strides,
+  int offset, const std::vector<int>& positions);
+
+/** \brief Pairwise contraction order for a multi-operand einsum
+
+  Operands are numbered 0..n-1; the result of step k gets number n+k.
+  The order minimizes the sum over all steps of the number of scalar products
+  plus the number of entries in the intermediate result.
+  An exact search over subsets is used for few operands, a greedy one otherwise.
+*/
+class ContractionPath {
+  public:
+    ContractionPath(const std::vector< std::vector<int> >& dims,
+      const std::vector< std::vector<int> >& labels, const std::vector<int>& c);
+
+    /// Pairs of operands contracted at each step
+    const std::vector< std::pair<int, int> >& steps() const { return steps_; }
+    /// Labels of the operands followed by those of the intermediates
+    const std::vector< std::vector<int> >& labels() const { return labels_; }
+    /// Cost of the chosen order according to the cost model
+    double cost() const { return cost_; }
+
+    /// Largest number of operands for which the exact search is used
+    static const int exhaustive_limit = 8;
+
+  private:
+    void add_step(int i, int j, const std::vector<int>& labels);
+    void search_exhaustive(const std::vector< std::vector<int> >& labels, const std::vector<int>& c);
+    void search_greedy(const std::vector< std::vector<int> >& labels, const std::vector<int>& c);
+
+    std::map<int, int> extent_;
+    std::vector< std::pair<int, int> > steps_;
+    std::vector< std::vector<int> > labels_;
+    double cost_;
+};
+
+template <class F>
+void ContractionPlan::for_each(F f) const {
+  ArenaVector<int> ind(labels_.size());
+  walk(f, extents_.data(), n_iter_, offset_a_, offset_b_, 0, ind.data());
+}
+
+template <class F>
+void ContractionPlan::for_each(F f, int j, int begin, int end) const {
+  if (begin>=end) return;
+  ArenaVector<int> extents(extents_.begin(), extents_.end());
+  extents[j] = end-begin;
+  ArenaVector<int> ind(labels_.size());
+  walk(f, extents.data(), n_iter_/extents_[j]*(end-begin),
+    offset_a_+begin*stride_a_[j], offset_b_+begin*stride_b_[j], begin*stride_c_[j], ind.data());
+}
+
+template <class F>
+void ContractionPlan::for_each_at(F f, const std::vector<int>& positions, bool in_a) const {
+  const std::vector<int>& stride = in_a ? stride_a_ : stride_b_;
+  // The labels of the walked operand are fixed by each position
+  ArenaVector<int> extents(extents_.begin(), extents_.end());
+  int n_iter = 1;
+  for (int j=0;j<extents.size();++j) {
+    if (stride[j]!=0) extents[j] = 1;
+    n_iter*= extents[j];
+  }
+  std::vector<int> order = operand_labels(in_a);
+  // Shared by all positions, so that the scratch does not grow with their number
+  ArenaVector<int> ind(labels_.size());
+  for (int i=0;i<positions.size();++i) {
+    int sub_a, sub_b, sub_c;
+    if (!locate(positions[i], in_a, order, sub_a, sub_b, sub_c)) continue;
+    // The remaining labels have zero stride in the walked operand
+    if (in_a) {
+      walk(f, extents.data(), n_iter, i, sub_b, sub_c, ind.data());
+    } else {
+      walk(f, extents.data(), n_iter, sub_a, i, sub_c, ind.data());
+    }
+  }
+}
+
+template <class F>
+void ContractionPlan::walk(F f, const int* extents, int n_iter,
+    int sub_a, int sub_b, int sub_c, int* ind) const {
+  int n = labels_.size();
+  std::fill(ind, ind+n, 0);
+  for (int i=0;i<n_iter;++i) {
+    f(sub_a, sub_b, sub_c);
+    for (int j=0;j<n;++j) {
+      if (++ind[j]<extents[j]) {
+        sub_a+= stride_a_[j];
+        sub_b+= stride_b_[j];
+        sub_c+= stride_c_[j];
+        break;
+      }
+      // Wrap around and carry into the next label
+      ind[j] = 0;
+      sub_a-= stride_a_[j]*(extents[j]-1);
+      sub_b-= stride_b_[j]*(extents[j]-1);
+      sub_c-= stride_c_[j]*(extents[j]-1);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,343 @@
+#include "dense_kernels.hpp"
+#include "thread_pool.hpp"
+
+#include <casadi/casadi.hpp>
+#include <casadi/core/runtime/casadi_runtime.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <type_traits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DENSE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+#define DENSE_BINARY_SCALAR(NAME, EXPR) \
+  void NAME##_scalar(int n, const double* x, const double* y, double* r) { \
+    for (int i=0;i<n;++i) r[i] = EXPR(x[i], y[i]); \
+  }
+
+#define SCALAR_ADD(X, Y) ((X)+(Y))
+#define SCALAR_SUB(X, Y) ((X)-(Y))
+#define SCALAR_MUL(X, Y) ((X)*(Y))
+#define SCALAR_LE(X, Y) ((X)<=(Y) ? 1.0 : 0.0)
+#define SCALAR_GE(X, Y) ((X)>=(Y) ? 1.0 : 0.0)
+
+  DENSE_BINARY_SCALAR(add, SCALAR_ADD)
+  DENSE_BINARY_SCALAR(sub, SCALAR_SUB)
+  DENSE_BINARY_SCALAR(mul, SCALAR_MUL)
+  DENSE_BINARY_SCALAR(le, SCALAR_LE)
+  DENSE_BINARY_SCALAR(ge, SCALAR_GE)
+
+  void neg_scalar(int n, const double* x, double* r) {
+    for (int i=0;i<n;++i) r[i] = -x[i];
+  }
+
+  void axpy_scalar(int n, double alpha, const double* x, double* y) {
+    for (int i=0;i<n;++i) y[i] += alpha*x[i];
+  }
+
+  /// c += a*b over the index space of plan, or over [begin, end) of label split
+  template <class F>
+  inline void walk(const ContractionPlan& plan, const F& f, int split, int begin, int end) {
+    if (split<0) {
+      plan.for_each(f);
+    } else {
+      plan.for_each(f, split, begin, end);
+    }
+  }
+
+  void walk_scalar(const ContractionPlan& plan, const double* a, const double* b, double* c,
+      int split, int begin, int end) {
+    walk(plan, [=](int sub_a, int sub_b, int sub_c) { c[sub_c] += a[sub_a]*b[sub_b]; },
+      split, begin, end);
+  }
+
+#ifdef DENSE_KERNELS_X86
+
+  // Scalar kernels with fused multiply-adds; without the target, fma() is a library call.
+  // Flattened so that the walk and its accumulator are compiled for the target too
+  __attribute__((target("fma")))
+  void axpy_fma(int n, double alpha, const double* x, double* y) {
+    for (int i=0;i<n;++i) y[i] = __builtin_fma(alpha, x[i], y[i]);
+  }
+
+  __attribute__((target("fma"), flatten))
+  void walk_fma(const ContractionPlan& plan, const double* a, const double* b, double* c,
+      int split, int begin, int end) {
+    walk(plan, [=](int sub_a, int sub_b, int sub_c) {
+      c[sub_c] = __builtin_fma(a[sub_a], b[sub_b], c[sub_c]);
+    }, split, begin, end);
+  }
+
+#define DENSE_BINARY_SIMD(NAME, ISA, TARGET, WIDTH, LOAD, STORE, VEXPR, EXPR) \
+  __attribute__((target(TARGET))) \
+  void NAME##_##ISA(int n, const double* x, const double* y, double* r) { \
+    int i = 0; \
+    for (;i+WIDTH<=n;i+=WIDTH) STORE(r+i, VEXPR(LOAD(x+i), LOAD(y+i))); \
+    for (;i<n;++i) r[i] = EXPR(x[i], y[i]); \
+  }
+
+#define AVX2_LE(X, Y) _mm256_and_pd(_mm256_cmp_pd(X, Y, _CMP_LE_OQ), _mm256_set1_pd(1.0))
+#define AVX2_GE(X, Y) _mm256_and_pd(_mm256_cmp_pd(X, Y, _CMP_GE_OQ), _mm256_set1_pd(1.0))
+
+  DENSE_BINARY_SIMD(add, avx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, SCALAR_ADD)
+  DENSE_BINARY_SIMD(sub, avx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, SCALAR_SUB)
+  DENSE_BINARY_SIMD(mul, avx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, SCALAR_MUL)
+  DENSE_BINARY_SIMD(le, avx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, AVX2_LE, SCALAR_LE)
+  DENSE_BINARY_SIMD(ge, avx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, AVX2_GE, SCALAR_GE)
+
+  __attribute__((target("avx2")))
+  void neg_avx2(int n, const double* x, double* r) {
+    __m256d sign = _mm256_set1_pd(-0.0);
+    int i = 0;
+    for (;i+4<=n;i+=4) _mm256_storeu_pd(r+i, _mm256_xor_pd(_mm256_loadu_pd(x+i), sign));
+    for (;i<n;++i) r[i] = -x[i];
+  }
+
+  __attribute__((target("avx2,fma")))
+  void axpy_avx2(int n, double alpha, const double* x, double* y) {
+    __m256d a = _mm256_set1_pd(alpha);
+    int i = 0;
+    for (;i+4<=n;i+=4) {
+      _mm256_storeu_pd(y+i, _mm256_fmadd_pd(a, _mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i)));
+    }
+    for (;i<n;++i) y[i] = __builtin_fma(alpha, x[i], y[i]);
+  }
+
+#define AVX512_LE(X, Y) _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(X, Y, _CMP_LE_OQ), _mm512_set1_pd(1.0))
+#define AVX512_GE(X, Y) _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(X, Y, _CMP_GE_OQ), _mm512_set1_pd(1.0))
+
+  DENSE_BINARY_SIMD(add, avx512, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd, SCALAR_ADD)
+  DENSE_BINARY_SIMD(sub, avx512, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_sub_pd, SCALAR_SUB)
+  DENSE_BINARY_SIMD(mul, avx512, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_mul_pd, SCALAR_MUL)
+  DENSE_BINARY_SIMD(le, avx512, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, AVX512_LE, SCALAR_LE)
+  DENSE_BINARY_SIMD(ge, avx512, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, AVX512_GE, SCALAR_GE)
+
+  __attribute__((target("avx512f")))
+  void neg_avx512(int n, const double* x, double* r) {
+    int i = 0;
+    for (;i+8<=n;i+=8) {
+      _mm512_storeu_pd(r+i, _mm512_sub_pd(_mm512_set1_pd(-0.0), _mm512_loadu_pd(x+i)));
+    }
+    for (;i<n;++i) r[i] = -x[i];
+  }
+
+  __attribute__((target("avx512f,fma")))
+  void axpy_avx512(int n, double alpha, const double* x, double* y) {
+    __m512d a = _mm512_set1_pd(alpha);
+    int i = 0;
+    for (;i+8<=n;i+=8) {
+      _mm512_storeu_pd(y+i, _mm512_fmadd_pd(a, _mm512_loadu_pd(x+i), _mm512_loadu_pd(y+i)));
+    }
+    for (;i<n;++i) y[i] = __builtin_fma(alpha, x[i], y[i]);
+  }
+
+#endif  // DENSE_KERNELS_X86
+
+  typedef void (*BinaryKernel)(int, const double*, const double*, double*);
+  typedef void (*UnaryKernel)(int, const double*, double*);
+  typedef void (*AxpyKernel)(int, double, const double*, double*);
+  typedef void (*WalkKernel)(const ContractionPlan&, const double*, const double*, double*,
+    int, int, int);
+
+  struct KernelTable {
+    BinaryKernel add, sub, mul, le, ge;
+    UnaryKernel neg;
+    AxpyKernel axpy;
+    WalkKernel walk;
+  };
+
+  const KernelTable scalar_table = {add_scalar, sub_scalar, mul_scalar, le_scalar, ge_scalar,
+    neg_scalar, axpy_scalar, walk_scalar};
+#ifdef DENSE_KERNELS_X86
+  const KernelTable scalar_fma_table = {add_scalar, sub_scalar, mul_scalar, le_scalar, ge_scalar,
+    neg_scalar, axpy_fma, walk_fma};
+  const KernelTable avx2_table = {add_avx2, sub_avx2, mul_avx2, le_avx2, ge_avx2,
+    neg_avx2, axpy_avx2, walk_fma};
+  const KernelTable avx512_table = {add_avx512, sub_avx512, mul_avx512, le_avx512, ge_avx512,
+    neg_avx512, axpy_avx512, walk_fma};
+#endif
+
+  bool supported_fma() {
+#ifdef DENSE_KERNELS_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("fma");
+#else
+    return false;
+#endif
+  }
+
+  DenseIsa supported_isa() {
+#ifdef DENSE_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return DENSE_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return DENSE_AVX2;
+#endif
+    return DENSE_SCALAR;
+  }
+
+  const KernelTable* table_for(DenseIsa isa) {
+#ifdef DENSE_KERNELS_X86
+    if (isa==DENSE_AVX512) return &avx512_table;
+    if (isa==DENSE_AVX2) return &avx2_table;
+    if (supported_fma()) return &scalar_fma_table;
+#endif
+    return &scalar_table;
+  }
+
+  std::atomic<const KernelTable*> active_table(0);
+
+  const KernelTable& kernels() {
+    const KernelTable* t = active_table.load(std::memory_order_relaxed);
+    if (t==0) {
+      t = table_for(supported_isa());
+      active_table.store(t);
+    }
+    return *t;
+  }
+}
+
+DenseIsa dense_isa() {
+  const KernelTable* t = &kernels();
+#ifdef DENSE_KERNELS_X86
+  if (t==&avx512_table) return DENSE_AVX512;
+  if (t==&avx2_table) return DENSE_AVX2;
+#endif
+  return DENSE_SCALAR;
+}
+
+void set_dense_isa(DenseIsa isa) {
+  active_table.store(table_for(std::min(isa, supported_isa())));
+}
+
+bool dense_fma() {
+  return kernels().walk!=walk_scalar;
+}
+
+void dense_add(int n, const double* x, const double* y, double* r) { kernels().add(n, x, y, r); }
+void dense_sub(int n, const double* x, const double* y, double* r) { kernels().sub(n, x, y, r); }
+void dense_mul(int n, const double* x, const double* y, double* r) { kernels().mul(n, x, y, r); }
+void dense_le(int n, const double* x, const double* y, double* r) { kernels().le(n, x, y, r); }
+void dense_ge(int n, const double* x, const double* y, double* r) { kernels().ge(n, x, y, r); }
+void dense_neg(int n, const double* x, double* r) { kernels().neg(n, x, r); }
+void dense_axpy(int n, double alpha, const double* x, double* y) { kernels().axpy(n, alpha, x, y); }
+
+namespace {
+  /// Split [0, n) into n_tasks contiguous chunks
+  int chunk_begin(int n, int n_tasks, int t) {
+    return static_cast<long long>(n)*t/n_tasks;
+  }
+
+  /// Integer type of casadi's compressed sparsity patterns
+  typedef std::remove_const<std::remove_pointer<
+    decltype(casadi::Sparsity().colind())>::type>::type SparsityInt;
+
+  /// Compressed column storage of a dense nrow-by-ncol pattern, as casadi's runtime reads it
+  void dense_pattern(int nrow, int ncol, ArenaVector<SparsityInt>& sp) {
+    sp.resize(3+ncol+nrow*ncol);
+    sp[0] = nrow;
+    sp[1] = ncol;
+    for (int j=0;j<=ncol;++j) sp[2+j] = j*nrow;
+    for (int j=0;j<ncol;++j) {
+      for (int i=0;i<nrow;++i) sp[3+ncol+j*nrow+i] = i;
+    }
+  }
+
+  /// Run task(0), ..., task(n_tasks-1) on pool, or inline without one
+  template <class F>
+  void run_tasks(const std::shared_ptr<ThreadPool>& pool, int n_tasks, const F& task) {
+    if (pool) {
+      pool->run(n_tasks, std::function<void(int)>(task));
+    } else {
+      // Serial evaluation does not wrap the task, which could allocate
+      for (int t=0;t<n_tasks;++t) task(t);
+    }
+  }
+}
+
+void dense_contract(const ContractionPlan& plan, const double* a, const double* b, double* c,
+    int n_threads) {
+  if (plan.n_iter()==0) return;
+  TensorArena scratch;
+
+  // Serial evaluation does not touch the shared pool
+  std::shared_ptr<ThreadPool> pool;
+  if (n_threads>1) pool = ThreadPool::shared(n_threads);
+  // Some slack for load balancing
+  int n_tasks = n_threads>1 ? 4*n_threads : 1;
+
+  if (plan.is_gemm()) {
+    int m = plan.gemm_m();
+    int k = plan.gemm_k();
+    int n = plan.gemm_n();
+    int n_cols = n*plan.gemm_batch();
+
+    const std::vector<int>& index_a = plan.gemm_index_a();
+    const std::vector<int>& index_b = plan.gemm_index_b();
+    const std::vector<int>& index_c = plan.gemm_index_c();
+
+    // Transposed operands
+    ArenaVector<double> a_buf(index_a.size()), b_buf(index_b.size()), c_buf;
+    for (int i=0;i<index_a.size();++i) a_buf[i] = a[index_a[i]];
+    for (int i=0;i<index_b.size();++i) b_buf[i] = b[index_b[i]];
+    const double* a_p = index_a.empty() ? a : a_buf.data();
+    const double* b_p = index_b.empty() ? b : b_buf.data();
+    double* c_p = c;
+    if (!index_c.empty()) {
+      c_buf.resize(index_c.size());
+      c_p = c_buf.data();
+    }
+
+    // Each task multiplies a range of columns of [free B, batch] with casadi's mtimes kernel,
+    // one call per batch entry the range covers. The sparsity patterns are built on the
+    // arena: Sparsity objects must not be created on worker threads
+    ArenaVector<SparsityInt> sp_a;
+    dense_pattern(m, k, sp_a);
+    std::fill(c_p, c_p+m*n_cols, 0.0);
+    n_tasks = std::min(n_tasks, n_cols);
+    run_tasks(pool, n_tasks, [&](int t) {
+      TensorArena scratch;
+      ArenaVector<SparsityInt> sp_b, sp_c;
+      ArenaVector<double> w(m);
+      int end = chunk_begin(n_cols, n_tasks, t+1);
+      for (int j=chunk_begin(n_cols, n_tasks, t);j<end;) {
+        int batch = j/n;
+        int width = std::min(end, (batch+1)*n)-j;
+        dense_pattern(k, width, sp_b);
+        dense_pattern(m, width, sp_c);
+        casadi::casadi_mtimes(a_p+batch*m*k, sp_a.data(), b_p+j*k, sp_b.data(), c_p+j*m,
+          sp_c.data(), w.data(), false);
+        j += width;
+      }
+    });
+
+    for (int i=0;i<index_c.size();++i) c[i] = c_p[index_c[i]];
+    return;
+  }
+
+  // Split over the output label with the largest extent
+  int split = -1;
+  for (int j=0;j<plan.n_labels();++j) {
+    if (plan.strides_c()[j]==0) continue;
+    if (split<0 || plan.extents()[j]>plan.extents()[split]) split = j;
+  }
+
+  WalkKernel walk = kernels().walk;
+  if (split<0) {
+    walk(plan, a, b, c, split, 0, 0);
+    return;
+  }
+
+  int extent = plan.extents()[split];
+  n_tasks = std::min(n_tasks, extent);
+  run_tasks(pool, n_tasks, [&](int t) {
+    // Odometer scratch on the arena of the executing thread
+    TensorArena scratch;
+    walk(plan, a, b, c, split, chunk_begin(extent, n_tasks, t), chunk_begin(extent, n_tasks, t+1));
+  });
+}
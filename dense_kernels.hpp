@@ -0,0 +1,56 @@
+#ifndef DENSE_KERNELS_HPP_INCLUDE
+#define DENSE_KERNELS_HPP_INCLUDE
+
+#include "contraction_plan.hpp"
+
+/** \brief Instruction sets the dense kernels can dispatch to */
+enum DenseIsa {DENSE_SCALAR, DENSE_AVX2, DENSE_AVX512};
+
+/** \brief Instruction set in use
+*
+*   Detected at first use: the widest one supported by the processor.
+*/
+DenseIsa dense_isa();
+
+/** \brief Select an instruction set, e.g. to compare against the scalar fallback
+*
+*   Requests beyond what the processor supports are clamped.
+*/
+void set_dense_isa(DenseIsa isa);
+
+/** \brief Whether contraction walks and dense_axpy use fused multiply-adds
+*
+*   True where the processor has FMA instructions, whichever instruction set
+*   is selected; elsewhere products are rounded before they are added. Results
+*   may thus differ in the last bits between processors with and without FMA.
+*/
+bool dense_fma();
+
+/// r = x + y, elementwise over n entries
+void dense_add(int n, const double* x, const double* y, double* r);
+/// r = x - y
+void dense_sub(int n, const double* x, const double* y, double* r);
+/// r = x * y
+void dense_mul(int n, const double* x, const double* y, double* r);
+/// r = -x
+void dense_neg(int n, const double* x, double* r);
+/// r = x <= y, as 1 or 0
+void dense_le(int n, const double* x, const double* y, double* r);
+/// r = x >= y, as 1 or 0
+void dense_ge(int n, const double* x, const double* y, double* r);
+/// y += alpha * x, with fused multiply-adds where the processor has them
+void dense_axpy(int n, double alpha, const double* x, double* y);
+
+/** \brief Evaluate a contraction plan on dense buffers, using n_threads threads
+*
+*   c must hold zeros on entry. The work is split over the entries of C,
+*   so that each entry is accumulated by a single thread in a fixed order:
+*   the result is independent of n_threads. Matrix product plans are split
+*   over the columns of [free B, batch], each range multiplied with casadi's
+*   mtimes kernel, and round as mtimes does. Other plans walk the index space
+*   and accumulate as dense_fma tells.
+*/
+void dense_contract(const ContractionPlan& plan, const double* a, const double* b, double* c,
+  int n_threads);
+
+#endif
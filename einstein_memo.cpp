@@ -0,0 +1,228 @@
+#include "einstein_memo.hpp"
+#include "tensor.hpp"
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+namespace {
+  std::atomic<bool> memo_enabled(false);
+  std::atomic<int> memo_capacity(4096);
+  std::atomic<int> hits(0);
+  std::atomic<int> misses(0);
+
+  std::mutex& memo_mutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  /// FNV-1a over raw bytes, continuing from h
+  std::size_t mix(std::size_t h, const void* data, std::size_t n) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (std::size_t i=0;i<n;++i) {
+      h^= p[i];
+      h*= 1099511628211ull;
+    }
+    return h;
+  }
+
+  std::size_t mix(std::size_t h, int v) {
+    return mix(h, &v, sizeof(v));
+  }
+
+  std::size_t mix(std::size_t h, const std::vector<int>& v) {
+    h = mix(h, static_cast<int>(v.size()));
+    return v.empty() ? h : mix(h, v.data(), sizeof(int)*v.size());
+  }
+
+  std::size_t mix_shape(std::size_t h, const Sparsity& sp) {
+    h = mix(h, sp.size1());
+    h = mix(h, sp.size2());
+    return mix(h, sp.nnz());
+  }
+
+  /// Hash of the identity of an operand: values, entry nodes or expression node
+  std::size_t identity(std::size_t h, const DM& x) {
+    h = mix_shape(h, x.sparsity());
+    return x.nnz() ? mix(h, x.ptr(), sizeof(double)*x.nnz()) : h;
+  }
+
+  std::size_t identity(std::size_t h, const SX& x) {
+    h = mix_shape(h, x.sparsity());
+    for (const SXElem& e : x.nonzeros()) {
+      const void* node = e.get();
+      h = mix(h, &node, sizeof(node));
+    }
+    return h;
+  }
+
+  std::size_t identity(std::size_t h, const MX& x) {
+    const void* node = x.get();
+    return mix(h, &node, sizeof(node));
+  }
+
+  bool same(const DM& x, const DM& y) {
+    return x.sparsity()==y.sparsity() && x.nonzeros()==y.nonzeros();
+  }
+
+  bool same(const SX& x, const SX& y) {
+    if (!(x.sparsity()==y.sparsity())) return false;
+    for (int k=0;k<x.nnz();++k) {
+      if (x.nonzeros()[k].get()!=y.nonzeros()[k].get()) return false;
+    }
+    return true;
+  }
+
+  bool same(const MX& x, const MX& y) {
+    return x.get()==y.get();
+  }
+
+  template <class T>
+  std::size_t key_hash(const EinsteinMemoKey<T>& k) {
+    std::size_t h = 14695981039346656037ull;
+    h = identity(h, *k.storage_a);
+    h = mix(mix(mix(h, k.dims_a), k.strides_a), k.offset_a);
+    h = identity(h, *k.storage_b);
+    h = mix(mix(mix(h, k.dims_b), k.strides_b), k.offset_b);
+    return mix(mix(mix(h, k.a), k.b), k.c);
+  }
+
+  template <class T>
+  bool same_key(const EinsteinMemoKey<T>& x, const EinsteinMemoKey<T>& y) {
+    if (x.a!=y.a || x.b!=y.b || x.c!=y.c) return false;
+    if (x.dims_a!=y.dims_a || x.strides_a!=y.strides_a || x.offset_a!=y.offset_a) return false;
+    if (x.dims_b!=y.dims_b || x.strides_b!=y.strides_b || x.offset_b!=y.offset_b) return false;
+    // Shared storage needs no inspection
+    if (x.storage_a!=y.storage_a && !same(*x.storage_a, *y.storage_a)) return false;
+    return x.storage_b==y.storage_b || same(*x.storage_b, *y.storage_b);
+  }
+
+  template <class T>
+  struct Entry {
+    EinsteinMemoKey<T> key;
+    std::size_t hash;
+    T result;
+  };
+
+  /// Entries of one tensor type, most recently used first
+  template <class T>
+  struct Store {
+    typedef typename std::list< Entry<T> >::iterator Iterator;
+    std::list< Entry<T> > entries;
+    std::unordered_multimap<std::size_t, Iterator> index;
+
+    Iterator find(const EinsteinMemoKey<T>& key, std::size_t hash) {
+      auto range = index.equal_range(hash);
+      for (auto it=range.first;it!=range.second;++it) {
+        if (same_key(it->second->key, key)) return it->second;
+      }
+      return entries.end();
+    }
+
+    /// Drop least recently used entries beyond n
+    void trim(int n) {
+      while (static_cast<int>(entries.size())>std::max(n, 0)) {
+        Iterator last = std::prev(entries.end());
+        auto range = index.equal_range(last->hash);
+        for (auto it=range.first;it!=range.second;++it) {
+          if (it->second==last) {
+            index.erase(it);
+            break;
+          }
+        }
+        entries.pop_back();
+      }
+    }
+
+    void clear() {
+      index.clear();
+      entries.clear();
+    }
+  };
+
+  /// The memo lock must be held
+  template <class T>
+  Store<T>& memo_store() {
+    // Never destroyed, as the entries hold casadi expressions that may outlive static destruction
+    static Store<T>* s = new Store<T>();
+    return *s;
+  }
+}
+
+void EinsteinMemo::set_enabled(bool enabled) {
+  memo_enabled = enabled;
+}
+
+bool EinsteinMemo::enabled() {
+  return memo_enabled;
+}
+
+void EinsteinMemo::set_capacity(int n) {
+  std::lock_guard<std::mutex> lock(memo_mutex());
+  memo_capacity = n;
+  memo_store<DM>().trim(n);
+  memo_store<SX>().trim(n);
+  memo_store<MX>().trim(n);
+}
+
+int EinsteinMemo::capacity() {
+  return memo_capacity;
+}
+
+void EinsteinMemo::clear() {
+  std::lock_guard<std::mutex> lock(memo_mutex());
+  memo_store<DM>().clear();
+  memo_store<SX>().clear();
+  memo_store<MX>().clear();
+}
+
+int EinsteinMemo::size() {
+  std::lock_guard<std::mutex> lock(memo_mutex());
+  return memo_store<DM>().entries.size() + memo_store<SX>().entries.size() +
+    memo_store<MX>().entries.size();
+}
+
+int EinsteinMemo::n_hits() {
+  return hits;
+}
+
+int EinsteinMemo::n_misses() {
+  return misses;
+}
+
+template <class T>
+bool EinsteinMemo::lookup(const EinsteinMemoKey<T>& key, T& result) {
+  std::size_t hash = key_hash(key);
+  std::lock_guard<std::mutex> lock(memo_mutex());
+  Store<T>& s = memo_store<T>();
+  typename Store<T>::Iterator it = s.find(key, hash);
+  if (it==s.entries.end()) {
+    misses++;
+    return false;
+  }
+  // Move to the front; iterators in the index stay valid
+  s.entries.splice(s.entries.begin(), s.entries, it);
+  result = it->result;
+  hits++;
+  return true;
+}
+
+template <class T>
+void EinsteinMemo::store(const EinsteinMemoKey<T>& key, const T& result) {
+  std::size_t hash = key_hash(key);
+  std::lock_guard<std::mutex> lock(memo_mutex());
+  Store<T>& s = memo_store<T>();
+  // Another thread may have stored it meanwhile
+  if (s.find(key, hash)!=s.entries.end()) return;
+  s.entries.push_front(Entry<T>{key, hash, result});
+  s.index.insert(std::make_pair(hash, s.entries.begin()));
+  s.trim(memo_capacity);
+}
+
+template bool EinsteinMemo::lookup(const EinsteinMemoKey<DM>& key, DM& result);
+template bool EinsteinMemo::lookup(const EinsteinMemoKey<SX>& key, SX& result);
+template bool EinsteinMemo::lookup(const EinsteinMemoKey<MX>& key, MX& result);
+template void EinsteinMemo::store(const EinsteinMemoKey<DM>& key, const DM& result);
+template void EinsteinMemo::store(const EinsteinMemoKey<SX>& key, const SX& result);
+template void EinsteinMemo::store(const EinsteinMemoKey<MX>& key, const MX& result);
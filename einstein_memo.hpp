@@ -0,0 +1,67 @@
+#ifndef EINSTEIN_MEMO_HPP_INCLUDE
+#define EINSTEIN_MEMO_HPP_INCLUDE
+
+#include <vector>
+#include <memory>
+
+/// A contraction C_c = A_a * B_b of two strided views, as looked up by EinsteinMemo
+template <class T>
+struct EinsteinMemoKey {
+  std::shared_ptr<const T> storage_a;
+  std::vector<int> dims_a;
+  std::vector<int> strides_a;
+  int offset_a;
+  std::shared_ptr<const T> storage_b;
+  std::vector<int> dims_b;
+  std::vector<int> strides_b;
+  int offset_b;
+  std::vector<int> a;
+  std::vector<int> b;
+  std::vector<int> c;
+};
+
+/** \brief Memoization of einstein results
+
+  When enabled, every contraction (einstein, inner, partial_product, ...)
+  first looks for an earlier contraction with the same spec (a, b, c), the
+  same view dims, strides and offsets, and identical operands, and returns
+  its result. Operands are identical when they share storage, or else:
+  for MX, the same expression node; for SX, the same node for every entry;
+  for DM, the same sparsity and values.
+
+  For symbolic types, reusing a result also shares its subgraph instead of
+  building a copy of it.
+
+  Entries keep their operands and result alive. At most capacity() entries
+  are kept per tensor type; the least recently used are dropped first.
+
+  Disabled by default.
+*/
+class EinsteinMemo {
+  public:
+    static void set_enabled(bool enabled);
+    static bool enabled();
+
+    /// Bound on the number of entries per tensor type; default 4096
+    static void set_capacity(int n);
+    static int capacity();
+
+    /// Drop all entries; statistics are kept
+    static void clear();
+    /// Number of entries, over all tensor types
+    static int size();
+
+    /// Contractions served from the memo, and contractions computed while enabled
+    static int n_hits();
+    static int n_misses();
+
+    /// Result of an earlier contraction for key, if any
+    template <class T>
+    static bool lookup(const EinsteinMemoKey<T>& key, T& result);
+
+    /// Remember the result of a contraction
+    template <class T>
+    static void store(const EinsteinMemoKey<T>& key, const T& result);
+};
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef FIXED_TENSOR_HPP_INCLUDE
+#define FIXED_TENSOR_HPP_INCLUDE
+
+#include <array>
+#include "tensor.hpp"
+
+/// Dimensions known at compile time
+template <int... D>
+struct Shape {};
+
+/// Einstein labels known at compile time; negative labels are summed, others fixed
+template <int... L>
+struct Labels {};
+
+namespace tensor_detail {
+
+  template <int... V>
+  struct product_of { static const int value = 1; };
+  template <int V0, int... V>
+  struct product_of<V0, V...> { static const int value = V0*product_of<V...>::value; };
+
+  /// Column-major linear index of (i0, i1, ...)
+  template <int... D>
+  struct linear {
+    static int get() { return 0; }
+  };
+  template <int D0, int... D>
+  struct linear<D0, D...> {
+    template <class... I>
+    static int get(int i0, I... i) { return i0+D0*linear<D...>::get(i...); }
+  };
+
+  /// Stride of label L in a tensor with labels Ls and dimensions Ds (0 if absent)
+  template <int L, class Ls, class Ds>
+  struct label_stride { static const int value = 0; };
+  template <int L, int L0, int... Ls, int D0, int... Ds>
+  struct label_stride<L, Labels<L0, Ls...>, Shape<D0, Ds...> > {
+    static const int value = (L0==L ? 1 : 0)+D0*label_stride<L, Labels<Ls...>, Shape<Ds...> >::value;
+  };
+
+  /// Extent of label L (0 if absent)
+  template <int L, class Ls, class Ds>
+  struct label_extent { static const int value = 0; };
+  template <int L, int L0, int... Ls, int D0, int... Ds>
+  struct label_extent<L, Labels<L0, Ls...>, Shape<D0, Ds...> > {
+    static const int value = L0==L ? D0 : label_extent<L, Labels<Ls...>, Shape<Ds...> >::value;
+  };
+
+  /// Whether label L occurs in Ls
+  template <int L, class Ls>
+  struct label_occurs { static const bool value = false; };
+  template <int L, int L0, int... Ls>
+  struct label_occurs<L, Labels<L0, Ls...> > {
+    static const bool value = L0==L || label_occurs<L, Labels<Ls...> >::value;
+  };
+
+  template <bool... B>
+  struct all_of { static const bool value = true; };
+  template <bool B0, bool... B>
+  struct all_of<B0, B...> { static const bool value = B0 && all_of<B...>::value; };
+
+  /// Whether all occurrences of label L have the same extent
+  template <int L, class Ls, class Ds>
+  struct label_consistent { static const bool value = true; };
+  template <int L, int L0, int... Ls, int D0, int... Ds>
+  struct label_consistent<L, Labels<L0, Ls...>, Shape<D0, Ds...> > {
+    static const int rest = label_extent<L, Labels<Ls...>, Shape<Ds...> >::value;
+    static const bool value = (L0!=L || rest==0 || rest==D0) &&
+      label_consistent<L, Labels<Ls...>, Shape<Ds...> >::value;
+  };
+
+  /// Linear offset contributed by the fixed (non-negative) indices
+  template <class Ls, class Ds>
+  struct fixed_offset { static const int value = 0; };
+  template <int L0, int... Ls, int D0, int... Ds>
+  struct fixed_offset<Labels<L0, Ls...>, Shape<D0, Ds...> > {
+    static const int value = (L0>=0 ? L0 : 0)+D0*fixed_offset<Labels<Ls...>, Shape<Ds...> >::value;
+  };
+
+  /// Largest -L over the summation labels
+  template <class Ls>
+  struct max_label { static const int value = 0; };
+  template <int L0, int... Ls>
+  struct max_label<Labels<L0, Ls...> > {
+    static const int rest = max_label<Labels<Ls...> >::value;
+    static const int value = -L0>rest ? -L0 : rest;
+  };
+
+  template <int L, class LA, class DA, class LB, class DB>
+  struct contract_extent {
+    static const int a = label_extent<L, LA, DA>::value;
+    static const int b = label_extent<L, LB, DB>::value;
+    static_assert(label_consistent<L, LA, DA>::value && label_consistent<L, LB, DB>::value,
+      "Label extents do not match");
+    static_assert(a==0 || b==0 || a==b, "Label extents do not match");
+    static const int value = a ? a : b;
+  };
+
+  /** Loop nest over labels -K, -K+1, ..., -1
+
+    Bounds and strides are compile-time constants; labels absent from
+    both operands collapse to a single iteration.
+  */
+  template <int K, class LA, class DA, class LB, class DB, class LC, class DC>
+  struct contract_loop {
+    static const int n = contract_extent<-K, LA, DA, LB, DB>::value;
+    static const int sa = label_stride<-K, LA, DA>::value;
+    static const int sb = label_stride<-K, LB, DB>::value;
+    static const int sc = label_stride<-K, LC, DC>::value;
+    typedef contract_loop<K-1, LA, DA, LB, DB, LC, DC> inner;
+
+    template <class S>
+    static void run(const S* a, const S* b, S* c) {
+      for (int i=0;i<(n ? n : 1);++i) inner::run(a+i*sa, b+i*sb, c+i*sc);
+    }
+  };
+
+  template <class LA, class DA, class LB, class DB, class LC, class DC>
+  struct contract_loop<0, LA, DA, LB, DB, LC, DC> {
+    template <class S>
+    static void run(const S* a, const S* b, S* c) {
+      *c = *c+(*a)*(*b);
+    }
+  };
+
+  template <class S, class LA, class DA, class LB, class DB, class LC>
+  struct einstein_result;
+}
+
+/** \brief Tensor with dimensions fixed at compile time
+
+  S is the scalar type: double, or SXElem for symbolic entries.
+  The entries are stored inline, in column-major order, so that numeric
+  fixed tensors live on the stack. Strides, offsets and loop bounds of
+  einstein are template constants.
+
+  Converts to and from Tensor< Matrix<S> > (DT or ST), and thereby to AnyTensor.
+*/
+template <class S, int... Dims>
+class FixedTensor {
+  public:
+    typedef Shape<Dims...> shape;
+    static const int n_dims = sizeof...(Dims);
+    static const int numel = tensor_detail::product_of<Dims...>::value;
+
+    /// All zeros
+    FixedTensor() { data_.fill(S(0)); }
+
+    /// All entries equal to a
+    explicit FixedTensor(const S& a) { data_.fill(a); }
+
+    explicit FixedTensor(const std::array<S, numel>& data) : data_(data) {}
+
+    /// Copy the entries of a dense tensor with the same dimensions
+    explicit FixedTensor(const Tensor< Matrix<S> >& t) {
+      tensor_assert(t.dims()==dims());
+      tensor_assert(!t.is_sparse());
+      const std::vector<S>& nz = t.data().nonzeros();
+      std::copy(nz.begin(), nz.end(), data_.begin());
+    }
+
+    operator Tensor< Matrix<S> >() const {
+      return Tensor< Matrix<S> >(Matrix<S>(std::vector<S>(data_.begin(), data_.end())), dims());
+    }
+
+    static std::vector<int> dims() { return {Dims...}; }
+
+    /// Entry (i0, i1, ...)
+    template <class... I>
+    S& operator()(I... i) {
+      static_assert(sizeof...(I)==n_dims, "Wrong number of indices");
+      return data_[tensor_detail::linear<Dims...>::get(i...)];
+    }
+    template <class... I>
+    const S& operator()(I... i) const {
+      static_assert(sizeof...(I)==n_dims, "Wrong number of indices");
+      return data_[tensor_detail::linear<Dims...>::get(i...)];
+    }
+
+    const std::array<S, numel>& data() const { return data_; }
+    std::array<S, numel>& data() { return data_; }
+
+    FixedTensor operator+(const FixedTensor& rhs) const {
+      FixedTensor r;
+      for (int i=0;i<numel;++i) r.data_[i] = data_[i]+rhs.data_[i];
+      return r;
+    }
+
+    FixedTensor operator*(const FixedTensor& rhs) const {
+      FixedTensor r;
+      for (int i=0;i<numel;++i) r.data_[i] = data_[i]*rhs.data_[i];
+      return r;
+    }
+
+    FixedTensor operator-() const {
+      FixedTensor r;
+      for (int i=0;i<numel;++i) r.data_[i] = -data_[i];
+      return r;
+    }
+
+  private:
+    std::array<S, numel> data_;
+};
+
+namespace tensor_detail {
+  template <class S, class LA, class DA, class LB, class DB, int... Lc>
+  struct einstein_result<S, LA, DA, LB, DB, Labels<Lc...> > {
+    static_assert(all_of<(label_occurs<Lc, LA>::value || label_occurs<Lc, LB>::value)...>::value,
+      "Every label of c must occur in a or b");
+    typedef FixedTensor<S, contract_extent<Lc, LA, DA, LB, DB>::value...> type;
+  };
+}
+
+/** \brief Contraction of fixed tensors, see Tensor::einstein
+
+  einstein< Labels<a...>, Labels<b...>, Labels<c...> >(A, B) -> C
+
+  The labels are template arguments, so that the loop nest is fully
+  resolved at compile time.
+*/
+template <class LA, class LB, class LC, class S, int... DA, int... DB>
+typename tensor_detail::einstein_result<S, LA, Shape<DA...>, LB, Shape<DB...>, LC>::type
+einstein(const FixedTensor<S, DA...>& a, const FixedTensor<S, DB...>& b) {
+  using namespace tensor_detail;
+  typedef typename einstein_result<S, LA, Shape<DA...>, LB, Shape<DB...>, LC>::type Result;
+  typedef typename Result::shape DC;
+  static const int M = max_label<LA>::value>max_label<LB>::value ?
+    max_label<LA>::value : max_label<LB>::value;
+
+  Result c;
+  contract_loop<M, LA, Shape<DA...>, LB, Shape<DB...>, LC, DC>::run(
+    a.data().data()+fixed_offset<LA, Shape<DA...> >::value,
+    b.data().data()+fixed_offset<LB, Shape<DB...> >::value,
+    c.data().data());
+  return c;
+}
+
+#endif
@@ -0,0 +1,783 @@
+#include "mapped_tensor.hpp"
+
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+  const char NPY_MAGIC[] = "\x93NUMPY";
+  /// numpy pads headers so that the data starts at a multiple of this
+  const int NPY_ALIGN = 64;
+
+  const std::uint32_t ZIP_LOCAL = 0x04034b50;
+  const std::uint32_t ZIP_CENTRAL = 0x02014b50;
+  const std::uint32_t ZIP_END = 0x06054b50;
+  const std::uint32_t ZIP64_END = 0x06064b50;
+  const std::uint32_t ZIP64_LOCATOR = 0x07064b50;
+  const std::uint32_t ZIP_MAX32 = 0xFFFFFFFF;
+  /// Extra field ids: sizes beyond 4GB, and alignment padding
+  const std::uint16_t ZIP64_EXTRA = 0x0001;
+  const std::uint16_t ZIP_ALIGN_EXTRA = 0xD935;
+  /// Version 4.5: zip64
+  const std::uint16_t ZIP_VERSION = 45;
+  /// 1980-01-01, the earliest date a zip entry can carry
+  const std::uint16_t ZIP_DATE = (1 << 5) | 1;
+
+  bool little_endian() {
+    std::uint16_t x = 1;
+    return *reinterpret_cast<const unsigned char*>(&x)==1;
+  }
+
+  std::uint64_t get(const unsigned char* p, int n) {
+    std::uint64_t r = 0;
+    for (int i=n-1;i>=0;--i) r = (r << 8) | p[i];
+    return r;
+  }
+
+  /// Little-endian n-byte integer
+  std::string le(std::uint64_t v, int n) {
+    std::string r(n, '\0');
+    for (int i=0;i<n;++i) r[i] = static_cast<char>((v >> (8*i)) & 0xFF);
+    return r;
+  }
+
+  std::uint32_t crc_table(int i) {
+    static std::uint32_t table[256];
+    static bool init = false;
+    if (!init) {
+      for (std::uint32_t n=0;n<256;++n) {
+        std::uint32_t c = n;
+        for (int k=0;k<8;++k) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        table[n] = c;
+      }
+      init = true;
+    }
+    return table[i];
+  }
+
+  /// Counts and checksums what goes to the stream
+  struct Writer {
+    explicit Writer(std::ostream& out) : out(out), crc(0xFFFFFFFF), n(0) {}
+    void write(const void* data, std::size_t size) {
+      const unsigned char* p = static_cast<const unsigned char*>(data);
+      for (std::size_t i=0;i<size;++i) crc = crc_table((crc ^ p[i]) & 0xFF) ^ (crc >> 8);
+      out.write(static_cast<const char*>(data), size);
+      n+= size;
+    }
+    void write(const std::string& s) { write(s.data(), s.size()); }
+    std::uint32_t checksum() const { return crc ^ 0xFFFFFFFF; }
+
+    std::ostream& out;
+    std::uint32_t crc;
+    std::uint64_t n;
+  };
+
+  /// Magic, version, header length and header dict, padded to NPY_ALIGN
+  std::string npy_header(const std::vector<int>& dims) {
+    std::stringstream ss;
+    ss << "{'descr': '<f8', 'fortran_order': True, 'shape': (";
+    for (int i=0;i<dims.size();++i) ss << (i ? ", " : "") << dims[i];
+    ss << (dims.size()==1 ? ",), }" : "), }");
+    std::string dict = ss.str();
+
+    // Version 1.0 has a 2-byte header length, 2.0 a 4-byte one
+    bool v1 = dict.size()+1+10<65536;
+    int prefix = v1 ? 10 : 12;
+    int pad = (NPY_ALIGN-(prefix+dict.size()+1) % NPY_ALIGN) % NPY_ALIGN;
+    dict+= std::string(pad, ' ') + "\n";
+    return std::string(NPY_MAGIC, 6) + (v1 ? std::string("\x01\x00", 2) : std::string("\x02\x00", 2)) +
+      le(dict.size(), v1 ? 2 : 4) + dict;
+  }
+
+  /// Entries of x in column-major order, structural zeros included
+  void write_entries(Writer& w, const DM& x) {
+    if (x.is_dense()) {
+      w.write(x.ptr(), sizeof(double)*x.nnz());
+      return;
+    }
+    static const double zeros[512] = {0};
+    std::vector<int> pos = x.sparsity().find();
+    const double* nz = x.ptr();
+    long next = 0;
+    auto write_zeros = [&](long n) {
+      for (;n>0;n-=512) w.write(zeros, sizeof(double)*std::min(n, 512L));
+    };
+    for (int k=0;k<pos.size();++k) {
+      write_zeros(pos[k]-next);
+      w.write(nz+k, sizeof(double));
+      next = pos[k]+1;
+    }
+    write_zeros(static_cast<long>(x.numel())-next);
+  }
+
+  /// Value of key in a numpy header dict, up to the next top-level comma or brace
+  std::string npy_field(const std::string& header, const std::string& key) {
+    std::size_t i = header.find("'" + key + "'");
+    tensor_assert_message(i!=std::string::npos, "npy header lacks '" << key << "': " << header);
+    i = header.find(':', i);
+    tensor_assert(i!=std::string::npos);
+    ++i;
+    while (i<header.size() && header[i]==' ') ++i;
+    std::size_t j = i;
+    int depth = 0;
+    for (;j<header.size();++j) {
+      char c = header[j];
+      if (c=='(') depth++;
+      if (c==')') depth--;
+      if (depth==0 && (c==',' || c=='}')) break;
+    }
+    return header.substr(i, j-i);
+  }
+
+  std::vector<int> npy_shape(const std::string& s) {
+    tensor_assert_message(s.size()>=2 && s[0]=='(' && s[s.size()-1]==')', "Bad npy shape " << s);
+    std::vector<int> dims;
+    std::stringstream ss(s.substr(1, s.size()-2));
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      if (item.find_first_not_of(' ')==std::string::npos) continue;
+      dims.push_back(std::stoi(item));
+    }
+    return dims;
+  }
+
+  /// Number of entries, in 64 bits
+  long n_entries(const std::vector<int>& dims) {
+    long n = 1;
+    for (int d : dims) {
+      tensor_assert_message(d==0 || n<=LONG_MAX/d, "Tensor with more than 2^63 entries");
+      n*= d;
+    }
+    return n;
+  }
+
+  /// Contiguous strides in 64 bits, first or last axis fastest
+  std::vector<long> strides_64(const std::vector<int>& dims, bool fortran) {
+    std::vector<long> strides(dims.size());
+    long s = 1;
+    for (int k=0;k<dims.size();++k) {
+      int i = fortran ? k : dims.size()-1-k;
+      strides[i] = s;
+      s*= dims[i];
+    }
+    return strides;
+  }
+
+  /// Entries between the first and last of a view, inclusive
+  long span(const std::vector<int>& dims, const std::vector<long>& strides) {
+    long e = 1;
+    for (int i=0;i<dims.size();++i) {
+      if (dims[i]==0) return 0;
+      e+= (dims[i]-1)*strides[i];
+    }
+    return e;
+  }
+
+  /// Call f(i, sub) for the entries of a view in column-major order; sub is the offset of entry i
+  template<class F>
+  void for_each_entry(const std::vector<int>& dims, const std::vector<long>& strides, F f) {
+    long n = n_entries(dims);
+    std::vector<int> ind(dims.size(), 0);
+    std::ptrdiff_t sub = 0;
+    for (long i=0;i<n;++i) {
+      f(i, sub);
+      for (int j=0;j<dims.size();++j) {
+        if (++ind[j]<dims[j]) {
+          sub+= strides[j];
+          break;
+        }
+        ind[j] = 0;
+        sub-= strides[j]*(dims[j]-1);
+      }
+    }
+  }
+
+  /** \brief Strides of a view as ContractionPlan takes them
+  *
+  *   ContractionPlan indexes with int, so the view must span fewer than
+  *   2^31 entries. Axes of extent 1 are never stepped along and get stride 0.
+  */
+  std::vector<int> plan_strides(const std::vector<int>& dims, const std::vector<long>& strides) {
+    tensor_assert_message(span(dims, strides)<=INT_MAX, "A view spanning "
+      << span(dims, strides) << " entries is too large to contract in memory; "
+      << "use the out-of-core einstein");
+    std::vector<int> ret(dims.size());
+    for (int i=0;i<dims.size();++i) ret[i] = dims[i]==1 ? 0 : strides[i];
+    return ret;
+  }
+
+  /// Extents of the summation labels of a contraction; its plan checks the rest
+  std::map<int, int> label_extents(const std::vector<int>& dims_a, const std::vector<int>& a,
+      const std::vector<int>& dims_b, const std::vector<int>& b) {
+    tensor_assert(a.size()==dims_a.size() && b.size()==dims_b.size());
+    std::map<int, int> extent;
+    for (int k=0;k<2;++k) {
+      const std::vector<int>& labels = k ? b : a;
+      const std::vector<int>& dims = k ? dims_b : dims_a;
+      for (int i=0;i<labels.size();++i) {
+        if (labels[i]>=0) continue;
+        int e = extent.insert(std::make_pair(labels[i], dims[i])).first->second;
+        tensor_assert_message(e==dims[i], "Label " << labels[i] << " has extents " << e
+          << " and " << dims[i]);
+      }
+    }
+    return extent;
+  }
+
+  std::vector<int> result_dims(const std::map<int, int>& extent, const std::vector<int>& c) {
+    std::vector<int> dims;
+    for (int l : c) {
+      auto it = extent.find(l);
+      tensor_assert_message(it!=extent.end(), "Label " << l << " of c occurs in neither a nor b");
+      dims.push_back(it->second);
+    }
+    return dims;
+  }
+}
+
+struct MappedTensor::Mapping {
+  Mapping() : addr(nullptr), size(0) {}
+  ~Mapping() {
+    if (addr) munmap(addr, size);
+  }
+
+  static std::shared_ptr<Mapping> open(const std::string& filename) {
+    tensor_assert_message(little_endian(), "npy files are only supported on little-endian hosts");
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    tensor_assert_message(fd>=0, "Cannot open " << filename);
+    struct stat st;
+    if (fstat(fd, &st)!=0 || st.st_size==0) {
+      ::close(fd);
+      tensor_assert_message(false, "Cannot map empty or unreadable file " << filename);
+    }
+    std::shared_ptr<Mapping> map = std::make_shared<Mapping>();
+    map->size = st.st_size;
+    void* addr = mmap(nullptr, map->size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    tensor_assert_message(addr!=MAP_FAILED, "Cannot map " << filename);
+    map->addr = addr;
+    return map;
+  }
+
+  /// Create filename holding header followed by size zero bytes, mapped writable
+  static std::shared_ptr<Mapping> create(const std::string& filename, const std::string& header,
+      std::size_t size) {
+    tensor_assert_message(little_endian(), "npy files are only supported on little-endian hosts");
+    int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tensor_assert_message(fd>=0, "Cannot open " << filename << " for writing");
+    std::shared_ptr<Mapping> map = std::make_shared<Mapping>();
+    map->size = header.size()+size;
+    bool ok = ::write(fd, header.data(), header.size())==header.size() &&
+      ftruncate(fd, map->size)==0;
+    void* addr = ok ? mmap(nullptr, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    tensor_assert_message(addr!=MAP_FAILED, "Cannot map " << filename << " for writing");
+    map->addr = addr;
+    return map;
+  }
+
+  const unsigned char* bytes() const { return static_cast<const unsigned char*>(addr); }
+
+  /** \brief Advise the kernel on the pages spanned by [lo, hi)
+  *
+  *   Only the part of the range within the file mapping is advised: copies
+  *   are anonymous memory, which MADV_DONTNEED would zero.
+  */
+  void advise(const double* lo, const double* hi, int advice) const {
+    std::uintptr_t b = std::max(reinterpret_cast<std::uintptr_t>(lo),
+      reinterpret_cast<std::uintptr_t>(addr));
+    std::uintptr_t e = std::min(reinterpret_cast<std::uintptr_t>(hi),
+      reinterpret_cast<std::uintptr_t>(addr)+size);
+    if (b>=e) return;
+    std::uintptr_t page = sysconf(_SC_PAGESIZE);
+    if (advice==MADV_DONTNEED) {
+      // Only pages entirely within the range
+      b = (b+page-1)/page*page;
+      e = e/page*page;
+    } else {
+      b = b/page*page;
+      e = (e+page-1)/page*page;
+    }
+    if (b<e) madvise(reinterpret_cast<void*>(b), e-b, advice);
+  }
+
+  void* addr;
+  std::size_t size;
+  /// Entries that were not aligned in the file
+  std::vector< std::vector<double> > copies;
+
+  private:
+    Mapping(const Mapping&);
+    Mapping& operator=(const Mapping&);
+};
+
+MappedTensor::MappedTensor(const std::string& filename) {
+  std::shared_ptr<Mapping> map = Mapping::open(filename);
+  *this = parse(map, 0, map->size, filename);
+}
+
+MappedTensor::MappedTensor(const std::shared_ptr<const Mapping>& map, const double* ptr,
+    const std::vector<int>& dims, const std::vector<long>& strides) :
+    map_(map), ptr_(ptr), dims_(dims), strides_(strides) {
+}
+
+MappedTensor MappedTensor::parse(const std::shared_ptr<Mapping>& map, std::size_t begin,
+    std::size_t size, const std::string& name) {
+  const unsigned char* p = map->bytes()+begin;
+  tensor_assert_message(size>=10 && std::memcmp(p, NPY_MAGIC, 6)==0, name << " is not an npy file");
+  int major = p[6];
+  tensor_assert_message(major>=1 && major<=3, "Unsupported npy version " << major << " in " << name);
+  std::size_t prefix = major==1 ? 10 : 12;
+  tensor_assert(size>=prefix);
+  std::size_t header_len = get(p+8, major==1 ? 2 : 4);
+  tensor_assert_message(prefix+header_len<=size, "Truncated npy header in " << name);
+  std::string header(reinterpret_cast<const char*>(p+prefix), header_len);
+
+  std::string descr = npy_field(header, "descr");
+  tensor_assert_message(descr=="'<f8'", "Only little-endian float64 is supported, " << name
+    << " holds " << descr);
+  bool fortran = npy_field(header, "fortran_order")=="True";
+  std::vector<int> dims = npy_shape(npy_field(header, "shape"));
+
+  std::size_t offset = prefix+header_len;
+  std::size_t n = n_entries(dims);
+  tensor_assert_message(offset<=size && n<=(size-offset)/sizeof(double),
+    "Truncated npy data in " << name);
+  const double* data = reinterpret_cast<const double*>(p+offset);
+  if (reinterpret_cast<std::uintptr_t>(data) % alignof(double)) {
+    map->copies.push_back(std::vector<double>(n));
+    std::memcpy(map->copies.back().data(), p+offset, sizeof(double)*n);
+    data = map->copies.back().data();
+  }
+
+  return MappedTensor(map, data, dims, strides_64(dims, fortran));
+}
+
+std::map<std::string, MappedTensor> MappedTensor::load_npz(const std::string& filename) {
+  std::shared_ptr<Mapping> map = Mapping::open(filename);
+  const unsigned char* p = map->bytes();
+  std::size_t size = map->size;
+
+  // End of central directory record, followed by a comment of at most 64k
+  std::size_t end = std::string::npos;
+  if (size>=22) {
+    std::size_t first = size-22>65535 ? size-22-65535 : 0;
+    for (std::size_t i=size-22;;--i) {
+      if (get(p+i, 4)==ZIP_END) {
+        end = i;
+        break;
+      }
+      if (i==first) break;
+    }
+  }
+  tensor_assert_message(end!=std::string::npos, filename << " is not a zip archive");
+  // Whether n bytes at offset lie within the file, without overflowing
+  auto within = [size](std::uint64_t offset, std::uint64_t n) {
+    return offset<=size && n<=size-offset;
+  };
+  std::uint64_t n_entries = get(p+end+10, 2);
+  std::uint64_t cd_offset = get(p+end+16, 4);
+  if (end>=20 && get(p+end-20, 4)==ZIP64_LOCATOR) {
+    std::uint64_t z = get(p+end-20+8, 8);
+    tensor_assert_message(within(z, 56) && get(p+z, 4)==ZIP64_END, "Corrupt zip64 record in "
+      << filename);
+    n_entries = get(p+z+32, 8);
+    cd_offset = get(p+z+48, 8);
+  }
+
+  std::map<std::string, MappedTensor> ret;
+  std::uint64_t q = cd_offset;
+  for (std::uint64_t e=0;e<n_entries;++e) {
+    tensor_assert_message(within(q, 46) && get(p+q, 4)==ZIP_CENTRAL, "Corrupt zip directory in "
+      << filename);
+    int method = get(p+q+10, 2);
+    std::uint64_t usize = get(p+q+24, 4);
+    std::uint64_t csize = get(p+q+20, 4);
+    int name_len = get(p+q+28, 2);
+    int extra_len = get(p+q+30, 2);
+    int comment_len = get(p+q+32, 2);
+    std::uint64_t local = get(p+q+42, 4);
+    tensor_assert_message(within(q+46, name_len+extra_len+comment_len), "Corrupt zip directory in "
+      << filename);
+    std::string name(reinterpret_cast<const char*>(p+q+46), name_len);
+
+    // 64-bit values replace the saturated ones, in this order
+    const unsigned char* x = p+q+46+name_len;
+    const unsigned char* x_end = x+extra_len;
+    while (x_end-x>=4) {
+      int id = get(x, 2);
+      int len = get(x+2, 2);
+      const unsigned char* v = x+4;
+      tensor_assert_message(len<=x_end-v, "Corrupt extra field of " << name << " in " << filename);
+      const unsigned char* v_end = v+len;
+      auto widen = [&](std::uint64_t& field) {
+        if (field!=ZIP_MAX32) return;
+        tensor_assert_message(v_end-v>=8, "Truncated zip64 field of " << name << " in "
+          << filename);
+        field = get(v, 8);
+        v+= 8;
+      };
+      if (id==ZIP64_EXTRA) {
+        widen(usize);
+        widen(csize);
+        widen(local);
+      }
+      x = v_end;
+    }
+    q+= 46+name_len+extra_len+comment_len;
+
+    // Other members, such as directories, are not arrays
+    if (name.size()<=4 || name.compare(name.size()-4, 4, ".npy")!=0) continue;
+    tensor_assert_message(method==0, "Entry " << name << " of " << filename
+      << " is compressed and cannot be mapped; write it with np.savez");
+    tensor_assert_message(within(local, 30) && get(p+local, 4)==ZIP_LOCAL,
+      "Corrupt local header of " << name << " in " << filename);
+    std::uint64_t data = local+30+get(p+local+26, 2)+get(p+local+28, 2);
+    tensor_assert_message(within(data, usize), "Truncated entry " << name << " in " << filename);
+
+    ret.insert(std::make_pair(name.substr(0, name.size()-4),
+      parse(map, data, usize, filename + ":" + name)));
+  }
+  return ret;
+}
+
+MappedTensor MappedTensor::index(const std::vector<int>& ind) const {
+  tensor_assert(ind.size()==n_dims());
+  std::vector<int> dims;
+  std::vector<long> strides;
+  const double* ptr = ptr_;
+  for (int i=0;i<n_dims();++i) {
+    if (ind[i]==-1) {
+      dims.push_back(dims_[i]);
+      strides.push_back(strides_[i]);
+    } else {
+      tensor_assert(ind[i]>=0 && ind[i]<dims_[i]);
+      ptr+= static_cast<std::ptrdiff_t>(ind[i])*strides_[i];
+    }
+  }
+  return MappedTensor(map_, ptr, dims, strides);
+}
+
+MappedTensor MappedTensor::reorder_dims(const std::vector<int>& order) const {
+  tensor_assert(order.size()==n_dims());
+  std::vector<bool> occured(n_dims(), false);
+  for (int i : order) {
+    tensor_assert(i>=0 && i<n_dims());
+    occured[i] = true;
+  }
+  for (bool occ : occured) tensor_assert(occ);
+  return MappedTensor(map_, ptr_, reorder(dims_, order), reorder(strides_, order));
+}
+
+long MappedTensor::numel() const {
+  return n_entries(dims_);
+}
+
+DT MappedTensor::materialize() const {
+  tensor_assert_message(numel()<=INT_MAX, "Cannot materialize " << numel() << " entries; "
+    << "take a slice first");
+  DM r = DM::zeros(DT::normalize_dim(dims_));
+  if (strides_==strides_64(dims_, true)) {
+    std::memcpy(r.ptr(), ptr_, sizeof(double)*numel());
+  } else {
+    double* pr = r.ptr();
+    for_each_entry(dims_, strides_, [&](long i, std::ptrdiff_t sub) { pr[i] = ptr_[sub]; });
+  }
+  return DT(std::move(r), dims_);
+}
+
+MappedTensor MappedTensor::slice(const std::vector<int>& labels, int l, int begin, int end) const {
+  std::vector<int> dims = dims_;
+  const double* ptr = ptr_;
+  for (int i=0;i<n_dims();++i) {
+    if (labels[i]!=l) continue;
+    ptr+= static_cast<std::ptrdiff_t>(begin)*strides_[i];
+    dims[i] = end-begin;
+  }
+  return MappedTensor(map_, ptr, dims, strides_);
+}
+
+DT MappedTensor::contract(const double* b, const std::vector<int>& dims_b,
+    const std::vector<long>& strides_b, const std::vector<int>& a, const std::vector<int>& b_l,
+    const std::vector<int>& c) const {
+  TENSOR_TRACE_SCOPE("einstein", DM);
+  std::map<int, int> extent = label_extents(dims_, a, dims_b, b_l);
+  double n_iter = 1;
+  for (const auto& e : extent) n_iter*= e.second;
+  tensor_assert_message(n_iter<=INT_MAX && n_entries(result_dims(extent, c))<=INT_MAX,
+    "A contraction of " << n_iter << " scalar products is too large to run in memory; "
+    << "use the out-of-core einstein");
+  std::shared_ptr<const ContractionPlan> plan = ContractionPlan::get(dims_,
+    plan_strides(dims_, strides_), dims_b, plan_strides(dims_b, strides_b), a, b_l, c);
+  TENSOR_TRACE_COUNT(product(plan->dims()), 2.0*plan->n_iter(),
+    8.0*(numel()+n_entries(dims_b)+product(plan->dims())));
+
+  int n_threads = ContractionPlan::num_threads();
+  if (plan->n_iter()<ContractionPlan::parallel_threshold()) n_threads = 1;
+  DM r = DM::zeros(DT::normalize_dim(plan->dims()));
+  dense_contract(*plan, ptr_, b, r.ptr(), n_threads);
+  return DT(std::move(r), plan->dims());
+}
+
+DT MappedTensor::einstein(const DT& B, const std::vector<int>& a,
+    const std::vector<int>& b, const std::vector<int>& c) const {
+  DT Bd = B.dense();
+  return contract(Bd.data().ptr(), Bd.dims(), strides_64(Bd.dims(), true), a, b, c);
+}
+
+DT MappedTensor::einstein(const MappedTensor& B, const std::vector<int>& a,
+    const std::vector<int>& b, const std::vector<int>& c) const {
+  return contract(B.ptr(), B.dims(), B.strides(), a, b, c);
+}
+
+MappedTensor MappedTensor::einstein(const MappedTensor& B, const std::vector<int>& a,
+    const std::vector<int>& b, const std::vector<int>& c, const std::string& filename,
+    std::size_t memory_budget, int tile_label) const {
+  TENSOR_TRACE_SCOPE("einstein_out_of_core", DM);
+  const MappedTensor& A = *this;
+  tensor_assert(a.size()==A.n_dims() && b.size()==B.n_dims());
+  std::map<int, int> extent = label_extents(A.dims(), a, B.dims(), b);
+  std::vector<int> dims_c = result_dims(extent, c);
+  long numel_c = n_entries(dims_c);
+  // Scalar products of a tile of t entries along label l
+  auto n_iter = [&](int l, double t) {
+    double n = 1;
+    for (const auto& e : extent) n*= e.first==l ? t : e.second;
+    return n;
+  };
+  TENSOR_TRACE_COUNT(numel_c, 2.0*n_iter(0, 0), 8.0*(A.numel()+B.numel()+numel_c));
+
+  auto occurs = [](const std::vector<int>& labels, int l) {
+    return std::count(labels.begin(), labels.end(), l);
+  };
+  auto axis_of = [&](int l) {
+    return static_cast<int>(std::find(c.begin(), c.end(), l)-c.begin());
+  };
+  // Bytes held by a tile of t entries along label l: the operands, the result and its buffer,
+  // and for matrix products a gathered copy (8 bytes) and an index table (4 bytes) per entry
+  // of each operand and of the result
+  auto cost = [&](int l, double t) {
+    double f = l ? t/dims_c[axis_of(l)] : 1;
+    double n_a = (occurs(a, l) ? f : 1)*A.numel();
+    double n_b = (occurs(b, l) ? f : 1)*B.numel();
+    double n_c = f*numel_c;
+    return 8*(n_a+n_b+2*n_c) + 12*(n_a+n_b+n_c);
+  };
+
+  if (tile_label) {
+    tensor_assert_message(occurs(c, tile_label)==1, "Tile label " << tile_label
+      << " must occur exactly once in c");
+  } else {
+    for (int l : c) {
+      if (occurs(c, l)!=1 || dims_c[axis_of(l)]==0) continue;
+      if (!tile_label || cost(l, 1)<cost(tile_label, 1)) tile_label = l;
+    }
+  }
+
+  // Tiles are contracted in memory, indexed with int
+  auto dims_tile = [&](std::vector<int> dims, const std::vector<int>& labels, int t) {
+    for (int i=0;i<dims.size();++i) if (tile_label && labels[i]==tile_label) dims[i] = t;
+    return dims;
+  };
+  auto indexable = [&](int t) {
+    return n_iter(tile_label, t)<=INT_MAX && n_entries(dims_tile(dims_c, c, t))<=INT_MAX &&
+      span(dims_tile(A.dims(), a, t), A.strides())<=INT_MAX &&
+      span(dims_tile(B.dims(), b, t), B.strides())<=INT_MAX;
+  };
+
+  // Largest tile within the budget
+  int n = tile_label ? dims_c[axis_of(tile_label)] : 1;
+  int t = n;
+  if (cost(tile_label, n)>memory_budget || !indexable(n)) {
+    tensor_assert_message(cost(tile_label, 1)<=memory_budget, "A memory budget of "
+      << memory_budget << " bytes is too small: the smallest tile needs " << cost(tile_label, 1)
+      << " bytes");
+    tensor_assert_message(indexable(1), "The smallest tile along label " << tile_label
+      << " spans 2^31 entries or more; choose another tile_label");
+    // Both conditions hold for t=lo and fail for t=hi
+    int lo = 1, hi = n;
+    while (hi-lo>1) {
+      int mid = lo+(hi-lo)/2;
+      if (cost(tile_label, mid)<=memory_budget && indexable(mid)) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    t = lo;
+  }
+
+  std::shared_ptr<Mapping> out = Mapping::create(filename, npy_header(dims_c),
+    sizeof(double)*numel_c);
+  double* pc = reinterpret_cast<double*>(static_cast<unsigned char*>(out->addr)+
+    npy_header(dims_c).size());
+  std::vector<long> strides_c = strides_64(dims_c, true);
+  int axis = tile_label ? axis_of(tile_label) : -1;
+  // Tiles along the last nontrivial axis are contiguous in the result
+  bool in_place = true;
+  for (int i=axis+1;axis>=0 && i<dims_c.size();++i) in_place&= dims_c[i]==1;
+
+  // Address ranges of the entries of a view
+  auto first = [](const MappedTensor& x) { return x.ptr(); };
+  auto last = [](const MappedTensor& x) {
+    if (x.numel()==0) return x.ptr();
+    std::ptrdiff_t e = 1;
+    for (int i=0;i<x.n_dims();++i) e+= static_cast<std::ptrdiff_t>(x.dims(i)-1)*x.strides()[i];
+    return x.ptr()+e;
+  };
+  auto tile = [&](const MappedTensor& x, const std::vector<int>& labels, int begin) {
+    return tile_label ? x.slice(labels, tile_label, begin, std::min(begin+t, n)) : x;
+  };
+
+  std::vector<double> buf;
+  for (int begin=0;begin<n && n_iter(0, 0)>0;begin+=t) {
+    MappedTensor At = tile(A, a, begin);
+    MappedTensor Bt = tile(B, b, begin);
+    int next = begin+t;
+    if (next<n) {
+      // Read ahead while this tile is computed
+      MappedTensor An = tile(A, a, next);
+      MappedTensor Bn = tile(B, b, next);
+      A.map_->advise(first(An), last(An), MADV_WILLNEED);
+      B.map_->advise(first(Bn), last(Bn), MADV_WILLNEED);
+    }
+
+    // Same labels as the whole contraction, hence the same summation order per entry.
+    // Not taken from the plan cache, which would keep the index tables of every tile
+    ContractionPlan p(At.dims(), plan_strides(At.dims(), At.strides()), Bt.dims(),
+      plan_strides(Bt.dims(), Bt.strides()), a, b, c);
+    int n_threads = ContractionPlan::num_threads();
+    if (p.n_iter()<ContractionPlan::parallel_threshold()) n_threads = 1;
+    double* pt = axis>=0 ? pc+static_cast<std::ptrdiff_t>(begin)*strides_c[axis] : pc;
+    if (in_place) {
+      dense_contract(p, At.ptr(), Bt.ptr(), pt, n_threads);
+    } else {
+      buf.assign(product(p.dims()), 0.0);
+      dense_contract(p, At.ptr(), Bt.ptr(), buf.data(), n_threads);
+      for_each_entry(p.dims(), strides_c, [&](long i, std::ptrdiff_t sub) { pt[sub] = buf[i]; });
+    }
+
+    // Drop the pages that the next tile does not read
+    if (next<n) {
+      A.map_->advise(first(At), std::min(last(At), first(tile(A, a, next))), MADV_DONTNEED);
+      B.map_->advise(first(Bt), std::min(last(Bt), first(tile(B, b, next))), MADV_DONTNEED);
+    }
+  }
+  tensor_assert_message(msync(out->addr, out->size, MS_SYNC)==0, "Failed writing " << filename);
+  out.reset();
+  return MappedTensor(filename);
+}
+
+MappedTensor MappedTensor::partial_product(const MappedTensor& B, const std::string& filename,
+    std::size_t memory_budget) const {
+  const MappedTensor& A = *this;
+  tensor_assert(B.n_dims()>=2);
+  tensor_assert(A.n_dims()>=2);
+
+  bool fixed = A.n_dims()==2;
+  if (!fixed) {
+    for (int i=2;i<A.n_dims();i++) tensor_assert(A.dims(i)==B.dims(i));
+  }
+  tensor_assert(B.dims(1)==A.dims(0));
+
+  std::vector<int> a_r;
+  if (fixed) {
+    a_r = {-1, -B.n_dims()-1};
+  } else {
+    a_r = mrange(A.n_dims());
+    a_r[1] = -B.n_dims()-1;
+  }
+  std::vector<int> b_r = mrange(B.n_dims());
+  b_r[0] = -B.n_dims()-1;
+  std::vector<int> c_r = mrange(B.n_dims());
+
+  return einstein(B, a_r, b_r, c_r, filename, memory_budget);
+}
+
+template <>
+void Tensor<DM>::save(const std::string& filename) const {
+  tensor_assert_message(little_endian(), "npy files are only supported on little-endian hosts");
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  tensor_assert_message(out.good(), "Cannot open " << filename << " for writing");
+  Writer w(out);
+  w.write(npy_header(dims()));
+  write_entries(w, data());
+  tensor_assert_message(out.good(), "Failed writing " << filename);
+}
+
+template <>
+Tensor<DM> Tensor<DM>::load(const std::string& filename) {
+  return MappedTensor(filename).materialize();
+}
+
+void save_npz(const std::string& filename, const std::map<std::string, DT>& arrays) {
+  tensor_assert_message(little_endian(), "npy files are only supported on little-endian hosts");
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  tensor_assert_message(out.good(), "Cannot open " << filename << " for writing");
+
+  struct Entry {
+    std::string name;
+    std::uint64_t offset;
+    std::uint64_t size;
+    std::uint32_t crc;
+  };
+  std::vector<Entry> entries;
+
+  for (auto& a : arrays) {
+    Entry e;
+    e.name = a.first + ".npy";
+    e.offset = out.tellp();
+
+    // Sizes go in a zip64 extra field; padding aligns the data for mapping
+    std::size_t base = e.offset+30+e.name.size()+20;
+    std::size_t pad = (NPY_ALIGN-base % NPY_ALIGN) % NPY_ALIGN;
+    if (pad>0 && pad<4) pad+= NPY_ALIGN;
+    std::string local = le(ZIP_LOCAL, 4) + le(ZIP_VERSION, 2) + le(0, 2) + le(0, 2) +
+      le(0, 2) + le(ZIP_DATE, 2) + le(0, 4) + le(ZIP_MAX32, 4) + le(ZIP_MAX32, 4) +
+      le(e.name.size(), 2) + le(20+pad, 2) + e.name +
+      le(ZIP64_EXTRA, 2) + le(16, 2) + le(0, 8) + le(0, 8);
+    if (pad) local+= le(ZIP_ALIGN_EXTRA, 2) + le(pad-4, 2) + std::string(pad-4, '\0');
+    out.write(local.data(), local.size());
+
+    // Stream the entry, then fill in its checksum and size
+    Writer w(out);
+    w.write(npy_header(a.second.dims()));
+    write_entries(w, a.second.data());
+    e.size = w.n;
+    e.crc = w.checksum();
+    std::streampos end = out.tellp();
+    out.seekp(e.offset+14);
+    out.write(le(e.crc, 4).data(), 4);
+    out.seekp(e.offset+30+e.name.size()+4);
+    out.write((le(e.size, 8) + le(e.size, 8)).data(), 16);
+    out.seekp(end);
+    entries.push_back(e);
+  }
+
+  std::uint64_t cd_offset = out.tellp();
+  for (auto& e : entries) {
+    std::string central = le(ZIP_CENTRAL, 4) + le(ZIP_VERSION, 2) + le(ZIP_VERSION, 2) +
+      le(0, 2) + le(0, 2) + le(0, 2) + le(ZIP_DATE, 2) + le(e.crc, 4) +
+      le(ZIP_MAX32, 4) + le(ZIP_MAX32, 4) + le(e.name.size(), 2) + le(28, 2) + le(0, 2) +
+      le(0, 2) + le(0, 2) + le(0, 4) + le(ZIP_MAX32, 4) + e.name +
+      le(ZIP64_EXTRA, 2) + le(24, 2) + le(e.size, 8) + le(e.size, 8) + le(e.offset, 8);
+    out.write(central.data(), central.size());
+  }
+  std::uint64_t z64_offset = out.tellp();
+  std::uint64_t cd_size = z64_offset-cd_offset;
+
+  std::string tail = le(ZIP64_END, 4) + le(44, 8) + le(ZIP_VERSION, 2) + le(ZIP_VERSION, 2) +
+    le(0, 4) + le(0, 4) + le(entries.size(), 8) + le(entries.size(), 8) +
+    le(cd_size, 8) + le(cd_offset, 8) +
+    le(ZIP64_LOCATOR, 4) + le(0, 4) + le(z64_offset, 8) + le(1, 4) +
+    le(ZIP_END, 4) + le(0, 2) + le(0, 2) +
+    le(std::min<std::size_t>(entries.size(), 0xFFFF), 2) +
+    le(std::min<std::size_t>(entries.size(), 0xFFFF), 2) +
+    le(ZIP_MAX32, 4) + le(ZIP_MAX32, 4) + le(0, 2);
+  out.write(tail.data(), tail.size());
+  tensor_assert_message(out.good(), "Failed writing " << filename);
+}
@@ -0,0 +1,121 @@
+#ifndef MAPPED_TENSOR_HPP_INCLUDE
+#define MAPPED_TENSOR_HPP_INCLUDE
+
+#include <map>
+#include "tensor.hpp"
+
+/** \brief Read-only numeric tensor on a memory-mapped .npy file
+
+  Nothing is read or copied at load time: pages of the file are brought in
+  as the entries are touched, and are shared with other processes mapping
+  the same file. Only little-endian float64 ('<f8') data is supported.
+
+  Files in C order, numpy's default, are viewed with reversed strides, so
+  that dims always match the numpy shape. Contractions read the mapped
+  entries in place; materialize copies them into a DT.
+
+  Copies, slices and permutations share the mapping, which is released
+  with the last of them.
+
+  Strides and sizes are 64-bit, so files may hold more than 2^31 entries.
+  A contraction reads views of fewer than 2^31 entries: the whole operands
+  in memory, or one tile of them out of core.
+*/
+class MappedTensor {
+  public:
+    /// Map an .npy file
+    explicit MappedTensor(const std::string& filename);
+
+    /** \brief Map every array of an .npz archive, by name without the .npy suffix
+    *
+    *   The entries must be stored uncompressed, as np.savez and save_npz do;
+    *   np.savez_compressed archives are rejected. Entries that are not
+    *   8-byte aligned in the archive are copied.
+    */
+    static std::map<std::string, MappedTensor> load_npz(const std::string& filename);
+
+    int n_dims() const { return dims_.size(); }
+    const std::vector<int>& dims() const { return dims_; }
+    int dims(int i) const { return dims_[i]; }
+    long numel() const;
+    /// Distance between neighbours along each axis, in entries
+    const std::vector<long>& strides() const { return strides_; }
+    /// First entry
+    const double* ptr() const { return ptr_; }
+
+    /** \brief Make a slice, without copying
+    *
+    *   -1  indicates a slice
+    */
+    MappedTensor index(const std::vector<int>& ind) const;
+
+    /** \brief Generalization of transpose, without copying */
+    MappedTensor reorder_dims(const std::vector<int>& order) const;
+
+    /// Copy the entries into a dense tensor
+    DT materialize() const;
+    operator DT() const { return materialize(); }
+
+    /** \brief Contraction with a numeric tensor, see Tensor::einstein
+    *
+    *   The mapped entries are read in place.
+    */
+    DT einstein(const DT& B, const std::vector<int>& a,
+      const std::vector<int>& b, const std::vector<int>& c) const;
+    DT einstein(const MappedTensor& B, const std::vector<int>& a,
+      const std::vector<int>& b, const std::vector<int>& c) const;
+
+    /** \brief Out-of-core contraction into an .npy file, see Tensor::einstein
+    *
+    *   For operands and results that need not fit in memory. The result is
+    *   computed in tiles along one label of c: tile_label, or if 0, the label
+    *   that shrinks the tiles most. A tile reads the slices of A and B along
+    *   that label, which are prefetched while the previous tile is computed
+    *   and dropped after use, and is stored in filename, an .npy file in
+    *   Fortran order. Tiles are as large as memory_budget (bytes) allows for
+    *   the slices of A and B plus twice the tile of the result, and for the
+    *   gathered copies and index tables of a matrix product on all three.
+    *
+    *   Each entry of the result is accumulated in the same order as by the
+    *   in-memory contraction, without ContractionKernel: the results are
+    *   bit-identical. Returns the mapped result.
+    */
+    MappedTensor einstein(const MappedTensor& B, const std::vector<int>& a,
+      const std::vector<int>& b, const std::vector<int>& c, const std::string& filename,
+      std::size_t memory_budget, int tile_label=0) const;
+
+    /// Out-of-core Tensor::partial_product, see einstein
+    MappedTensor partial_product(const MappedTensor& B, const std::string& filename,
+      std::size_t memory_budget) const;
+
+    struct Mapping;
+
+  private:
+    MappedTensor(const std::shared_ptr<const Mapping>& map, const double* ptr,
+      const std::vector<int>& dims, const std::vector<long>& strides);
+
+    /// View on the .npy image at [begin, begin+size) of the mapping
+    static MappedTensor parse(const std::shared_ptr<Mapping>& map, std::size_t begin,
+      std::size_t size, const std::string& name);
+
+    /// Restrict the axes carrying label l of labels to [begin, end)
+    MappedTensor slice(const std::vector<int>& labels, int l, int begin, int end) const;
+
+    DT contract(const double* b, const std::vector<int>& dims_b, const std::vector<long>& strides_b,
+      const std::vector<int>& a, const std::vector<int>& b_l, const std::vector<int>& c) const;
+
+    std::shared_ptr<const Mapping> map_;
+    const double* ptr_;
+    std::vector<int> dims_;
+    std::vector<long> strides_;
+};
+
+/** \brief Write numeric tensors to an uncompressed .npz archive
+*
+*   Each tensor is streamed to the file as it is written; no staging copy
+*   of the archive is made. Entries are aligned for MappedTensor::load_npz.
+*   np.load reads the archive, with keys as given.
+*/
+void save_npz(const std::string& filename, const std::map<std::string, DT>& arrays);
+
+#endif
@@ -0,0 +1,62 @@
+#include "private_dir.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::string user_cache_dir(const std::string& name) {
+  const char* xdg = std::getenv("XDG_CACHE_HOME");
+  if (xdg && *xdg=='/') return std::string(xdg) + "/tensortools/" + name;
+  const char* home = std::getenv("HOME");
+  std::string h = home && *home ? home : "";
+  if (h.empty()) {
+    passwd* pw = getpwuid(geteuid());
+    if (pw && pw->pw_dir) h = pw->pw_dir;
+  }
+  return h + "/.cache/tensortools/" + name;
+}
+
+bool make_private_dir(const std::string& dir) {
+  if (dir.empty()) return false;
+  // Parents first; existing ones are left as they are
+  for (std::size_t i=dir.find('/', 1);i!=std::string::npos;i=dir.find('/', i+1)) {
+    mkdir(dir.substr(0, i).c_str(), 0700);
+  }
+  if (mkdir(dir.c_str(), 0700)!=0 && errno!=EEXIST) return false;
+
+  struct stat st;
+  if (lstat(dir.c_str(), &st)!=0) return false;
+  return S_ISDIR(st.st_mode) && st.st_uid==geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH))==0;
+}
+
+std::string shell_quote(const std::string& s) {
+  std::string r = "'";
+  for (char c : s) {
+    if (c=='\'') {
+      r+= "'\\''";
+    } else {
+      r+= c;
+    }
+  }
+  return r + "'";
+}
+
+std::string env_or(const char* name, const std::string& fallback) {
+  const char* v = std::getenv(name);
+  return v && *v ? std::string(v) : fallback;
+}
+
+std::string stable_hash(const std::string& s) {
+  std::uint64_t h = 14695981039346656037ull;
+  for (unsigned char ch : s) {
+    h^= ch;
+    h*= 1099511628211ull;
+  }
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+  return buf;
+}
@@ -0,0 +1,30 @@
+#ifndef PRIVATE_DIR_HPP_INCLUDE
+#define PRIVATE_DIR_HPP_INCLUDE
+
+#include <string>
+
+/** \brief Default location of a per-user cache
+*
+*   $XDG_CACHE_HOME/tensortools/<name>, or ~/.cache/tensortools/<name>.
+*/
+std::string user_cache_dir(const std::string& name);
+
+/** \brief Create dir and its missing parents with mode 0700, and check it
+*
+*   Returns whether dir is a directory, not a symbolic link, owned by the
+*   effective user and not writable by group or others. Files in any other
+*   directory could have been planted by another user and must not be
+*   loaded from it.
+*/
+bool make_private_dir(const std::string& dir);
+
+/// Quote s as a single word for the shell
+std::string shell_quote(const std::string& s);
+
+/// Value of the environment variable name, or fallback if unset or empty
+std::string env_or(const char* name, const std::string& fallback);
+
+/// FNV-1a of s as 16 hex digits, stable across processes and platforms
+std::string stable_hash(const std::string& s);
+
+#endif
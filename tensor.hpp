@@ -4,9 +4,15 @@
 #include <iostream>
 #include <fstream>
 #include <ctime>
+#include <algorithm>
 #include <assert.h>
 #include <casadi/casadi.hpp>
 #include "tensor_exception.hpp"
+#include "contraction_plan.hpp"
+#include "dense_kernels.hpp"
+#include "contraction_jit.hpp"
+#include "tensor_trace.hpp"
+#include "einstein_memo.hpp"
 
 using namespace casadi;
 using namespace std;
@@ -33,6 +39,221 @@ std::vector<T> mrange(T start, T stop) {
 
 #ifndef SWIG
 int product(const std::vector<int>& a);
+
+/** \brief Elementwise operations on the data of tensors of equal dimensions
+*
+*   The numeric overloads work directly on the nonzero buffers.
+*/
+template <class T>
+T elementwise_add(const T& x, const T& y) { return x+y; }
+template <class T>
+T elementwise_sub(const T& x, const T& y) { return x-y; }
+template <class T>
+T elementwise_mul(const T& x, const T& y) { return x*y; }
+template <class T>
+T elementwise_neg(const T& x) { return -x; }
+template <class T>
+T elementwise_le(const T& x, const T& y) { return x<=y; }
+template <class T>
+T elementwise_ge(const T& x, const T& y) { return x>=y; }
+
+#define DENSE_ELEMENTWISE_BINARY(NAME, KERNEL) \
+inline DM NAME(const DM& x, const DM& y) { \
+  if (!x.is_dense() || !y.is_dense() || x.size()!=y.size()) return NAME<DM>(x, y); \
+  DM r = DM::zeros(x.size()); \
+  KERNEL(x.nnz(), x.ptr(), y.ptr(), r.ptr()); \
+  return r; \
+}
+
+DENSE_ELEMENTWISE_BINARY(elementwise_add, dense_add)
+DENSE_ELEMENTWISE_BINARY(elementwise_sub, dense_sub)
+DENSE_ELEMENTWISE_BINARY(elementwise_mul, dense_mul)
+DENSE_ELEMENTWISE_BINARY(elementwise_le, dense_le)
+DENSE_ELEMENTWISE_BINARY(elementwise_ge, dense_ge)
+
+#undef DENSE_ELEMENTWISE_BINARY
+
+inline DM elementwise_neg(const DM& x) {
+  if (!x.is_dense()) return -x;
+  DM r = DM::zeros(x.size());
+  dense_neg(x.nnz(), x.ptr(), r.ptr());
+  return r;
+}
+
+/** \brief Gather nonzeros into a column: ret[i] = x[index[i]] */
+template <class T>
+T gather(const T& x, const std::vector<int>& index) {
+  T ret;
+  x.get_nz(ret, false, IM(index));
+  return ret;
+}
+
+inline DM gather(const DM& x, const std::vector<int>& index) {
+  DM ret = DM::zeros(index.size(), 1);
+  const double* px = x.ptr();
+  double* pr = ret.ptr();
+  for (int i=0;i<index.size();++i) pr[i] = px[index[i]];
+  return ret;
+}
+
+/** \brief Scatter x into a sparse column of length n: ret[index[i]] += x[i]
+*
+*   Only the rows in index become structural nonzeros.
+*/
+template <class T>
+T scatter(const T& x, const std::vector<int>& index, int n) {
+  int k = index.size();
+  // Column i of the selection matrix has a single one, on row index[i]
+  T selection = T::ones(Sparsity(n, k, range(k+1), index));
+  return mtimes(selection, x);
+}
+#endif
+
+template <class T>
+class TensorView;
+
+template <class T>
+class Tensor;
+
+#ifndef SWIG
+/** \brief Lazy elementwise expression on tensors of equal dimensions
+
+  Tensor arithmetic (+, - and *) builds these nodes instead of evaluating.
+  Dimensions are checked once, when a node is built; converting to a Tensor
+  evaluates the whole expression. Numeric expressions are evaluated in a
+  single pass, block by block, so that intermediates stay in cache.
+
+  Leaves hold a copy of their tensor, which shares its storage.
+
+  The read-only Tensor members are available on expressions too. Each call
+  evaluates the expression; convert to a Tensor to evaluate it once.
+*/
+template <class T, class E>
+struct TensorExpr {
+  const E& self() const { return static_cast<const E&>(*this); }
+  const std::vector<int>& dims() const { return self().dims(); }
+  int n_dims() const { return dims().size(); }
+  int numel() const { return product(dims()); }
+
+  T data() const { return Tensor<T>(*this).data(); }
+  T matrix() const { return Tensor<T>(*this).matrix(); }
+  int nnz() const { return Tensor<T>(*this).nnz(); }
+  bool is_sparse() const { return Tensor<T>(*this).is_sparse(); }
+  Tensor<T> dense() const { return Tensor<T>(*this).dense(); }
+
+  TensorView<T> operator()(const std::vector<int>& ind) const { return Tensor<T>(*this)(ind); }
+  TensorView<T> index(const std::vector<int>& ind) const { return Tensor<T>(*this).index(ind); }
+  TensorView<T> reorder_dims(const std::vector<int>& order) const {
+    return Tensor<T>(*this).reorder_dims(order);
+  }
+  TensorView<T> squeeze() const { return Tensor<T>(*this).squeeze(); }
+  TensorView<T> shape(const std::vector<int>& dims) const { return Tensor<T>(*this).shape(dims); }
+
+  Tensor<T> einstein(const TensorView<T>& B, const std::vector<int>& a,
+      const std::vector<int>& b, const std::vector<int>& c) const {
+    return Tensor<T>(*this).einstein(B, a, b, c);
+  }
+  Tensor<T> einstein(const std::vector<int>& a_e, const std::vector<int>& c_e) const {
+    return Tensor<T>(*this).einstein(a_e, c_e);
+  }
+  Tensor<T> solve(const Tensor<T>& B) const { return Tensor<T>(*this).solve(B); }
+  Tensor<T> outer_product(const Tensor<T>& b) const { return Tensor<T>(*this).outer_product(b); }
+  Tensor<T> inner(const Tensor<T>& b) const { return Tensor<T>(*this).inner(b); }
+  Tensor<T> partial_product(const Tensor<T>& b) const {
+    return Tensor<T>(*this).partial_product(b);
+  }
+
+  Tensor<T> operator<=(const Tensor<T>& rhs) const { return Tensor<T>(*this)<=rhs; }
+  Tensor<T> operator>=(const Tensor<T>& rhs) const { return Tensor<T>(*this)>=rhs; }
+};
+
+/// Number of entries per block in a fused numeric evaluation
+const int TENSOR_EXPR_BLOCK = 256;
+
+/// Buffer of a dense numeric matrix, null otherwise
+template <class T>
+const double* dense_ptr(const T& x) { return nullptr; }
+inline const double* dense_ptr(const DM& x) { return x.is_dense() ? x.ptr() : nullptr; }
+
+template <class T>
+class TensorLeaf : public TensorExpr<T, TensorLeaf<T> > {
+  public:
+    /// Number of elementwise operations and of leaves, for tracing
+    enum { n_ops = 0, n_leaves = 1 };
+    explicit TensorLeaf(const Tensor<T>& t) : t_(t), p_(dense_ptr(t.data())) {}
+    const std::vector<int>& dims() const { return t_.dims(); }
+    /// Entries as a matrix
+    const T& eval() const { return t_.data(); }
+    /// Whether block can be used
+    bool is_dense() const { return p_!=nullptr; }
+    /// Entries [begin, begin+n), stored in buf or elsewhere
+    const double* block(int begin, int n, double* buf) const { return p_+begin; }
+  private:
+    Tensor<T> t_;
+    const double* p_;
+};
+
+#define TENSOR_EXPR_OP(NAME, FUN, KERNEL) \
+struct NAME { \
+  template <class T> \
+  static T eval(const T& x, const T& y) { return FUN(x, y); } \
+  static void block(int n, const double* x, const double* y, double* r) { KERNEL(n, x, y, r); } \
+};
+
+TENSOR_EXPR_OP(TensorAddOp, elementwise_add, dense_add)
+TENSOR_EXPR_OP(TensorSubOp, elementwise_sub, dense_sub)
+TENSOR_EXPR_OP(TensorMulOp, elementwise_mul, dense_mul)
+
+#undef TENSOR_EXPR_OP
+
+template <class T, class Op, class L, class R>
+class TensorBinary : public TensorExpr<T, TensorBinary<T, Op, L, R> > {
+  public:
+    enum { n_ops = L::n_ops+R::n_ops+1, n_leaves = L::n_leaves+R::n_leaves };
+    TensorBinary(const L& l, const R& r) : l_(l), r_(r) {
+      tensor_assert_message(l.dims()==r.dims(),
+        "Dimension mismatch: " << l.dims() << " versus " << r.dims());
+    }
+    const std::vector<int>& dims() const { return l_.dims(); }
+    T eval() const { return Op::eval(l_.eval(), r_.eval()); }
+    bool is_dense() const { return l_.is_dense() && r_.is_dense(); }
+    const double* block(int begin, int n, double* buf) const {
+      double buf_l[TENSOR_EXPR_BLOCK];
+      double buf_r[TENSOR_EXPR_BLOCK];
+      Op::block(n, l_.block(begin, n, buf_l), r_.block(begin, n, buf_r), buf);
+      return buf;
+    }
+  private:
+    L l_;
+    R r_;
+};
+
+template <class T, class E>
+class TensorNeg : public TensorExpr<T, TensorNeg<T, E> > {
+  public:
+    enum { n_ops = E::n_ops+1, n_leaves = E::n_leaves };
+    explicit TensorNeg(const E& e) : e_(e) {}
+    const std::vector<int>& dims() const { return e_.dims(); }
+    T eval() const { return elementwise_neg(e_.eval()); }
+    bool is_dense() const { return e_.is_dense(); }
+    const double* block(int begin, int n, double* buf) const {
+      double buf_e[TENSOR_EXPR_BLOCK];
+      dense_neg(n, e_.block(begin, n, buf_e), buf);
+      return buf;
+    }
+  private:
+    E e_;
+};
+
+/// Non-deduced context, so that the other operand fixes T
+template <class T>
+struct tensor_expr_identity { typedef T type; };
+
+/// Evaluate an expression into a tensor
+template <class T, class E>
+Tensor<T> evaluate_expr(const TensorExpr<T, E>& expr);
+template <class E>
+Tensor<DM> evaluate_expr(const TensorExpr<DM, E>& expr);
 #endif
 
 template <class T>
@@ -40,49 +261,126 @@ class Tensor {
   public:
 
   template<class S>
-  Tensor(const Tensor<S>& a) : data_(T(a.data())), dims_(a.dims()) {
+  Tensor(const Tensor<S>& a) : data_(std::make_shared<T>(T(a.data()))), dims_(a.dims()) {
 
   }
 
-  static Tensor<T> concat(const std::vector< Tensor<T> >& v) {
-    tensor_assert_message(false, "Not implemented");
+  /** \brief Join tensors along an existing axis
+  *
+  *   All other dimensions must agree.
+  */
+  static Tensor<T> concat(const std::vector< Tensor<T> >& v, int axis) {
+    TENSOR_TRACE_SCOPE("concat", T);
+    tensor_assert(!v.empty());
+    std::vector<int> dims = v[0].dims();
+    tensor_assert(axis>=0 && axis<dims.size());
+    dims[axis] = 0;
+    for (auto& t : v) {
+      tensor_assert(t.n_dims()==dims.size());
+      for (int i=0;i<dims.size();++i) {
+        if (i!=axis) tensor_assert(t.dims(i)==dims[i]);
+      }
+      dims[axis]+= t.dims(axis);
+    }
+    TENSOR_TRACE_COUNT(product(dims), 0, 16.0*product(dims));
+    return Tensor(concat_blocks(v, product(std::vector<int>(dims.begin()+axis+1, dims.end()))),
+      dims);
   }
 
+  /** \brief Stack tensors of equal dimensions along a new axis
+  *
+  *   The new axis gets position axis in the result.
+  */
   static Tensor<T> pack(const std::vector< Tensor<T> >& v, int axis) {
-    auto dims = v[0].dims();
-
-    std::vector<T> data;
+    TENSOR_TRACE_SCOPE("pack", T);
+    tensor_assert(!v.empty());
+    std::vector<int> dims = v[0].dims();
+    for (auto& t : v) tensor_assert(dims==t.dims());
+    tensor_assert(axis>=0 && axis<=dims.size());
+
+    int outer = product(std::vector<int>(dims.begin()+axis, dims.end()));
+    dims.insert(dims.begin()+axis, v.size());
+    TENSOR_TRACE_COUNT(product(dims), 0, 16.0*product(dims));
+    return Tensor(concat_blocks(v, outer), dims);
+  }
 
-    for (auto& t : v) {
-      tensor_assert(dims==t.dims());
-      data.push_back(vec(t.data()).T());
+  /** \brief Slices of v along axis, without copying
+  *
+  *   Inverse of pack.
+  */
+  static std::vector< TensorView<T> > unpack(const Tensor<T>& v, int axis) {
+    tensor_assert(axis>=0 && axis<v.n_dims());
+    std::vector<int> ind(v.n_dims(), -1);
+    std::vector< TensorView<T> > ret;
+    ret.reserve(v.dims(axis));
+    for (int i=0;i<v.dims(axis);++i) {
+      ind[axis] = i;
+      ret.push_back(v.index(ind));
     }
+    return ret;
+  }
 
-    std::vector<int> new_dims = dims;
-    new_dims.insert(new_dims.begin(), v.size());
-    Tensor<T> ret = Tensor(vertcat(data), new_dims);
+  /** \brief Split each tensor in outer equal blocks, and interleave them
+  *
+  *   Returns a matrix whose column j stacks block j of v[0], v[1], ...
+  *   In column-major order, that is the concatenation along the axis
+  *   after which outer counts the remaining entries.
+  */
+  static T concat_blocks(const std::vector< Tensor<T> >& v, int outer);
 
-    if (axis!=0) tensor_assert_message(false, "Not implemented");
-    return ret;
+  /** \brief Tensor with the entries of data, in column-major order
+  *
+  *   data may be sparse. Its structural zeros are kept by views, elementwise
+  *   operations and contractions, which only visit the structural nonzeros.
+  */
+  Tensor(const T& data, const std::vector<int>& dims) :
+      data_(std::make_shared<T>(data)), dims_(dims) {
+    tensor_assert(data.numel()==product(dims));
+  }
 
+  Tensor(T&& data, const std::vector<int>& dims) :
+      data_(std::make_shared<T>(std::move(data))), dims_(dims) {
+    tensor_assert(data_->numel()==product(dims));
   }
 
-  Tensor(const T& data, const std::vector<int>& dims) : data_(data), dims_(dims) {
-    tensor_assert(data.is_dense());
-    tensor_assert(data.numel()==product(dims));
+  Tensor(const T& data) : data_(std::make_shared<T>(data)), dims_({data.size1(), data.size2()}) {
+  }
+
+  /** \brief Wrap existing storage, without copying
+  *
+  *   The storage is shared with every copy and view of the tensor, and
+  *   must not be modified afterwards.
+  */
+  Tensor(const std::shared_ptr<const T>& data, const std::vector<int>& dims) :
+      data_(data), dims_(dims) {
+    tensor_assert(data->numel()==product(dims));
+  }
+
+  /// Materialize a view
+  Tensor(const TensorView<T>& v) : Tensor(v.materialize()) {
   }
 
-  Tensor(const T& data) : data_(data), dims_({data.size1(), data.size2()}) {
-    tensor_assert(data.is_dense());
+#ifndef SWIG
+  /// Evaluate an elementwise expression
+  template <class E>
+  Tensor(const TensorExpr<T, E>& e) : Tensor(evaluate_expr(e)) {
+  }
+#endif
+
+  /// Copies share the storage until one of them is modified
+  Tensor(const Tensor& t) : data_(t.data_), dims_(t.dims()) {
   }
 
-  Tensor(const Tensor& t) : data_(t.data()), dims_(t.dims()) {
+  /// Moved-from tensors are left a scalar zero, like default constructed ones
+  Tensor(Tensor&& t) : data_(std::move(t.data_)), dims_(std::move(t.dims_)) {
+    t.data_ = zero_storage();
+    t.dims_.clear();
   }
 
-  Tensor(double a) : data_({a}), dims_({}) {
+  Tensor(double a) : data_(std::make_shared<T>(a)), dims_({}) {
   }
 
-  Tensor() : data_({0}), dims_({}) {
+  Tensor() : data_(zero_storage()), dims_({}) {
   }
 
   ~Tensor() { }
@@ -90,34 +388,70 @@ class Tensor {
 #ifndef SWIG
   Tensor& operator=(const Tensor& t) {
     dims_ = t.dims();
-    data_ = t.data();
+    data_ = t.data_;
+    return *this;
+  }
+
+  Tensor& operator=(Tensor&& t) {
+    if (this==&t) return *this;
+    dims_ = std::move(t.dims_);
+    data_ = std::move(t.data_);
+    t.data_ = zero_storage();
+    t.dims_.clear();
     return *this;
   }
 #endif
 
-  T data() const { return data_; }
+  const T& data() const { return *data_; }
+
+  /** \brief Data for modification
+  *
+  *   Storage shared with copies or views of this tensor is copied first,
+  *   so that those keep their values.
+  */
+  T& mutable_data() {
+    if (data_.use_count()>1) data_ = std::make_shared<T>(*data_);
+    return const_cast<T&>(*data_);
+  }
+
+  /// Assign a single entry
+  void set(const std::vector<int>& ind, const T& rhs) {
+    tensor_assert(rhs.is_scalar());
+    set(mutable_data(), dims_, ind, rhs);
+  }
+  /// Shared storage of the tensor
+  const std::shared_ptr<const T>& storage() const { return data_; }
   T matrix() const {
     tensor_assert(n_dims()<=2);
     if (n_dims()==0) {
-      return reshape(data_, std::pair<int, int>{1, 1});
+      return reshape(*data_, std::pair<int, int>{1, 1});
     } else if (n_dims()==1) {
-      return reshape(data_, std::pair<int, int>{dims_[0], 1});
+      return reshape(*data_, std::pair<int, int>{dims_[0], 1});
     } else if (n_dims()==2) {
-      return reshape(data_, std::pair<int, int>{dims_[0], dims_[1]});
+      return reshape(*data_, std::pair<int, int>{dims_[0], dims_[1]});
     }
     return 0;
   }
-  Tensor squeeze() const {
-    std::vector<int> dims;
-    for (int i=0;i<n_dims();++i) {
-      if (dims_[i]!=1) dims.push_back(dims_[i]);
-    }
-    return Tensor(data_, dims);
+
+  /// View on the whole tensor
+  TensorView<T> view() const {
+    return TensorView<T>(data_, dims_, contiguous_strides(dims_), 0);
   }
-  Tensor shape(const std::vector<int>& dims) const {
-    return Tensor(data_, dims);
+
+  /// Drop all dimensions of extent 1, without copying
+  TensorView<T> squeeze() const { return view().squeeze(); }
+  /// Reinterpret the entries with other dimensions, without copying
+  TensorView<T> shape(const std::vector<int>& dims) const { return view().shape(dims); }
+  int numel() const { return data_->numel(); }
+  /// Number of structural nonzeros
+  int nnz() const { return data_->nnz(); }
+  /// Whether the storage has structural zeros
+  bool is_sparse() const { return !data_->is_dense(); }
+  /// Copy with all structural zeros made explicit
+  Tensor dense() const {
+    if (!is_sparse()) return *this;
+    return Tensor(densify(*data_), dims_);
   }
-  int numel() const { return data_.numel(); }
 
   static std::pair<int, int> normalize_dim(const std::vector<int> & dims);
 
@@ -163,97 +497,77 @@ class Tensor {
     return Tensor<T>(v, dims);
   }
 
+  /** \brief Write to an .npy file, for numeric tensors
+  *
+  *   The entries are streamed in column-major order (fortran_order), so that
+  *   numpy sees the same dims. See also save_npz.
+  */
+  void save(const std::string& filename) const;
+
+  /** \brief Read an .npy file, for numeric tensors
+  *
+  *   The file is memory-mapped and copied once, without parsing; use
+  *   MappedTensor to work on the mapped entries in place.
+  */
+  static Tensor load(const std::string& filename);
+
   Tensor solve(const Tensor& B) const {
+    // LU factorization, then one forward and backward substitution per column of B
+    TENSOR_TRACE_SCOPE("solve", T);
+    TENSOR_TRACE_COUNT(B.numel(), 2.0/3*normalize_dim(dims_).first*numel()+
+      2.0*normalize_dim(dims_).first*B.numel(), 8.0*(numel()+2*B.numel()));
     return T::solve(matrix(), B.matrix(), "lapacklu", Dict());
   }
 
-  Tensor operator+(const Tensor& rhs) const {
-    assert_match_dim(dims_, rhs.dims_);
-    return Tensor(data_+rhs.data_, dims_);
+#ifndef SWIG
+  /// Elementwise arithmetic, evaluated lazily; see TensorExpr
+  TensorBinary<T, TensorAddOp, TensorLeaf<T>, TensorLeaf<T> > operator+(const Tensor& rhs) const {
+    return {TensorLeaf<T>(*this), TensorLeaf<T>(rhs)};
+  }
+
+  TensorBinary<T, TensorSubOp, TensorLeaf<T>, TensorLeaf<T> > operator-(const Tensor& rhs) const {
+    return {TensorLeaf<T>(*this), TensorLeaf<T>(rhs)};
   }
 
-  Tensor operator-() const {
-    return Tensor(-data_, dims_);
+  TensorNeg<T, TensorLeaf<T> > operator-() const {
+    return TensorNeg<T, TensorLeaf<T> >(TensorLeaf<T>(*this));
   }
 
-  Tensor operator*(const Tensor& rhs) const {
-    assert_match_dim(dims_, rhs.dims_);
-    return Tensor(data_*rhs.data_, dims_);
+  TensorBinary<T, TensorMulOp, TensorLeaf<T>, TensorLeaf<T> > operator*(const Tensor& rhs) const {
+    return {TensorLeaf<T>(*this), TensorLeaf<T>(rhs)};
   }
+#endif
 
   Tensor operator<=(const Tensor& rhs) const {
-    return Tensor(data_<=rhs.data_, dims_);
+    TENSOR_TRACE_SCOPE("elementwise", T);
+    TENSOR_TRACE_COUNT(numel(), numel(), 24.0*numel());
+    return Tensor(elementwise_le(*data_, *rhs.data_), dims_);
   }
   Tensor operator>=(const Tensor& rhs) const {
-    return Tensor(data_<=rhs.data_, dims_);
+    TENSOR_TRACE_SCOPE("elementwise", T);
+    TENSOR_TRACE_COUNT(numel(), numel(), 24.0*numel());
+    return Tensor(elementwise_ge(*data_, *rhs.data_), dims_);
   }
   /** \brief Make a slice
   *
   *   -1  indicates a slice
   */
-  Tensor operator()(const std::vector<int>& ind) const {
+  TensorView<T> operator()(const std::vector<int>& ind) const {
     return index(ind);
   }
 
-
-  Tensor index(const std::vector<int>& ind) const {
-    // Check that input is a permutation of range(n_dims())
-    tensor_assert(ind.size()==n_dims());
-
-    std::vector<int> slice_dims;
-
-    std::vector<int> slice_location;
-
-    for (int i=0;i<n_dims();++i) {
-      if (ind[i]==-1) {
-        slice_dims.push_back(dims(i));
-        slice_location.push_back(i);
-      } else {
-        tensor_assert(ind[i]>=0);
-        tensor_assert(ind[i]<dims(i));
-      }
-    }
-
-    int c=1;
-    std::vector<int> a_e;
-    std::vector<int> c_e;
-    for (int i=0;i<ind.size();++i) {
-      if (ind[i]>=0) {
-        a_e.push_back(ind[i]);
-      } else {
-        a_e.push_back(-c);
-        c_e.push_back(-c);
-        c+=1;
-      }
-    }
-
-    return einstein(a_e, c_e);
+  /** \brief Make a slice, without copying
+  *
+  *   -1  indicates a slice
+  */
+  TensorView<T> index(const std::vector<int>& ind) const {
+    return view().index(ind);
   }
 
-  /** \brief Generalization of transpose
+  /** \brief Generalization of transpose, without copying
   */
-  Tensor reorder_dims(const std::vector<int>& order) const {
-    // Check that input is a permutaion of range(n_dims())
-    tensor_assert(order.size()==n_dims());
-
-    std::vector<bool> occured(n_dims(), false);
-
-    for (int i : order) {
-      tensor_assert(i>=0);
-      tensor_assert(i<n_dims());
-      occured[i] = true;
-    }
-
-    for (bool occ : occured) {
-      tensor_assert(occ);
-    }
-
-    std::vector<int> ind(order.size());
-    for (int i=0;i<ind.size();++i) {
-      ind[i] = -order[i]-1;
-    }
-
-    return einstein(mrange(n_dims()), ind);
+  TensorView<T> reorder_dims(const std::vector<int>& order) const {
+    return view().reorder_dims(order);
   }
 
   Tensor einstein(const std::vector<int>& a_e, const std::vector<int>& c_e) const {
@@ -272,89 +586,54 @@ class Tensor {
     Instead of the classical index labels i,j,k,... we employ -1,-2,-3,...
 
   */
-  Tensor einstein(const Tensor &B, const std::vector<int>& a,
+  Tensor einstein(const TensorView<T>& B, const std::vector<int>& a,
       const std::vector<int>& b, const std::vector<int>& c) const {
+    return view().einstein(B, a, b, c);
+  }
 
-    const Tensor& A = *this;
-
-    // Dimension check
-    tensor_assert(A.n_dims()==a.size());
-    tensor_assert(B.n_dims()==b.size());
-
-    tensor_assert(c.size()<=a.size()+b.size());
+  /** \brief Contract any number of tensors, using index/einstein notation
 
-    std::map<int, int> dim_map;
+    einsum({A, B, C, ...}, {a, b, c, ...}, r) -> R
 
-    // Check if shared nodes dimensions match up
-    for (int i=0;i<a.size();++i) {
-      int ai = a[i];
-      if (ai>=0) continue;
-      auto al = dim_map.find(ai);
-      if (al==dim_map.end()) {
-        dim_map[ai] = A.dims(i);
-      } else {
-        tensor_assert(al->second==A.dims(i));
-      }
-    }
+    computes R_r = A_a * B_b * C_c * ...
 
-    for (int i=0;i<b.size();++i) {
-      int bi = b[i];
-      if (bi>=0) continue;
-      auto bl = dim_map.find(bi);
-      if (bl==dim_map.end()) {
-        dim_map[bi] = B.dims(i);
-      } else {
-        tensor_assert(bl->second==B.dims(i));
+    The operands are contracted pairwise, in the order that minimizes
+    the number of scalar products and the size of the intermediates.
+  */
+  static Tensor einsum(const std::vector<Tensor>& t, const std::vector< std::vector<int> >& labels,
+      const std::vector<int>& c) {
+    tensor_assert(t.size()==labels.size());
+    tensor_assert(!t.empty());
+
+    std::vector< TensorView<T> > operands;
+    std::vector< std::vector<int> > op_labels;
+    std::vector< std::vector<int> > op_dims;
+
+    // Resolve fixed indices up front
+    for (int i=0;i<t.size();++i) {
+      tensor_assert(t[i].n_dims()==labels[i].size());
+      std::vector<int> ind, l;
+      for (int li : labels[i]) {
+        ind.push_back(li>=0 ? li : -1);
+        if (li<0) l.push_back(li);
       }
+      operands.push_back(t[i].index(ind));
+      op_labels.push_back(l);
+      op_dims.push_back(operands.back().dims());
     }
 
-    std::vector<int> new_dims;
-    for (int i=0;i<c.size();++i) {
-      int ci = c[i];
-      tensor_assert(ci<0);
-      auto cl = dim_map.find(ci);
-      tensor_assert(cl!=dim_map.end());
-      new_dims.push_back(dim_map[ci]);
-    }
-
-    T data = T::zeros(normalize_dim(new_dims));
-
-    // Compute the total number of iterations needed
-    int n_iter = 1;
-    std::vector<int> dim_map_keys;
-    std::vector<int> dim_map_values;
-    for (const auto& e : dim_map) {
-      n_iter*= e.second;
-      dim_map_keys.push_back(e.first);
-      dim_map_values.push_back(e.second);
-    }
-
-    // Main loop
-    for (int i=0;i<n_iter;++i) {
-      std::vector<int> ind_total = sub2ind(dim_map_values, i);
-      std::vector<int> ind_a, ind_b, ind_c;
-      int sub_a, sub_b, sub_c;
-
-      for (const auto& ai : a) {
-        ind_a.push_back(ai<0 ? ind_total[distance(dim_map.begin(), dim_map.find(ai))] : ai);
-      }
-      for (const auto& bi : b) {
-        ind_b.push_back(bi<0 ? ind_total[distance(dim_map.begin(), dim_map.find(bi))] : bi);
-      }
-      for (const auto& ci : c) {
-        if (ci<0) {
-          ind_c.push_back(ind_total[distance(dim_map.begin(), dim_map.find(ci))]);
-        }
-      }
-
-      sub_a = ind2sub(A.dims(), ind_a);
-      sub_b = ind2sub(B.dims(), ind_b);
-      sub_c = ind2sub(new_dims, ind_c);
-      data[sub_c]+= data_[sub_a]*B.data()[sub_b];
+    if (operands.size()==1) return operands[0].einstein(op_labels[0], c);
 
+    ContractionPath path(op_dims, op_labels, c);
+    const auto& steps = path.steps();
+    for (int k=0;k<steps.size();++k) {
+      int i = steps[k].first;
+      int j = steps[k].second;
+      const std::vector<int>& r = k+1==steps.size() ? c : path.labels()[t.size()+k];
+      operands.push_back(operands[i].einstein(operands[j], op_labels[i], op_labels[j], r));
+      op_labels.push_back(r);
     }
-
-    return Tensor(data, new_dims);
+    return operands.back();
   }
 
   /**
@@ -411,11 +690,49 @@ class Tensor {
     return einstein(b, a_r, b_r, c_r);
   }
 
+  /** \brief Evaluate a contraction plan on the data of A and B
+  *
+  *   The operands of the plan start at offset_a in a and offset_b in b.
+  */
+  static T contract(const ContractionPlan& plan, const T& a, int offset_a,
+    const T& b, int offset_b);
+
+  /** \brief Evaluate a contraction plan as a (batched) matrix product
+  *
+  *   Requires plan.is_gemm()
+  */
+  static T contract_gemm(const ContractionPlan& plan, const T& a, int offset_a,
+    const T& b, int offset_b);
+
+  /** \brief Evaluate a contraction plan as gather, multiply and sum
+  *
+  *   All scalar products are formed by a single elementwise multiplication of
+  *   two gathered vectors, and summed into C by one sparse matrix product.
+  *   Intended for symbolic types, where it keeps the graph size independent
+  *   of the number of products.
+  */
+  static T contract_gather(const ContractionPlan& plan, const T& a, int offset_a,
+    const T& b, int offset_b);
+
+  /** \brief Evaluate a contraction plan with a sparse operand
+  *
+  *   Only the scalar products between structural nonzeros are formed,
+  *   walking the operand with fewest nonzeros. The result is sparse.
+  */
+  static T contract_sparse(const ContractionPlan& plan, const T& a, int offset_a,
+    const T& b, int offset_b);
+
+  /** \brief Gather n entries of x starting at offset, through index
+  *
+  *   An empty index stands for the identity.
+  */
+  static T gather_operand(const T& x, int offset, const std::vector<int>& index, int n);
+
   #ifndef SWIG
   /// Print a representation of the object to a stream (shorthand)
   inline friend
       std::ostream& operator<<(std::ostream &stream, const Tensor& obj) {
-          return stream << "Tensor(" << obj.data_.type_name() << ", "
+          return stream << "Tensor(" << obj.data_->type_name() << ", "
             << obj.dims() << "): " << obj.data();
       }
   #endif // SWIG
@@ -431,10 +748,268 @@ class Tensor {
   }
 
   private:
-    T data_;
+    /// Storage shared by all default constructed tensors
+    static const std::shared_ptr<const T>& zero_storage() {
+      // Never destroyed, as tensors may outlive static destruction
+      static const std::shared_ptr<const T>* zero = new std::shared_ptr<const T>(std::make_shared<T>(0));
+      return *zero;
+    }
+
+    std::shared_ptr<const T> data_;
     std::vector<int> dims_;
 };
 
+/** \brief Strided window on the storage of a tensor
+
+  Entry (i_0, i_1, ...) of the view is entry offset + sum_k i_k*strides[k]
+  of the shared storage. Slicing, reordering and squeezing only touch the
+  strides and the offset; the data is copied when the view is materialized,
+  or gathered directly by einstein when a view is used as operand.
+*/
+template <class T>
+class TensorView {
+  public:
+    TensorView(const std::shared_ptr<const T>& storage, const std::vector<int>& dims,
+        const std::vector<int>& strides, int offset) :
+        storage_(storage), dims_(dims), strides_(strides), offset_(offset) {
+      tensor_assert(dims.size()==strides.size());
+    }
+
+    /// View on a whole tensor
+    TensorView(const Tensor<T>& t) : TensorView(t.view()) {
+    }
+
+    const std::shared_ptr<const T>& storage() const { return storage_; }
+    const std::vector<int>& dims() const { return dims_; }
+    int dims(int i) const { return dims_[i]; }
+    int n_dims() const { return dims_.size(); }
+    const std::vector<int>& strides() const { return strides_; }
+    int offset() const { return offset_; }
+    int numel() const { return product(dims_); }
+
+    /// Whether the entries are laid out column-major without gaps
+    bool is_contiguous() const { return strides_==contiguous_strides(dims_); }
+
+    /** \brief Copy the entries into a tensor of their own
+    *
+    *   No copy is made if the view covers its whole storage in order.
+    */
+    Tensor<T> materialize() const;
+
+    /// Entries of the view, as a column-major matrix
+    T data() const { return materialize().data(); }
+
+    TensorView operator()(const std::vector<int>& ind) const {
+      return index(ind);
+    }
+
+    /** \brief Make a slice
+    *
+    *   -1  indicates a slice
+    */
+    TensorView index(const std::vector<int>& ind) const {
+      tensor_assert(ind.size()==n_dims());
+
+      std::vector<int> dims, strides;
+      int offset = offset_;
+      for (int i=0;i<n_dims();++i) {
+        if (ind[i]==-1) {
+          dims.push_back(dims_[i]);
+          strides.push_back(strides_[i]);
+        } else {
+          tensor_assert(ind[i]>=0);
+          tensor_assert(ind[i]<dims_[i]);
+          offset+= ind[i]*strides_[i];
+        }
+      }
+      return TensorView(storage_, dims, strides, offset);
+    }
+
+    /** \brief Generalization of transpose
+    */
+    TensorView reorder_dims(const std::vector<int>& order) const {
+      // Without copying: no flops, no bytes
+      TENSOR_TRACE_SCOPE("reorder_dims", T);
+      TENSOR_TRACE_COUNT(numel(), 0, 0);
+      // Check that input is a permutaion of range(n_dims())
+      tensor_assert(order.size()==n_dims());
+
+      std::vector<bool> occured(n_dims(), false);
+
+      for (int i : order) {
+        tensor_assert(i>=0);
+        tensor_assert(i<n_dims());
+        occured[i] = true;
+      }
+
+      for (bool occ : occured) {
+        tensor_assert(occ);
+      }
+
+      return TensorView(storage_, reorder(dims_, order), reorder(strides_, order), offset_);
+    }
+
+    TensorView squeeze() const {
+      std::vector<int> dims, strides;
+      for (int i=0;i<n_dims();++i) {
+        if (dims_[i]!=1) {
+          dims.push_back(dims_[i]);
+          strides.push_back(strides_[i]);
+        }
+      }
+      return TensorView(storage_, dims, strides, offset_);
+    }
+
+    /** \brief Reinterpret the entries with other dimensions
+    *
+    *   Copies only if the view is not contiguous.
+    */
+    TensorView shape(const std::vector<int>& dims) const {
+      tensor_assert(product(dims)==numel());
+      if (!is_contiguous()) return materialize().shape(dims);
+      return TensorView(storage_, dims, contiguous_strides(dims), offset_);
+    }
+
+    /** \brief Contraction with a view as left operand
+    *
+    *   See Tensor::einstein
+    */
+    Tensor<T> einstein(const TensorView& B, const std::vector<int>& a,
+        const std::vector<int>& b, const std::vector<int>& c) const {
+      TENSOR_TRACE_SCOPE("einstein", T);
+      std::shared_ptr<const ContractionPlan> plan =
+        ContractionPlan::get(dims_, strides_, B.dims_, B.strides_, a, b, c);
+      TENSOR_TRACE_COUNT(product(plan->dims()), 2.0*plan->n_iter(),
+        8.0*(numel()+B.numel()+product(plan->dims())));
+
+      if (!EinsteinMemo::enabled()) {
+        return Tensor<T>(Tensor<T>::contract(*plan, *storage_, offset_, *B.storage_, B.offset_),
+          plan->dims());
+      }
+      EinsteinMemoKey<T> key = {storage_, dims_, strides_, offset_,
+        B.storage_, B.dims_, B.strides_, B.offset_, a, b, c};
+      T data;
+      if (!EinsteinMemo::lookup(key, data)) {
+        data = Tensor<T>::contract(*plan, *storage_, offset_, *B.storage_, B.offset_);
+        EinsteinMemo::store(key, data);
+      }
+      return Tensor<T>(data, plan->dims());
+    }
+
+    Tensor<T> einstein(const std::vector<int>& a_e, const std::vector<int>& c_e) const {
+      return einstein(Tensor<T>(1, {}), a_e, {}, c_e);
+    }
+
+    /// The Tensor operations below materialize the view; see the Tensor members
+    T matrix() const { return materialize().matrix(); }
+    int nnz() const { return materialize().nnz(); }
+    bool is_sparse() const { return materialize().is_sparse(); }
+    Tensor<T> dense() const { return materialize().dense(); }
+    Tensor<T> solve(const Tensor<T>& B) const { return materialize().solve(B); }
+    Tensor<T> outer_product(const Tensor<T>& b) const { return materialize().outer_product(b); }
+    Tensor<T> inner(const Tensor<T>& b) const { return materialize().inner(b); }
+    Tensor<T> partial_product(const Tensor<T>& b) const {
+      return materialize().partial_product(b);
+    }
+
+#ifndef SWIG
+    TensorBinary<T, TensorAddOp, TensorLeaf<T>, TensorLeaf<T> >
+        operator+(const Tensor<T>& rhs) const { return materialize()+rhs; }
+    TensorBinary<T, TensorSubOp, TensorLeaf<T>, TensorLeaf<T> >
+        operator-(const Tensor<T>& rhs) const { return materialize()-rhs; }
+    TensorNeg<T, TensorLeaf<T> > operator-() const { return -materialize(); }
+    TensorBinary<T, TensorMulOp, TensorLeaf<T>, TensorLeaf<T> >
+        operator*(const Tensor<T>& rhs) const { return materialize()*rhs; }
+#endif
+
+    Tensor<T> operator<=(const Tensor<T>& rhs) const { return materialize()<=rhs; }
+    Tensor<T> operator>=(const Tensor<T>& rhs) const { return materialize()>=rhs; }
+
+  private:
+    std::shared_ptr<const T> storage_;
+    std::vector<int> dims_;
+    std::vector<int> strides_;
+    int offset_;
+};
+
+#ifndef SWIG
+#define TENSOR_EXPR_BINARY(OP, NODE) \
+template <class T, class L, class R> \
+TensorBinary<T, NODE, L, R> operator OP(const TensorExpr<T, L>& l, const TensorExpr<T, R>& r) { \
+  return TensorBinary<T, NODE, L, R>(l.self(), r.self()); \
+} \
+template <class T, class R> \
+TensorBinary<T, NODE, TensorLeaf<T>, R> operator OP( \
+    const typename tensor_expr_identity< Tensor<T> >::type& l, const TensorExpr<T, R>& r) { \
+  return TensorBinary<T, NODE, TensorLeaf<T>, R>(TensorLeaf<T>(l), r.self()); \
+} \
+template <class T, class L> \
+TensorBinary<T, NODE, L, TensorLeaf<T> > operator OP( \
+    const TensorExpr<T, L>& l, const typename tensor_expr_identity< Tensor<T> >::type& r) { \
+  return TensorBinary<T, NODE, L, TensorLeaf<T> >(l.self(), TensorLeaf<T>(r)); \
+}
+
+TENSOR_EXPR_BINARY(+, TensorAddOp)
+TENSOR_EXPR_BINARY(-, TensorSubOp)
+TENSOR_EXPR_BINARY(*, TensorMulOp)
+
+#undef TENSOR_EXPR_BINARY
+
+template <class T, class E>
+TensorNeg<T, E> operator-(const TensorExpr<T, E>& e) {
+  return TensorNeg<T, E>(e.self());
+}
+
+template <class T, class E>
+Tensor<T> evaluate_expr(const TensorExpr<T, E>& expr) {
+  TENSOR_TRACE_SCOPE("elementwise", T);
+  TENSOR_TRACE_COUNT(product(expr.dims()), double(E::n_ops)*product(expr.dims()),
+    8.0*(E::n_leaves+1)*product(expr.dims()));
+  return Tensor<T>(expr.self().eval(), expr.dims());
+}
+
+template <class E>
+Tensor<DM> evaluate_expr(const TensorExpr<DM, E>& expr) {
+  const E& e = expr.self();
+  TENSOR_TRACE_SCOPE("elementwise", DM);
+  TENSOR_TRACE_COUNT(product(e.dims()), double(E::n_ops)*product(e.dims()),
+    8.0*(E::n_leaves+1)*product(e.dims()));
+  if (!e.is_dense()) return Tensor<DM>(e.eval(), e.dims());
+  DM r = DM::zeros(Tensor<DM>::normalize_dim(e.dims()));
+  double* p = r.ptr();
+  int n = r.nnz();
+  for (int i=0;i<n;i+=TENSOR_EXPR_BLOCK) {
+    int m = std::min(TENSOR_EXPR_BLOCK, n-i);
+    const double* b = e.block(i, m, p+i);
+    if (b!=p+i) std::copy(b, b+m, p+i);
+  }
+  return Tensor<DM>(std::move(r), e.dims());
+}
+#endif
+
+template <class T>
+Tensor<T> TensorView<T>::materialize() const {
+  if (offset_==0 && storage_->numel()==numel() && is_contiguous()) {
+    return Tensor<T>(storage_, dims_);
+  }
+  TENSOR_TRACE_SCOPE("materialize", T);
+  TENSOR_TRACE_COUNT(numel(), 0, 16.0*numel());
+  if (!storage_->is_dense()) {
+    // Visit only the structural nonzeros that fall inside the view
+    std::vector<int> sub = strided_lookup(dims_, strides_, offset_, storage_->sparsity().find());
+    std::vector<int> nz, index;
+    for (int k=0;k<sub.size();++k) {
+      if (sub[k]<0) continue;
+      nz.push_back(k);
+      index.push_back(sub[k]);
+    }
+    T data = scatter(gather(*storage_, nz), index, numel());
+    return Tensor<T>(reshape(data, Tensor<T>::normalize_dim(dims_)), dims_);
+  }
+  T data = gather(*storage_, strided_indices(dims_, strides_, offset_));
+  return Tensor<T>(reshape(data, Tensor<T>::normalize_dim(dims_)), dims_);
+}
+
 template <class T>
 std::pair<int, int> Tensor<T>::normalize_dim(const std::vector<int> & dims) {
     if (dims.size()==0) {
@@ -455,6 +1030,220 @@ std::pair<int, int> Tensor<T>::normalize_dim(const std::vector<int> & dims) {
     return {0, 0};
 }
 
+template <class T>
+T Tensor<T>::concat_blocks(const std::vector< Tensor<T> >& v, int outer) {
+  if (outer==0) return T::zeros(0, 1);
+  std::vector<T> blocks;
+  blocks.reserve(v.size());
+  for (auto& t : v) blocks.push_back(reshape(t.data(), std::pair<int, int>{t.numel()/outer, outer}));
+  return vertcat(blocks);
+}
+
+/// Numeric concatenation writes every entry once, straight into the result
+template <>
+inline DM Tensor<DM>::concat_blocks(const std::vector< Tensor<DM> >& v, int outer) {
+  if (outer==0) return DM::zeros(0, 1);
+  int n = 0;
+  bool sparse = false;
+  for (auto& t : v) {
+    n+= t.numel();
+    sparse = sparse || t.is_sparse();
+  }
+  if (sparse) {
+    // Keep the structural zeros
+    std::vector<DM> blocks;
+    for (auto& t : v) blocks.push_back(reshape(t.data(), std::pair<int, int>{t.numel()/outer, outer}));
+    return vertcat(blocks);
+  }
+
+  std::vector<const double*> x(v.size());
+  std::vector<int> m(v.size());
+  for (int i=0;i<v.size();++i) {
+    x[i] = v[i].data().ptr();
+    m[i] = v[i].numel()/outer;
+  }
+  DM ret = DM::zeros(n/outer, outer);
+  double* r = ret.ptr();
+  for (int j=0;j<outer;++j) {
+    for (int i=0;i<v.size();++i) {
+      r = std::copy(x[i], x[i]+m[i], r);
+      x[i]+= m[i];
+    }
+  }
+  return ret;
+}
+
+template <class T>
+T Tensor<T>::contract(const ContractionPlan& plan, const T& a, int offset_a,
+    const T& b, int offset_b) {
+  if (plan.n_iter()==0) return T::zeros(normalize_dim(plan.dims()));
+  if (!a.is_dense() || !b.is_dense()) return contract_sparse(plan, a, offset_a, b, offset_b);
+  if (plan.is_gemm()) return contract_gemm(plan, a, offset_a, b, offset_b);
+  return contract_gather(plan, a, offset_a, b, offset_b);
+}
+
+template <class T>
+T Tensor<T>::gather_operand(const T& x, int offset, const std::vector<int>& index, int n) {
+  if (index.empty()) {
+    if (offset==0 && x.numel()==n) return x;
+    return gather(x, range(offset, offset+n));
+  }
+  if (offset==0) return gather(x, index);
+  std::vector<int> shifted = index;
+  for (int& i : shifted) i+= offset;
+  return gather(x, shifted);
+}
+
+template <class T>
+T Tensor<T>::contract_gather(const ContractionPlan& plan, const T& a, int offset_a,
+    const T& b, int offset_b) {
+  int n = plan.n_iter();
+  std::vector<int> index_a(n), index_b(n), index_c(n);
+  int i = 0;
+  plan.for_each([&](int sub_a, int sub_b, int sub_c) {
+    index_a[i] = offset_a+sub_a;
+    index_b[i] = offset_b+sub_b;
+    index_c[i] = sub_c;
+    i++;
+  });
+
+  T products = gather(a, index_a)*gather(b, index_b);
+  return reshape(densify(scatter(products, index_c, product(plan.dims()))),
+    normalize_dim(plan.dims()));
+}
+
+template <class T>
+T Tensor<T>::contract_sparse(const ContractionPlan& plan, const T& a, int offset_a,
+    const T& b, int offset_b) {
+  // The walk restarts its odometer at every nonzero
+  TensorArena scratch;
+  bool in_a = !a.is_dense() && (b.is_dense() || a.nnz()<=b.nnz());
+  const T& x = in_a ? a : b;
+  const T& y = in_a ? b : a;
+  int offset_x = in_a ? offset_a : offset_b;
+  int offset_y = in_a ? offset_b : offset_a;
+
+  std::vector<int> positions = x.sparsity().find();
+  for (int& p : positions) p-= offset_x;
+  // Sorted positions of the nonzeros of the other operand, if it is sparse
+  std::vector<int> positions_y;
+  if (!y.is_dense()) positions_y = y.sparsity().find();
+
+  std::vector<int> index_x, index_y, index_c;
+  plan.for_each_at([&](int sub_a, int sub_b, int sub_c) {
+    int j = (in_a ? sub_b : sub_a)+offset_y;
+    if (!y.is_dense()) {
+      auto it = std::lower_bound(positions_y.begin(), positions_y.end(), j);
+      if (it==positions_y.end() || *it!=j) return;
+      j = it-positions_y.begin();
+    }
+    index_x.push_back(in_a ? sub_a : sub_b);
+    index_y.push_back(j);
+    index_c.push_back(sub_c);
+  }, positions, in_a);
+
+  T products = in_a ? gather(a, index_x)*gather(b, index_y) : gather(a, index_y)*gather(b, index_x);
+  return reshape(scatter(products, index_c, product(plan.dims())), normalize_dim(plan.dims()));
+}
+
+/** \brief Symbolic entries that are identically zero are structural zeros
+*
+*   Such operands take the sparse path, so that no 0*x terms reach the
+*   graph and the result carries the sparsity implied by the operands.
+*/
+template <>
+inline SX Tensor<SX>::contract(const ContractionPlan& plan, const SX& a, int offset_a,
+    const SX& b, int offset_b) {
+  if (plan.n_iter()==0) return SX::zeros(normalize_dim(plan.dims()));
+  SX a_s = sparsify(a);
+  SX b_s = sparsify(b);
+  if (!a_s.is_dense() || !b_s.is_dense()) return contract_sparse(plan, a_s, offset_a, b_s, offset_b);
+  if (plan.is_gemm()) return contract_gemm(plan, a, offset_a, b, offset_b);
+  return contract_gather(plan, a, offset_a, b, offset_b);
+}
+
+/// A single mtimes node is only worthwhile without batch labels
+template <>
+inline MX Tensor<MX>::contract(const ContractionPlan& plan, const MX& a, int offset_a,
+    const MX& b, int offset_b) {
+  if (plan.n_iter()==0) return MX::zeros(normalize_dim(plan.dims()));
+  if (!a.is_dense() || !b.is_dense()) return contract_sparse(plan, a, offset_a, b, offset_b);
+  if (plan.is_gemm() && plan.gemm_batch()==1) return contract_gemm(plan, a, offset_a, b, offset_b);
+  return contract_gather(plan, a, offset_a, b, offset_b);
+}
+
+template <class T>
+T Tensor<T>::contract_gemm(const ContractionPlan& plan, const T& a, int offset_a,
+    const T& b, int offset_b) {
+  int m = plan.gemm_m();
+  int k = plan.gemm_k();
+  int n = plan.gemm_n();
+  int n_batch = plan.gemm_batch();
+
+  // Transpose the operands to [free A, contracted, batch] and [contracted, free B, batch]
+  T a_p = gather_operand(a, offset_a, plan.gemm_index_a(), m*k*n_batch);
+  T b_p = gather_operand(b, offset_b, plan.gemm_index_b(), k*n*n_batch);
+
+  T c_p;
+  if (n_batch==1) {
+    c_p = mtimes(reshape(a_p, std::pair<int, int>{m, k}), reshape(b_p, std::pair<int, int>{k, n}));
+  } else {
+    a_p = reshape(a_p, std::pair<int, int>{m, k*n_batch});
+    b_p = reshape(b_p, std::pair<int, int>{k, n*n_batch});
+    std::vector<T> c_batch(n_batch);
+    for (int i=0;i<n_batch;++i) {
+      c_batch[i] = mtimes(a_p(Slice(), Slice(i*k, (i+1)*k)), b_p(Slice(), Slice(i*n, (i+1)*n)));
+    }
+    c_p = horzcat(c_batch);
+  }
+
+  // Transpose the result from [free A, free B, batch] to the requested order
+  if (!plan.gemm_index_c().empty()) c_p = gather(c_p, plan.gemm_index_c());
+  return reshape(c_p, normalize_dim(plan.dims()));
+}
+
+/// Numeric matrix products go through mtimes; other contractions run on the raw
+/// buffers, with SIMD kernels and threads, or through a compiled kernel when enabled
+template <>
+inline DM Tensor<DM>::contract(const ContractionPlan& plan, const DM& a, int offset_a,
+    const DM& b, int offset_b) {
+  if (plan.n_iter()==0) return DM::zeros(normalize_dim(plan.dims()));
+  if (!a.is_dense() || !b.is_dense()) return contract_sparse(plan, a, offset_a, b, offset_b);
+  int n_threads = ContractionPlan::num_threads();
+  if (plan.n_iter()<ContractionPlan::parallel_threshold()) n_threads = 1;
+
+  if (n_threads==1 && ContractionKernel::enabled()) {
+    ContractionKernel::Function f = ContractionKernel::get(plan);
+    if (f) {
+      DM data = DM::zeros(normalize_dim(plan.dims()));
+      f(a.ptr()+offset_a, b.ptr()+offset_b, data.ptr());
+      return data;
+    }
+  }
+  if (n_threads==1 && plan.is_gemm()) return contract_gemm(plan, a, offset_a, b, offset_b);
+
+  DM data = DM::zeros(normalize_dim(plan.dims()));
+  dense_contract(plan, a.ptr()+offset_a, b.ptr()+offset_b, data.ptr(), n_threads);
+  return data;
+}
+
+template <class T>
+void Tensor<T>::save(const std::string& filename) const {
+  tensor_assert_message(false, "Only numeric tensors can be saved");
+}
+
+template <class T>
+Tensor<T> Tensor<T>::load(const std::string& filename) {
+  tensor_assert_message(false, "Only numeric tensors can be loaded");
+  return Tensor<T>();
+}
+
+/// See mapped_tensor.cpp
+template <>
+void Tensor<DM>::save(const std::string& filename) const;
+template <>
+Tensor<DM> Tensor<DM>::load(const std::string& filename);
+
 typedef Tensor<SX> ST;
 typedef Tensor<DM> DT;
 typedef Tensor<MX> MT;
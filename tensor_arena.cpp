@@ -0,0 +1,137 @@
+#include "tensor_arena.hpp"
+
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <new>
+
+namespace {
+  /// Alignment of every arena allocation, enough for any scalar or SIMD load
+  const std::size_t ARENA_ALIGN = 16;
+  /// Size of the first chunk; later chunks double
+  const std::size_t ARENA_CHUNK = 1 << 16;
+
+  std::atomic<long> n_system(0);
+
+  std::size_t align_up(std::size_t n) {
+    return (n+ARENA_ALIGN-1)/ARENA_ALIGN*ARENA_ALIGN;
+  }
+
+  struct Chunk {
+    char* data;
+    std::size_t size;
+  };
+}
+
+struct TensorArena::State {
+  std::vector<Chunk> chunks;
+  /// Chunk being filled, and its fill mark
+  int chunk;
+  std::size_t offset;
+  /// Number of open scopes
+  int depth;
+
+  State() : chunk(0), offset(0), depth(0) {}
+  ~State() {
+    for (auto& c : chunks) ::operator delete(c.data);
+  }
+
+  bool owns(const void* p) const {
+    std::less<const char*> less;
+    const char* q = static_cast<const char*>(p);
+    for (auto& c : chunks) {
+      if (!less(q, c.data) && less(q, c.data+c.size)) return true;
+    }
+    return false;
+  }
+
+  /// Insert a chunk of at least n bytes after the current one, and make it current
+  void grow(std::size_t n) {
+    std::size_t size = chunks.empty() ? ARENA_CHUNK : 2*chunks[chunk].size;
+    Chunk c = {static_cast<char*>(::operator new(std::max(size, n))), std::max(size, n)};
+    n_system++;
+    if (chunks.empty()) {
+      chunks.push_back(c);
+      chunk = 0;
+    } else {
+      chunks.insert(chunks.begin()+chunk+1, c);
+      chunk++;
+    }
+    offset = 0;
+  }
+};
+
+namespace {
+  TensorArena::State& local_state() {
+    thread_local TensorArena::State state;
+    return state;
+  }
+}
+
+TensorArena::TensorArena() : state_(&local_state()) {
+  chunk_ = state_->chunk;
+  offset_ = state_->offset;
+  state_->depth++;
+}
+
+TensorArena::~TensorArena() {
+  state_->chunk = chunk_;
+  state_->offset = offset_;
+  state_->depth--;
+}
+
+TensorArena::State* TensorArena::current() {
+  State& s = local_state();
+  return s.depth>0 ? &s : nullptr;
+}
+
+void* TensorArena::allocate(State* s, std::size_t n) {
+  if (!s || s->depth==0) {
+    n_system++;
+    return ::operator new(n);
+  }
+  n = align_up(std::max<std::size_t>(n, 1));
+  for (;;) {
+    if (s->chunks.empty()) {
+      s->grow(n);
+      continue;
+    }
+    const Chunk& c = s->chunks[s->chunk];
+    if (s->offset+n<=c.size) {
+      void* p = c.data+s->offset;
+      s->offset+= n;
+      return p;
+    }
+    // Move on to the next chunk if it is large enough, otherwise make one
+    if (s->chunk+1<s->chunks.size() && s->chunks[s->chunk+1].size>=n) {
+      s->chunk++;
+      s->offset = 0;
+    } else {
+      s->grow(n);
+    }
+  }
+}
+
+void TensorArena::deallocate(State* s, void* p) {
+  if (s && s->owns(p)) return;
+  ::operator delete(p);
+}
+
+long TensorArena::n_system_allocations() {
+  return n_system;
+}
+
+std::size_t TensorArena::reserved() {
+  std::size_t n = 0;
+  for (auto& c : local_state().chunks) n+= c.size;
+  return n;
+}
+
+void TensorArena::release() {
+  State& s = local_state();
+  if (s.depth>0) return;
+  for (auto& c : s.chunks) ::operator delete(c.data);
+  s.chunks.clear();
+  s.chunk = 0;
+  s.offset = 0;
+}
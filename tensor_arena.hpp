@@ -0,0 +1,87 @@
+#ifndef TENSOR_ARENA_HPP_INCLUDE
+#define TENSOR_ARENA_HPP_INCLUDE
+
+#include <vector>
+#include <cstddef>
+
+/** \brief Scope for scratch memory on the calling thread's arena
+
+  Each thread owns an arena: a list of chunks with a fill mark. Opening a
+  TensorArena records the mark; ArenaAllocator then bumps it; closing the
+  scope restores it, releasing everything allocated within at once. Scopes
+  nest. The chunks are kept, so that a loop opening a scope per iteration
+  stops requesting memory from the system once warmed up.
+
+  Outside any scope, ArenaAllocator falls back to the heap.
+  Memory from a scope must not be used after the scope closes.
+*/
+class TensorArena {
+  public:
+    struct State;
+
+    TensorArena();
+    ~TensorArena();
+
+    /// Arena of the calling thread, if a scope is open; nullptr otherwise
+    static State* current();
+
+    /// n bytes, aligned for any scalar type, from arena, or from the heap if arena is null or closed
+    static void* allocate(State* arena, std::size_t n);
+    /// Return memory obtained from allocate; arena memory is only reclaimed when its scope closes
+    static void deallocate(State* arena, void* p);
+
+    /// Chunks and heap fallbacks requested from the system, by all threads
+    static long n_system_allocations();
+
+    /// Bytes held by the calling thread's arena
+    static std::size_t reserved();
+
+    /// Release the calling thread's chunks; only outside any scope
+    static void release();
+
+  private:
+    TensorArena(const TensorArena&);
+    TensorArena& operator=(const TensorArena&);
+
+    State* state_;
+    int chunk_;
+    std::size_t offset_;
+};
+
+/** \brief Standard allocator drawing from the arena scope open at construction
+
+  Copies of a container get the heap, so that they may outlive the scope.
+*/
+template <class T>
+class ArenaAllocator {
+  public:
+    typedef T value_type;
+
+    ArenaAllocator() : arena_(TensorArena::current()) {}
+    explicit ArenaAllocator(TensorArena::State* arena) : arena_(arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& a) : arena_(a.arena()) {}
+
+    T* allocate(std::size_t n) {
+      return static_cast<T*>(TensorArena::allocate(arena_, n*sizeof(T)));
+    }
+    void deallocate(T* p, std::size_t n) { TensorArena::deallocate(arena_, p); }
+
+    ArenaAllocator select_on_container_copy_construction() const { return ArenaAllocator(nullptr); }
+
+    TensorArena::State* arena() const { return arena_; }
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U>& rhs) const { return arena_==rhs.arena(); }
+    template <class U>
+    bool operator!=(const ArenaAllocator<U>& rhs) const { return arena_!=rhs.arena(); }
+
+  private:
+    TensorArena::State* arena_;
+};
+
+/// Scratch vector on the current arena scope
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif
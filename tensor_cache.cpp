@@ -0,0 +1,305 @@
+#include "tensor_cache.hpp"
+#include "private_dir.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+namespace {
+  /// Bump when the layout of entries changes
+  const int CACHE_FORMAT = 1;
+  const char CACHE_MAGIC[] = "tensortools-cache";
+  /// Marks a directory as a cache root that tensortools created
+  const char CACHE_MARKER[] = ".tensortools-cache";
+
+  std::mutex& cache_mutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  std::string& dir_setting() {
+    static std::string dir;
+    return dir;
+  }
+
+  std::string& tag_setting() {
+    static std::string tag;
+    return tag;
+  }
+
+  std::atomic<long> size_setting(-1);
+  std::atomic<int> hits(0);
+  std::atomic<int> misses(0);
+  /// Whether directories of other versions were removed
+  bool pruned = false;
+
+  bool is_hash(const std::string& name) {
+    return name.size()==16 && name.find_first_not_of("0123456789abcdef")==std::string::npos;
+  }
+
+  /// Published entries, <hash>.entry; not the temporary files they are written to
+  bool is_entry(const std::string& name) {
+    return name.size()==22 && is_hash(name.substr(0, 16)) && name.compare(16, 6, ".entry")==0;
+  }
+
+  std::vector<std::string> list_dir(const std::string& dir) {
+    std::vector<std::string> ret;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return ret;
+    while (dirent* e = readdir(d)) {
+      std::string name = e->d_name;
+      if (name!="." && name!="..") ret.push_back(name);
+    }
+    closedir(d);
+    return ret;
+  }
+
+  /// Directory of the current version
+  std::string version_dir() {
+    return TensorCache::cache_dir() + "/" + stable_hash(TensorCache::version());
+  }
+
+  std::string entry_path(const std::string& key) {
+    return version_dir() + "/" + stable_hash(key) + ".entry";
+  }
+
+  /// Remove the entries of a version directory, and the directory once empty
+  void remove_version(const std::string& sub) {
+    for (const std::string& f : list_dir(sub)) {
+      // Only entries, published or not, are ours
+      if (is_hash(f.substr(0, 16)) && f.compare(16, 6, ".entry")==0) {
+        std::remove((sub + "/" + f).c_str());
+      }
+    }
+    rmdir(sub.c_str());
+  }
+
+  /** \brief Mark dir as a cache root if it is empty
+  *
+  *   Returns whether dir is marked. Directories that held other files
+  *   before are never marked, and never pruned.
+  */
+  bool mark_root(const std::string& dir) {
+    std::string marker = dir + "/" + CACHE_MARKER;
+    struct stat st;
+    if (lstat(marker.c_str(), &st)==0) return S_ISREG(st.st_mode);
+    if (!list_dir(dir).empty()) return false;
+    int fd = open(marker.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd<0) return false;
+    close(fd);
+    return true;
+  }
+
+  /// Create the cache root, marked if new; whether it is safe to use
+  bool open_root() {
+    std::string dir = TensorCache::cache_dir();
+    if (!make_private_dir(dir)) return false;
+    mark_root(dir);
+    return true;
+  }
+
+  /// Remove the directories of other versions; the cache lock must be held
+  void prune_versions() {
+    if (pruned) return;
+    pruned = true;
+    std::string dir = TensorCache::cache_dir();
+    if (!mark_root(dir)) return;
+    std::string current = stable_hash(TensorCache::version());
+    for (const std::string& name : list_dir(dir)) {
+      if (!is_hash(name) || name==current) continue;
+      remove_version(dir + "/" + name);
+    }
+  }
+
+  /// Remove least recently used entries beyond the size bound; the cache lock must be held
+  void evict() {
+    struct Entry {
+      std::string path;
+      long size;
+      time_t used;
+    };
+    std::string dir = version_dir();
+    std::vector<Entry> entries;
+    long total = 0;
+    for (const std::string& name : list_dir(dir)) {
+      // Files being written by other processes are left alone
+      if (!is_entry(name)) continue;
+      struct stat st;
+      std::string path = dir + "/" + name;
+      if (stat(path.c_str(), &st)!=0) continue;
+      entries.push_back({path, static_cast<long>(st.st_size), st.st_mtime});
+      total+= st.st_size;
+    }
+    std::sort(entries.begin(), entries.end(),
+      [](const Entry& a, const Entry& b) { return a.used<b.used; });
+    for (int i=0;i<entries.size() && total>TensorCache::max_size();++i) {
+      if (std::remove(entries[i].path.c_str())==0) total-= entries[i].size;
+    }
+  }
+
+  void pack(StringSerializer& s, const std::vector<DM>& v) { s.pack(v); }
+  void pack(StringSerializer& s, const std::vector<SX>& v) { s.pack(v); }
+  void pack(StringSerializer& s, const std::vector<MX>& v) { s.pack(v); }
+  void unpack(StringDeserializer& s, std::vector<DM>& v) { v = s.unpack_dm_vector(); }
+  void unpack(StringDeserializer& s, std::vector<SX>& v) { v = s.unpack_sx_vector(); }
+  void unpack(StringDeserializer& s, std::vector<MX>& v) { v = s.unpack_mx_vector(); }
+}
+
+template <class T>
+std::vector< Tensor<T> > TensorCache::cached(const std::string& key,
+    const std::function<std::vector< Tensor<T> >()>& build) {
+  std::string full_key = std::string(tensor_type_name<T>()) + ":" + key;
+
+  // Layout: number of tensors, their dims, then the serialized expressions
+  std::string data;
+  if (read_entry(full_key, data)) {
+    try {
+      std::stringstream ss(data);
+      int n;
+      ss >> n;
+      std::vector< std::vector<int> > dims(n);
+      for (auto& d : dims) {
+        int n_dims;
+        ss >> n_dims;
+        d.resize(n_dims);
+        for (int& e : d) ss >> e;
+      }
+      ss.get();
+      tensor_assert(ss.good());
+      StringDeserializer s(data.substr(ss.tellg()));
+      std::vector<T> v;
+      unpack(s, v);
+      tensor_assert(v.size()==n);
+
+      std::vector< Tensor<T> > ret;
+      for (int i=0;i<n;++i) ret.push_back(Tensor<T>(v[i], dims[i]));
+      hits++;
+      return ret;
+    } catch (std::exception& e) {
+      // Unreadable entries are rebuilt and overwritten
+    }
+  }
+
+  misses++;
+  std::vector< Tensor<T> > ret = build();
+  std::stringstream ss;
+  std::vector<T> v;
+  ss << ret.size() << "\n";
+  for (auto& t : ret) {
+    ss << t.n_dims();
+    for (int d : t.dims()) ss << " " << d;
+    ss << "\n";
+    v.push_back(t.data());
+  }
+  StringSerializer s;
+  pack(s, v);
+  write_entry(full_key, ss.str() + s.encode());
+  return ret;
+}
+
+template std::vector<DT> TensorCache::cached(const std::string& key,
+  const std::function<std::vector<DT>()>& build);
+template std::vector<ST> TensorCache::cached(const std::string& key,
+  const std::function<std::vector<ST>()>& build);
+template std::vector<MT> TensorCache::cached(const std::string& key,
+  const std::function<std::vector<MT>()>& build);
+
+bool TensorCache::read_entry(const std::string& key, std::string& data) {
+  std::lock_guard<std::mutex> lock(cache_mutex());
+  // Entries in a directory that others can write to may have been planted
+  if (!open_root() || !make_private_dir(version_dir())) return false;
+  std::string path = entry_path(key);
+  std::ifstream in(path.c_str(), std::ios::binary);
+  if (!in) return false;
+  std::stringstream buf;
+  buf << in.rdbuf();
+  std::string contents = buf.str();
+
+  // Magic and the full key guard against hash collisions and truncated files
+  std::string header = std::string(CACHE_MAGIC) + "\n" + std::to_string(key.size()) + "\n" + key + "\n";
+  if (contents.compare(0, header.size(), header)!=0) return false;
+  data = contents.substr(header.size());
+  utime(path.c_str(), nullptr);
+  return true;
+}
+
+void TensorCache::write_entry(const std::string& key, const std::string& data) {
+  std::lock_guard<std::mutex> lock(cache_mutex());
+  if (!open_root()) return;
+  prune_versions();
+  if (!make_private_dir(version_dir())) return;
+
+  // Write under a fresh private name, then publish atomically for concurrent processes
+  std::string path = entry_path(key);
+  std::string tmp = path + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd<0) return;
+  std::string contents = std::string(CACHE_MAGIC) + "\n" + std::to_string(key.size()) + "\n" +
+    key + "\n" + data;
+  std::size_t done = 0;
+  while (done<contents.size()) {
+    ssize_t n = write(fd, contents.data()+done, contents.size()-done);
+    if (n<=0) break;
+    done+= n;
+  }
+  close(fd);
+  if (done<contents.size() || std::rename(tmp.c_str(), path.c_str())!=0) {
+    std::remove(tmp.c_str());
+    return;
+  }
+  evict();
+}
+
+void TensorCache::set_cache_dir(const std::string& dir) {
+  std::lock_guard<std::mutex> lock(cache_mutex());
+  dir_setting() = dir;
+  pruned = false;
+}
+
+std::string TensorCache::cache_dir() {
+  if (!dir_setting().empty()) return dir_setting();
+  return env_or("TENSORTOOLS_CACHE_DIR", user_cache_dir("cache"));
+}
+
+void TensorCache::set_max_size(long bytes) {
+  size_setting = bytes;
+}
+
+long TensorCache::max_size() {
+  if (size_setting>=0) return size_setting;
+  return std::atol(env_or("TENSORTOOLS_CACHE_SIZE", "1073741824").c_str());
+}
+
+void TensorCache::set_tag(const std::string& tag) {
+  std::lock_guard<std::mutex> lock(cache_mutex());
+  tag_setting() = tag;
+  pruned = false;
+}
+
+std::string TensorCache::version() {
+  std::stringstream ss;
+  ss << "format " << CACHE_FORMAT << ", casadi " << CasadiMeta::version() << ", tag " << tag_setting();
+  return ss.str();
+}
+
+void TensorCache::clear() {
+  std::lock_guard<std::mutex> lock(cache_mutex());
+  remove_version(version_dir());
+}
+
+int TensorCache::n_hits() {
+  return hits;
+}
+
+int TensorCache::n_misses() {
+  return misses;
+}
@@ -0,0 +1,76 @@
+#ifndef TENSOR_CACHE_HPP_INCLUDE
+#define TENSOR_CACHE_HPP_INCLUDE
+
+#include <string>
+#include <functional>
+#include "tensor.hpp"
+
+/** \brief Persistent cache of constructed tensors
+
+  cached(key, build) returns the tensors build() returns, and stores them
+  on disk with casadi's serializer, so that later processes deserialize
+  them instead of building them again. key must identify everything the
+  construction depends on, e.g. its parameters and the hashes of its input
+  files; the tensor type is added to it.
+
+  All tensors returned by one build are serialized together and keep
+  their shared subexpressions and symbols. Return the symbolic inputs
+  alongside the results, to get back the symbols the results depend on.
+
+  Entries live in a subdirectory per version(), so that entries written
+  by another version of tensortools, casadi or the application are never
+  read; those subdirectories are removed on the first store, provided the
+  cache directory was created by tensortools. The least recently used
+  entries are evicted when the cache outgrows max_size().
+
+  Entries are deserialized into expressions, so they are only read from and
+  written to a directory owned by the user that group and others cannot
+  write to; otherwise the cache is bypassed.
+
+  The tensor type is explicit: TensorCache::cached<SX>(key, build).
+*/
+class TensorCache {
+  public:
+    template <class T>
+    static std::vector< Tensor<T> > cached(const std::string& key,
+      const std::function<std::vector< Tensor<T> >()>& build);
+
+    /** \brief Directory holding the entries
+    *
+    *   Defaults to $TENSORTOOLS_CACHE_DIR, or $XDG_CACHE_HOME/tensortools/cache
+    *   (~/.cache/tensortools/cache). Created with mode 0700.
+    */
+    static void set_cache_dir(const std::string& dir);
+    static std::string cache_dir();
+
+    /** \brief Bound on the total size of the entries, in bytes
+    *
+    *   Defaults to $TENSORTOOLS_CACHE_SIZE, or 1 GiB; a negative bound
+    *   restores the default.
+    */
+    static void set_max_size(long bytes);
+    static long max_size();
+
+    /** \brief Tag of the application, e.g. a version of the model code
+    *
+    *   Part of version(); changing it invalidates all entries.
+    */
+    static void set_tag(const std::string& tag);
+
+    /// Cache format, casadi version and tag
+    static std::string version();
+
+    /// Remove all entries of the current version, and their directory
+    static void clear();
+
+    /// Lookups served from disk, and lookups that had to build, in this process
+    static int n_hits();
+    static int n_misses();
+
+  private:
+    /// Contents of the entry for key, if present and intact; marks it as recently used
+    static bool read_entry(const std::string& key, std::string& data);
+    static void write_entry(const std::string& key, const std::string& data);
+};
+
+#endif
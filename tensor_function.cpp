@@ -0,0 +1,181 @@
+#include "tensor_function.hpp"
+
+namespace {
+  template <class T>
+  std::vector< std::vector<int> > all_dims(const std::vector< Tensor<T> >& v) {
+    std::vector< std::vector<int> > ret;
+    for (auto& t : v) ret.push_back(t.dims());
+    return ret;
+  }
+
+  template <class T>
+  std::vector<T> all_data(const std::vector< Tensor<T> >& v) {
+    std::vector<T> ret;
+    for (auto& t : v) ret.push_back(t.data());
+    return ret;
+  }
+}
+
+TensorFunction::TensorFunction(const std::string& name, const std::vector<ST>& in,
+    const std::vector<ST>& out, const Dict& opts) :
+    f_(flatten(Function(name, all_data(in), all_data(out), opts))),
+    dims_in_(all_dims(in)), dims_out_(all_dims(out)), n_batch_(0) {
+  init_work();
+}
+
+TensorFunction::TensorFunction(const std::string& name, const std::vector<MT>& in,
+    const std::vector<MT>& out, const Dict& opts) :
+    f_(flatten(Function(name, all_data(in), all_data(out), opts))),
+    dims_in_(all_dims(in)), dims_out_(all_dims(out)), n_batch_(0) {
+  init_work();
+}
+
+TensorFunction::TensorFunction(const Function& f, const std::vector< std::vector<int> >& dims_in,
+    const std::vector< std::vector<int> >& dims_out, int n_batch) :
+    f_(f), dims_in_(dims_in), dims_out_(dims_out), n_batch_(n_batch) {
+  init_work();
+}
+
+void TensorFunction::init_work() {
+  arg_.resize(f_.sz_arg());
+  res_.resize(f_.sz_res());
+  iw_.resize(f_.sz_iw());
+  w_.resize(f_.sz_w());
+
+  dims_eval_in_ = dims_in_;
+  dims_eval_out_ = dims_out_;
+  int n_stage = 0;
+  for (auto& d : dims_eval_in_) {
+    if (n_batch_) d.insert(d.begin(), n_batch_);
+    n_stage+= product(d);
+  }
+  for (auto& d : dims_eval_out_) {
+    if (n_batch_) d.insert(d.begin(), n_batch_);
+    n_stage+= product(d);
+  }
+  if (n_batch_) stage_.resize(n_stage);
+  dense_in_.resize(n_in());
+}
+
+Function TensorFunction::flatten(const Function& f) {
+  std::vector<MX> in, out;
+  for (int i=0;i<f.n_in();++i) {
+    in.push_back(MX::sym(f.name_in(i), f.numel_in(i), 1));
+  }
+  std::vector<MX> args;
+  for (int i=0;i<f.n_in();++i) {
+    args.push_back(reshape(in[i], f.size_in(i)));
+  }
+  // Dense outputs let eval write the entries straight into tensors
+  for (auto& r : f(args)) out.push_back(densify(vec(r)));
+  return Function(f.name() + "_flat", in, out);
+}
+
+TensorFunction TensorFunction::map(int n, const std::string& parallelization,
+    int max_num_threads) const {
+  tensor_assert_message(n_batch_==0, "Function is already batched");
+  tensor_assert(n>=1);
+  return TensorFunction(f_.map(n, parallelization, max_num_threads), dims_in_, dims_out_, n);
+}
+
+std::vector<DT> TensorFunction::operator()(const std::vector<DT>& args) const {
+  tensor_assert(args.size()==n_in());
+
+  // Instances are columns of the mapped Function, rows of the batched tensors
+  std::vector<DM> in(args.size());
+  for (int i=0;i<args.size();++i) {
+    const DT& a = args[i];
+    int n = product(dims_in_[i]);
+    if (a.dims()==dims_in_[i]) {
+      in[i] = reshape(a.data(), n, 1);
+    } else {
+      std::vector<int> dims = dims_in_[i];
+      dims.insert(dims.begin(), n_batch_);
+      tensor_assert_message(n_batch_>0 && a.dims()==dims,
+        "Input " << i << " has dims " << a.dims() << ", expected " << dims);
+      in[i] = reshape(a.data(), n_batch_, n).T();
+    }
+  }
+
+  std::vector<DM> out = f_(in);
+
+  std::vector<DT> ret;
+  ret.reserve(out.size());
+  for (int i=0;i<out.size();++i) {
+    if (n_batch_==0) {
+      ret.push_back(DT(densify(out[i]), dims_out_[i]));
+    } else {
+      std::vector<int> dims = dims_out_[i];
+      dims.insert(dims.begin(), n_batch_);
+      ret.push_back(DT(densify(out[i]).T(), dims));
+    }
+  }
+  return ret;
+}
+
+void TensorFunction::eval(const std::vector<DT>& args, std::vector<DT>& res) {
+  tensor_assert(args.size()==n_in());
+  if (res.size()!=n_out()) res.resize(n_out());
+
+  // Instances are columns of the mapped Function, rows of the batched tensors
+  double* stage = stage_.data();
+  for (int i=0;i<n_in();++i) {
+    const DT& a = args[i];
+    bool shared = a.dims()==dims_in_[i];
+    tensor_assert_message(shared || a.dims()==dims_eval_in_[i],
+      "Input " << i << " has dims " << a.dims() << ", expected " << dims_eval_in_[i]);
+
+    const DM& x = a.data();
+    const double* p = x.ptr();
+    if (!x.is_dense()) {
+      std::vector<double>& d = dense_in_[i];
+      d.resize(x.numel());
+      std::fill(d.begin(), d.end(), 0.0);
+      const int* colind = x.sparsity().colind();
+      const int* row = x.sparsity().row();
+      for (int c=0;c<x.size2();++c) {
+        for (int k=colind[c];k<colind[c+1];++k) d[row[k]+c*x.size1()] = p[k];
+      }
+      p = d.data();
+    }
+
+    if (n_batch_==0) {
+      arg_[i] = p;
+      continue;
+    }
+    int n = product(dims_in_[i]);
+    for (int k=0;k<n_batch_;++k) {
+      double* col = stage+k*n;
+      if (shared) {
+        std::copy(p, p+n, col);
+      } else {
+        for (int j=0;j<n;++j) col[j] = p[k+j*n_batch_];
+      }
+    }
+    arg_[i] = stage;
+    stage+= n*n_batch_;
+  }
+
+  for (int i=0;i<n_out();++i) {
+    DT& r = res[i];
+    if (r.dims()!=dims_eval_out_[i] || !r.data().is_dense()) {
+      r = DT(DM::zeros(DT::normalize_dim(dims_eval_out_[i])), dims_eval_out_[i]);
+    }
+    if (n_batch_==0) {
+      res_[i] = r.mutable_data().ptr();
+    } else {
+      res_[i] = stage;
+      stage+= product(dims_eval_out_[i]);
+    }
+  }
+
+  f_(arg_.data(), res_.data(), iw_.data(), w_.data());
+
+  for (int i=0;n_batch_ && i<n_out();++i) {
+    int n = product(dims_out_[i]);
+    double* p = res[i].mutable_data().ptr();
+    for (int k=0;k<n_batch_;++k) {
+      for (int j=0;j<n;++j) p[k+j*n_batch_] = res_[i][j+k*n];
+    }
+  }
+}
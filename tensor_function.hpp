@@ -0,0 +1,89 @@
+#ifndef TENSOR_FUNCTION_HPP_INCLUDE
+#define TENSOR_FUNCTION_HPP_INCLUDE
+
+#include "tensor.hpp"
+
+/** \brief casadi Function with tensor inputs and outputs
+
+  The underlying Function takes and returns every tensor as a column with
+  its entries in column-major order.
+
+  A batched TensorFunction, obtained with map, evaluates n instances at once.
+  Its tensors carry a leading batch axis: dims {n, d_0, d_1, ...} for an
+  instance with dims {d_0, d_1, ...}. An input with the dims of a single
+  instance is shared by all instances.
+
+  For repeated numeric evaluation, eval reuses work vectors that are
+  allocated once, at construction, and writes into the caller's outputs.
+*/
+class TensorFunction {
+  public:
+    TensorFunction(const std::string& name, const std::vector<ST>& in,
+      const std::vector<ST>& out, const Dict& opts=Dict());
+    TensorFunction(const std::string& name, const std::vector<MT>& in,
+      const std::vector<MT>& out, const Dict& opts=Dict());
+
+    /** \brief Evaluate n instances, see casadi::Function::map
+    *
+    *   parallelization is "serial", "openmp" or "thread"; max_num_threads
+    *   applies to "thread".
+    */
+    TensorFunction map(int n, const std::string& parallelization="serial",
+      int max_num_threads=1) const;
+
+    std::vector<DT> operator()(const std::vector<DT>& args) const;
+
+    /** \brief Evaluate into res, without allocating
+    *
+    *   Entries are written into the storage of res[i] in place. res is
+    *   (re)initialized when it does not hold dense tensors with the output
+    *   dims, which allocates: pass the same res on every call, and do not
+    *   keep copies of its tensors, whose storage would be copied on write.
+    *   Inputs with structural zeros are densified into a work vector that
+    *   is allocated on first use.
+    *
+    *   Not reentrant: concurrent callers each need their own copy.
+    */
+    void eval(const std::vector<DT>& args, std::vector<DT>& res);
+
+    /// Number of instances evaluated per call; 0 if not batched
+    int n_batch() const { return n_batch_; }
+    /// Dimensions of input i, for a single instance
+    const std::vector<int>& dims_in(int i) const { return dims_in_.at(i); }
+    /// Dimensions of output i, for a single instance
+    const std::vector<int>& dims_out(int i) const { return dims_out_.at(i); }
+    int n_in() const { return dims_in_.size(); }
+    int n_out() const { return dims_out_.size(); }
+
+    const Function& function() const { return f_; }
+
+  private:
+    TensorFunction(const Function& f, const std::vector< std::vector<int> >& dims_in,
+      const std::vector< std::vector<int> >& dims_out, int n_batch);
+
+    /// Wrap f, taking and returning all matrices as dense columns
+    static Function flatten(const Function& f);
+
+    /// Allocate the work vectors of eval
+    void init_work();
+
+    Function f_;
+    std::vector< std::vector<int> > dims_in_;
+    std::vector< std::vector<int> > dims_out_;
+    int n_batch_;
+
+    /// Dims of the tensors eval takes and returns, with the batch axis if batched
+    std::vector< std::vector<int> > dims_eval_in_;
+    std::vector< std::vector<int> > dims_eval_out_;
+    /// Work vectors of the low-level Function call
+    std::vector<const double*> arg_;
+    std::vector<double*> res_;
+    std::vector<int> iw_;
+    std::vector<double> w_;
+    /// Inputs and outputs with instances as columns, when batched
+    std::vector<double> stage_;
+    /// Densified inputs with structural zeros
+    std::vector< std::vector<double> > dense_in_;
+};
+
+#endif
@@ -0,0 +1,180 @@
+#include "tensor_trace.hpp"
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <iomanip>
+
+std::atomic<bool> TensorTrace::enabled_(false);
+
+namespace {
+  struct RingBuffer {
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+    /// Slot of the next event
+    int head;
+    /// Number of events recorded, capped at events.size()
+    int size;
+    int thread;
+  };
+
+  struct Registry {
+    std::mutex mutex;
+    /// Buffers outlive their threads, so that their events can still be exported
+    std::vector< std::shared_ptr<RingBuffer> > buffers;
+    int capacity;
+    Registry() : capacity(1<<16) {}
+  };
+
+  Registry& registry() {
+    static Registry r;
+    return r;
+  }
+
+  RingBuffer& local_buffer() {
+    thread_local std::shared_ptr<RingBuffer> buffer;
+    if (!buffer) {
+      Registry& r = registry();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      buffer = std::make_shared<RingBuffer>();
+      buffer->events.resize(r.capacity);
+      buffer->head = 0;
+      buffer->size = 0;
+      buffer->thread = r.buffers.size();
+      r.buffers.push_back(buffer);
+    }
+    return *buffer;
+  }
+
+  void write_string(std::ostream& out, const char* s) {
+    out << '"';
+    for (; *s; ++s) {
+      if (*s=='"' || *s=='\\') out << '\\';
+      out << *s;
+    }
+    out << '"';
+  }
+}
+
+void TensorTrace::set_enabled(bool enabled) {
+  enabled_ = enabled;
+}
+
+double TensorTrace::now() {
+  typedef std::chrono::steady_clock Clock;
+  static const Clock::time_point epoch = Clock::now();
+  return std::chrono::duration<double, std::micro>(Clock::now()-epoch).count();
+}
+
+void TensorTrace::record(const char* op, const char* type, double start, double duration,
+    double numel, double flops, double bytes) {
+  RingBuffer& b = local_buffer();
+  std::lock_guard<std::mutex> lock(b.mutex);
+  if (b.events.empty()) return;
+  b.events[b.head] = {op, type, start, duration, static_cast<long>(numel), flops, bytes, b.thread};
+  b.head = (b.head+1) % b.events.size();
+  b.size = std::min<int>(b.size+1, b.events.size());
+}
+
+void TensorTrace::set_capacity(int n) {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.capacity = std::max(n, 0);
+  for (auto& b : r.buffers) {
+    std::lock_guard<std::mutex> lock_b(b->mutex);
+    b->events.assign(r.capacity, TraceEvent());
+    b->head = 0;
+    b->size = 0;
+  }
+}
+
+int TensorTrace::capacity() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  return r.capacity;
+}
+
+std::vector<TraceEvent> TensorTrace::events() {
+  std::vector<TraceEvent> ret;
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (auto& b : r.buffers) {
+    std::lock_guard<std::mutex> lock_b(b->mutex);
+    int n = b->events.size();
+    // Oldest event first
+    for (int i=0;i<b->size;++i) ret.push_back(b->events[(b->head-b->size+i+n) % n]);
+  }
+  std::stable_sort(ret.begin(), ret.end(),
+    [](const TraceEvent& x, const TraceEvent& y) { return x.start<y.start; });
+  return ret;
+}
+
+void TensorTrace::clear() {
+  Registry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (auto& b : r.buffers) {
+    std::lock_guard<std::mutex> lock_b(b->mutex);
+    b->head = 0;
+    b->size = 0;
+  }
+}
+
+void TensorTrace::write_chrome(std::ostream& out) {
+  std::vector<TraceEvent> ev = events();
+  std::ios::fmtflags flags = out.flags();
+  out << std::fixed << std::setprecision(3);
+  out << "{\"traceEvents\": [";
+  for (int i=0;i<ev.size();++i) {
+    const TraceEvent& e = ev[i];
+    out << (i ? ",\n" : "\n") << "{\"name\": ";
+    write_string(out, e.op);
+    out << ", \"cat\": ";
+    write_string(out, e.type);
+    out << ", \"ph\": \"X\", \"ts\": " << e.start << ", \"dur\": " << e.duration
+        << ", \"pid\": 0, \"tid\": " << e.thread
+        << ", \"args\": {\"numel\": " << e.numel << ", \"flops\": " << e.flops
+        << ", \"bytes\": " << e.bytes << "}}";
+  }
+  out << "\n], \"displayTimeUnit\": \"ms\"}" << std::endl;
+  out.flags(flags);
+}
+
+void TensorTrace::summary(std::ostream& out) {
+  struct Row {
+    int calls;
+    double time;
+    double numel;
+    double flops;
+    double bytes;
+  };
+  std::map< std::pair<std::string, std::string>, Row > rows;
+  for (const TraceEvent& e : events()) {
+    Row& r = rows[{e.op, e.type}];
+    r.calls++;
+    r.time+= e.duration;
+    r.numel+= e.numel;
+    r.flops+= e.flops;
+    r.bytes+= e.bytes;
+  }
+
+  std::ios::fmtflags flags = out.flags();
+  out << std::left << std::setw(16) << "op" << std::setw(6) << "type" << std::right
+      << std::setw(10) << "calls" << std::setw(14) << "total [ms]" << std::setw(14) << "mean [us]"
+      << std::setw(14) << "numel" << std::setw(12) << "GFLOP/s" << std::setw(12) << "GB/s"
+      << std::endl;
+  out << std::fixed;
+  for (auto& e : rows) {
+    const Row& r = e.second;
+    // In nanoseconds, so that flops per unit time reads as GFLOP/s
+    double t = r.time*1e3;
+    out << std::left << std::setw(16) << e.first.first << std::setw(6) << e.first.second
+        << std::right << std::setw(10) << r.calls
+        << std::setprecision(3) << std::setw(14) << r.time/1e3 << std::setw(14) << r.time/r.calls
+        << std::setprecision(0) << std::setw(14) << r.numel
+        << std::setprecision(3) << std::setw(12) << (t ? r.flops/t : 0)
+        << std::setw(12) << (t ? r.bytes/t : 0) << std::endl;
+  }
+  out.flags(flags);
+}
@@ -0,0 +1,130 @@
+#ifndef TENSOR_TRACE_HPP_INCLUDE
+#define TENSOR_TRACE_HPP_INCLUDE
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <casadi/casadi.hpp>
+
+/// One recorded tensor operation
+struct TraceEvent {
+  /// Operation name, e.g. "einstein"
+  const char* op;
+  /// Operand type: "DT", "ST" or "MT"
+  const char* type;
+  /// Start, in microseconds since the first recorded event of the process
+  double start;
+  /// Wall time, in microseconds
+  double duration;
+  /// Number of entries of the result
+  long numel;
+  /// Estimated floating point operations
+  double flops;
+  /// Estimated bytes read and written, at 8 bytes per entry
+  double bytes;
+  /// Sequence number of the recording thread
+  int thread;
+};
+
+/** \brief Opt-in profiling of tensor operations
+
+  Tensor operations are instrumented with TENSOR_TRACE_SCOPE, which
+  compiles to nothing unless TENSORTOOLS_TRACE is defined (cmake
+  -DWITH_TRACE=ON). When compiled in, recording further requires
+  set_enabled(true); otherwise an operation costs one relaxed atomic load.
+
+  Each thread records into its own ring buffer, which keeps the most
+  recent capacity() events. AnyTensor operations are recorded through
+  the Tensor operation they dispatch to. Nested operations, such as the
+  pairwise contractions of einsum, are recorded within their parent.
+*/
+class TensorTrace {
+  public:
+    static void set_enabled(bool enabled);
+    static bool enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+    /// Whether the inline instrumentation was compiled into this translation unit
+    static bool compiled() {
+#ifdef TENSORTOOLS_TRACE
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    /// Resize every ring buffer, dropping recorded events
+    static void set_capacity(int n);
+    static int capacity();
+
+    /// Recorded events of all threads, ordered by start time
+    static std::vector<TraceEvent> events();
+    static void clear();
+
+    /// Write the events in Chrome trace-event format (chrome://tracing, Perfetto)
+    static void write_chrome(std::ostream& out);
+
+    /// Per operation and type: calls, total and mean time, throughput
+    static void summary(std::ostream& out);
+
+    /** \brief Records an event spanning its lifetime
+    *
+    *   Counts may be set after construction, so that work done to
+    *   estimate them is skipped when tracing is disabled.
+    */
+    class Scope {
+      public:
+        Scope(const char* op, const char* type) : op_(op), type_(type), active_(enabled()),
+            numel_(0), flops_(0), bytes_(0) {
+          if (active_) start_ = now();
+        }
+        ~Scope() {
+          if (active_) record(op_, type_, start_, now()-start_, numel_, flops_, bytes_);
+        }
+        bool active() const { return active_; }
+        void count(double numel, double flops, double bytes) {
+          numel_ = numel;
+          flops_ = flops;
+          bytes_ = bytes;
+        }
+      private:
+        Scope(const Scope&);
+        Scope& operator=(const Scope&);
+
+        const char* op_;
+        const char* type_;
+        bool active_;
+        double start_;
+        double numel_;
+        double flops_;
+        double bytes_;
+    };
+
+  private:
+    /// Microseconds since the process epoch
+    static double now();
+    static void record(const char* op, const char* type, double start, double duration,
+      double numel, double flops, double bytes);
+
+    static std::atomic<bool> enabled_;
+};
+
+/// Short name of a tensor type, as recorded in TraceEvent::type
+template <class T>
+const char* tensor_type_name() { return "?"; }
+template <> inline const char* tensor_type_name<casadi::DM>() { return "DT"; }
+template <> inline const char* tensor_type_name<casadi::SX>() { return "ST"; }
+template <> inline const char* tensor_type_name<casadi::MX>() { return "MT"; }
+
+#ifdef TENSORTOOLS_TRACE
+/// Record the enclosing block as operation op on tensors of type T
+#define TENSOR_TRACE_SCOPE(op, T) TensorTrace::Scope tensor_trace_scope_(op, tensor_type_name<T>())
+/// Set the counts of the enclosing TENSOR_TRACE_SCOPE; arguments are evaluated only when recording
+#define TENSOR_TRACE_COUNT(numel, flops, bytes) \
+  if (tensor_trace_scope_.active()) tensor_trace_scope_.count(numel, flops, bytes)
+#else
+#define TENSOR_TRACE_SCOPE(op, T) ((void) 0)
+#define TENSOR_TRACE_COUNT(numel, flops, bytes) ((void) 0)
+#endif
+
+#endif
@@ -1,5 +1,30 @@
 #include <any_tensor.hpp>
+#include <fixed_tensor.hpp>
+#include <tensor_function.hpp>
+#include <tensor_trace.hpp>
+#include <tensor_arena.hpp>
+#include <mapped_tensor.hpp>
+#include <private_dir.hpp>
+#include <tensor_cache.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <new>
+
+// Count heap allocations, to check that copies and moves do not deep-copy
+std::atomic<long> n_allocations(0);
+
+void* operator new(std::size_t n) {
+  n_allocations++;
+  void* p = std::malloc(n ? n : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
 
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
 
 
 
@@ -164,6 +189,818 @@ int main() {
   got = t8({0, 1}).data();
   assert_equal(got, expected);
 
+  // Contraction plans: trace via a repeated label, fixed index, reuse
+  {
+    DT m = DT(DM(std::vector<std::vector<double> >{{1, 2}, {3, 4}}), {2, 2});
+    int n_cached = ContractionPlan::cache_size();
+
+    got = m.einstein({-1, -1}, {}).data();
+    assert_equal(got, DM(5));
+
+    got = m.einstein({1, -1}, {-1}).data();
+    assert_equal(got, DM(std::vector<double>{3, 4}));
+
+    got = m.einstein({-1, -1}, {}).data();
+    assert_equal(got, DM(5));
+    assert(ContractionPlan::cache_size()==n_cached+2);
+
+    // The cache is bounded in bytes and drops the least recently used plans first
+    std::size_t capacity = ContractionPlan::cache_capacity();
+    ContractionPlan::clear_cache();
+    std::vector<int> l = {-1, -2}, r = {-2}, o = {-1};
+    std::shared_ptr<const ContractionPlan> p2 = ContractionPlan::get({2, 2}, {2}, l, r, o);
+    std::shared_ptr<const ContractionPlan> p3 = ContractionPlan::get({3, 3}, {3}, l, r, o);
+    assert(ContractionPlan::cache_bytes()==p2->bytes()+p3->bytes());
+    ContractionPlan::set_cache_capacity(p2->bytes()+p3->bytes());
+    assert(ContractionPlan::get({2, 2}, {2}, l, r, o)==p2);
+    ContractionPlan::get({4, 4}, {4}, l, r, o);
+    assert(ContractionPlan::cache_size()==2);
+    assert(ContractionPlan::get({2, 2}, {2}, l, r, o)==p2);
+    assert(ContractionPlan::get({3, 3}, {3}, l, r, o)!=p3);
+    ContractionPlan::set_cache_capacity(capacity);
+  }
+
+  // Batched, permuted matrix product against the plain loop
+  {
+    std::vector<double> va, vb;
+    for (int i=0;i<2*3*4;++i) va.push_back(i%7-3);
+    for (int i=0;i<4*3*5;++i) vb.push_back(i%5+1);
+    DT A = DT(DM(va), {2, 3, 4});
+    DT B = DT(DM(vb), {4, 3, 5});
+    std::vector<int> a = {-1, -2, -3}, b = {-3, -2, -4}, c = {-4, -1, -3};
+
+    ContractionPlan plan(A.dims(), B.dims(), a, b, c);
+    assert(plan.is_gemm());
+    assert(plan.gemm_batch()==4);
+
+    std::vector<double> vc(5*2*4, 0);
+    plan.for_each([&](int sub_a, int sub_b, int sub_c) { vc[sub_c]+= va[sub_a]*vb[sub_b]; });
+
+    DT C = A.einstein(B, a, b, c);
+    assert((C.dims()==std::vector<int>{5, 2, 4}));
+    assert_equal(vec(C.data()), DM(vc));
+  }
+
+  // Symbolic contractions evaluate like the numeric ones
+  {
+    DT A = DT(DM(std::vector<double>{1, -2, 3, 4, 0, 5, 7, -1, 2, 6, 1, 3}), {2, 3, 2});
+    DT B = DT(DM(std::vector<double>{2, 1, 0, -3, 4, 1, 5, 2, 2, 1, -1, 3}), {3, 2, 2});
+    MT Am = MT::sym("A", {2, 3, 2});
+    ST As = ST::sym("A", {2, 3, 2});
+
+    // Batched matrix product, single matrix product, diagonal, single operand sum
+    std::vector< std::vector<int> > a = {{-1, -2, -3}, {-1, -2, -3}, {-1, -2, -3}, {-1, -2, -3}};
+    std::vector< std::vector<int> > b = {{-2, -4, -3}, {-2, -4, -5}, {-2, -1, -3}, {-4, -5, -3}};
+    std::vector< std::vector<int> > c = {{-1, -4, -3}, {-1, -4, -3, -5}, {-1, -3}, {-4, -1}};
+    for (int i=0;i<a.size();++i) {
+      DM ref = A.einstein(B, a[i], b[i], c[i]).data();
+
+      Function fm("fm", std::vector<MX>{Am.data()},
+                  std::vector<MX>{Am.einstein(MT(B), a[i], b[i], c[i]).data()});
+      assert_equal(fm(std::vector<DM>{A.data()})[0], ref);
+
+      Function fs("fs", std::vector<SX>{As.data()},
+                  std::vector<SX>{As.einstein(ST(B), a[i], b[i], c[i]).data()});
+      assert_equal(fs(std::vector<DM>{A.data()})[0], ref);
+    }
+  }
+
+  // Multi-operand contractions
+  {
+    DT A = DT(DM(std::vector<std::vector<double> >{{1, 2, 0}, {3, -1, 2}}), {2, 3});
+    DT B = DT(DM(std::vector<std::vector<double> >{{2, 1}, {0, 1}, {4, -2}}), {3, 2});
+    DT v = DT(DM(std::vector<double>{5, -3}), {2});
+
+    DM ref = A.einstein(B, {-1, -2}, {-2, -3}, {-1, -3}).einstein(v, {-1, -3}, {-3}, {-1}).data();
+    got = DT::einsum({A, B, v}, {{-1, -2}, {-2, -3}, {-3}}, {-1}).data();
+    assert_equal(got, ref);
+
+    got = AnyTensor::einsum({A, B, v}, {{-1, -2}, {-2, -3}, {-3}}, {-1}).as_DT().data();
+    assert_equal(got, ref);
+
+    // Fixed index on an operand
+    ref = A({1, -1}).einstein(B, {-2}, {-2, -3}, {-3}).data();
+    got = DT::einsum({A, B}, {{1, -2}, {-2, -3}}, {-3}).data();
+    assert_equal(got, ref);
+
+    // Matrix-matrix-vector: the vector should be absorbed first
+    ContractionPath path({{100, 100}, {100, 100}, {100}}, {{-1, -2}, {-2, -3}, {-3}}, {-1});
+    assert((path.steps()[0]==std::pair<int, int>(1, 2)));
+  }
+
+  // Threaded numeric contractions match the serial ones exactly
+  {
+    std::vector<double> va, vb;
+    for (int i=0;i<6*5*7;++i) va.push_back(std::sin(i));
+    for (int i=0;i<7*5*6;++i) vb.push_back(std::cos(i));
+    DT A = DT(DM(va), {6, 5, 7});
+    DT B = DT(DM(vb), {7, 5, 6});
+
+    int n_threads = ContractionPlan::num_threads();
+    int threshold = ContractionPlan::parallel_threshold();
+
+    std::vector< std::vector<int> > b = {{-3, -2, -4}, {-3, -2, -5}, {-3, -4, -1}};
+    std::vector< std::vector<int> > c = {{-4, -1, -2}, {-1, -2}, {-1, -4}};
+    for (int i=0;i<b.size();++i) {
+      ContractionPlan::set_num_threads(1);
+      DM ref = A.einstein(B, {-1, -2, -3}, b[i], c[i]).data();
+      ContractionPlan::set_num_threads(3);
+      ContractionPlan::set_parallel_threshold(1);
+      got = A.einstein(B, {-1, -2, -3}, b[i], c[i]).data();
+      assert(got.nonzeros()==ref.nonzeros());
+      ContractionPlan::set_parallel_threshold(threshold);
+    }
+    ContractionPlan::set_num_threads(n_threads);
+  }
+
+  // Compiled contraction kernels match the interpreted ones
+  {
+    std::vector<double> va, vb;
+    for (int i=0;i<4*3*5;++i) va.push_back(i%7);
+    for (int i=0;i<5*3*2;++i) vb.push_back(i%5);
+    DT A = DT(DM(va), {4, 3, 5});
+    DT B = DT(DM(vb), {5, 3, 2});
+
+    int n_threads = ContractionPlan::num_threads();
+    ContractionPlan::set_num_threads(1);
+    DM ref = A({-1, 1, -1}).einstein(B, {-1, -3}, {-3, -2, -4}, {-4, -1, -2}).data();
+    ContractionKernel::set_enabled(true);
+    got = A({-1, 1, -1}).einstein(B, {-1, -3}, {-3, -2, -4}, {-4, -1, -2}).data();
+    ContractionKernel::set_enabled(false);
+    ContractionPlan::set_num_threads(n_threads);
+    assert(got.nonzeros()==ref.nonzeros());
+    // Without a working compiler, the interpreted kernel is used instead
+    assert(ContractionKernel::cache_size()==1);
+  }
+
+  // Elementwise kernels agree across instruction sets, including the tails
+  {
+    std::vector<double> vx, vy;
+    for (int i=0;i<19;++i) {
+      vx.push_back(i%4-1.5);
+      vy.push_back(2-i%3);
+    }
+    DT x = DT(DM(vx), {19});
+    DT y = DT(DM(vy), {19});
+
+    DenseIsa isa = dense_isa();
+    std::vector<DT> ref;
+    for (int level=DENSE_SCALAR;level<=isa;++level) {
+      set_dense_isa(static_cast<DenseIsa>(level));
+      std::vector<DT> r = {x+y, x*y, -x, x<=y, x>=y};
+      if (ref.empty()) ref = r;
+      for (int i=0;i<r.size();++i) assert(r[i].data().nonzeros()==ref[i].data().nonzeros());
+    }
+    set_dense_isa(isa);
+
+    for (int i=0;i<19;++i) {
+      assert(ref[3].data().nonzeros()[i]==(vx[i]<=vy[i]));
+      assert(ref[4].data().nonzeros()[i]==(vx[i]>=vy[i]));
+    }
+  }
+
+  // Contractions round alike on every instruction set, as matrix products or walks
+  {
+    std::vector<double> va, vb;
+    for (int i=0;i<7*9*5;++i) va.push_back(std::sin(i));
+    for (int i=0;i<9*5*6;++i) vb.push_back(std::cos(i)/3);
+    DT A = DT(DM(va), {7, 9, 5});
+    DT B = DT(DM(vb), {9, 5, 6});
+    // A matrix product, and a walk summing a label of B alone
+    std::vector< std::vector<int> > b = {{-2, -3, -4}, {-2, -3, -5}};
+    std::vector< std::vector<int> > c = {{-1, -4}, {-1}};
+
+    DenseIsa isa = dense_isa();
+    for (int i=0;i<b.size();++i) {
+      std::vector<double> ref;
+      for (int level=DENSE_SCALAR;level<=isa;++level) {
+        set_dense_isa(static_cast<DenseIsa>(level));
+        std::vector<double> r = A.einstein(B, {-1, -2, -3}, b[i], c[i]).data().nonzeros();
+        if (ref.empty()) ref = r;
+        assert(r==ref);
+      }
+    }
+    set_dense_isa(isa);
+  }
+
+  // Views share the storage of the tensor they were taken from
+  {
+    std::vector<double> va;
+    for (int i=0;i<24;++i) va.push_back(i);
+    DT A = DT(DM(va), {2, 3, 4});
+
+    TensorView<DM> v = A.reorder_dims({2, 0, 1});
+    assert(v.storage()==A.storage());
+    assert((v.dims()==std::vector<int>{4, 2, 3}));
+    TensorView<DM> w = v({1, -1, -1});
+    assert(w.storage()==A.storage());
+    assert(w.offset()==6);
+
+    // Entry (j, k) of w is A(j, k, 1)
+    std::vector<double> ws = w.data().nonzeros();
+    for (int j=0;j<2;++j) {
+      for (int k=0;k<3;++k) assert(ws[j+2*k]==j+2*k+6);
+    }
+
+    // A contiguous slice is reshaped and materialized without a copy
+    DT whole = A.shape({6, 4});
+    assert(whole.storage()==A.storage());
+    assert(A({-1, -1, 2}).shape({6}).storage()==A.storage());
+    assert((A({-1, 0, -1}).squeeze().dims()==std::vector<int>{2, 4}));
+
+    // Views as contraction operands
+    DT B = DT(DM(std::vector<double>{1, -2, 3}), {3});
+    DM ref = DT(w).einstein(B, {-1, -2}, {-2}, {-1}).data();
+    assert_equal(w.einstein(B, {-1, -2}, {-2}, {-1}).data(), ref);
+    assert_equal(DT(v).einstein(v, {-1, -2, -3}, {-1, -2, -3}, {}).data(),
+      v.einstein(v, {-1, -2, -3}, {-1, -2, -3}, {}).data());
+
+    // Views take the Tensor operations
+    DT C = DT(DM(std::vector<double>{2, 1, 1, 3}), {2, 2});
+    DT rhs = DT(DM(std::vector<double>{1, 2}), {2});
+    assert_equal(A.reorder_dims({1, 0, 2}).inner(B).data(),
+      DT(A.reorder_dims({1, 0, 2})).inner(B).data());
+    assert_equal(DT(A({0, -1, -1}) * A({1, -1, -1})).data(),
+      DT(DT(A({0, -1, -1})) * DT(A({1, -1, -1}))).data());
+    assert_equal(C.shape({2, 2}).solve(rhs).data(), C.solve(rhs).data());
+    assert_equal(w.outer_product(B).data(), DT(w).outer_product(B).data());
+    assert_equal(DT(-w).data(), DT(-DT(w)).data());
+
+    ST As = ST::sym("A", {2, 3, 4});
+    ST Ss = As.reorder_dims({2, 0, 1})({1, -1, -1}).einstein(ST(SX(B.data()), {3}),
+      {-1, -2}, {-2}, {-1});
+    Function f("f", std::vector<SX>{As.data()}, std::vector<SX>{Ss.data()});
+    assert_equal(f(std::vector<DM>{A.data()})[0], ref);
+  }
+
+  // Copies and moves share storage; modification copies it first
+  {
+    DT A = DT(DM(std::vector<double>(1000, 1.0)), {10, 100});
+    AnyTensor warm = A;
+
+    long before = n_allocations;
+    DT B = A;
+    AnyTensor a = A;
+    AnyTensor b = std::move(a);
+    DT C = std::move(B);
+    // Only the dims of B and of the AnyTensor copy are allocated
+    assert(n_allocations-before<=2);
+    assert(C.storage()==A.storage());
+    assert(b.as_DT().storage()==A.storage());
+    // The sources of the moves are scalar zeros
+    assert(B.dims().empty() && static_cast<double>(B.data())==0);
+    B = std::move(C);
+    assert(C.dims().empty() && static_cast<double>(C.data())==0);
+    C = std::move(B);
+
+    C.set({0, 0}, DM(5));
+    assert(C.storage()!=A.storage());
+    assert(A.data().nonzeros()[0]==1);
+    assert(C.data().nonzeros()[0]==5);
+
+    const DM* storage = C.storage().get();
+    C.set({1, 0}, DM(6));
+    assert(C.storage().get()==storage);
+    assert(C.data().nonzeros()[1]==6);
+
+    DT p = DT::pack({A({-1, 0}), C({-1, 0})}, 0);
+    assert((p.dims()==std::vector<int>{2, 10}));
+    assert_equal(p.data()(1, Slice()), C({-1, 0}).data().T());
+    assert_equal(p.data()(0, Slice()), A({-1, 0}).data().T());
+  }
+
+  // AnyTensor holds only its active tensor
+  {
+    static_assert(sizeof(AnyTensor)<=sizeof(DT)+sizeof(void*), "AnyTensor too large");
+
+    DT A = DT(DM(std::vector<double>{1, 2, 3}), {3});
+    long before = n_allocations;
+    AnyTensor empty;
+    AnyTensor a = A;
+    assert(n_allocations-before<=1);
+
+    AnyTensor s = ST::sym("s", {3});
+    a = s;
+    assert(a.is_ST());
+    a = A;
+    assert(a.is_DT());
+    assert_equal((a+a).as_DT().data(), DM(std::vector<double>{2, 4, 6}));
+    assert((a*s).is_ST());
+    assert((s.outer_product(a).dims()==std::vector<int>{3, 3}));
+    assert((a.reorder_dims({0}).dims()==std::vector<int>{3}));
+    assert(empty.getRepresentation()=="");
+  }
+
+  // Sparse tensors keep their structural zeros and match the dense results
+  {
+    DT S = DT(DM::eye(4), {2, 2, 4});
+    DT Sd = S.dense();
+    assert(S.is_sparse() && S.nnz()==4);
+    assert(!Sd.is_sparse());
+
+    std::vector<double> b(12);
+    for (int i=0;i<12;++i) b[i] = i+1;
+    DT B = DT(DM(b), {4, 3});
+
+    DT C = S.einstein(B, {-1, -2, -3}, {-3, -4}, {-1, -2, -4});
+    assert(C.is_sparse());
+    assert_equal(C.dense().data(), Sd.einstein(B, {-1, -2, -3}, {-3, -4}, {-1, -2, -4}).data());
+
+    // Operands swapped, and both sparse
+    assert_equal(B.einstein(S, {-3, -4}, {-1, -2, -3}, {-4, -1, -2}).dense().data(),
+      B.einstein(Sd, {-3, -4}, {-1, -2, -3}, {-4, -1, -2}).data());
+    assert_equal(S.einstein(S, {-1, -2, -3}, {-1, -2, -3}, {}).dense().data(), DM(4));
+
+    DT R = S.reorder_dims({2, 0, 1});
+    assert(R.is_sparse() && R.nnz()==4);
+    assert_equal(R.dense().data(), Sd.reorder_dims({2, 0, 1}).data());
+    DT I = S({-1, 1, -1});
+    assert(I.nnz()==2);
+    assert_equal(I.dense().data(), Sd({-1, 1, -1}).data());
+
+    assert_equal((S+Sd).data(), (Sd+Sd).data());
+    assert((S*S).is_sparse());
+
+    ST Bs = ST::sym("B", {4, 3});
+    ST Cs = ST(S).einstein(Bs, {-1, -2, -3}, {-3, -4}, {-1, -2, -4});
+    Function f("f", std::vector<SX>{Bs.data()}, std::vector<SX>{densify(Cs.data())});
+    assert_equal(f(std::vector<DM>{B.data()})[0], C.dense().data());
+  }
+
+  // Symbolic zeros do not produce product terms
+  {
+    SX a = SX::sym("a", 2);
+    ST A = ST(vertcat(a, SX::zeros(2)), {4});
+    ST B = ST::sym("B", {4, 3});
+    ST C = A.einstein(B, {-1}, {-2, -3}, {-1, -2, -3});
+    assert(C.nnz()==24);
+
+    ST D = A.einstein(B, {-1}, {-1, -2}, {-2});
+    Function f("f", std::vector<SX>{a, B.data()}, std::vector<SX>{D.data()});
+    assert_equal(f(std::vector<DM>{DM(std::vector<double>{1, 2}), DM::ones(4, 3)})[0],
+      DM::ones(3, 1)*3);
+
+    ST Ad = ST::sym("a", {4});
+    ST Dd = Ad.einstein(B, {-1}, {-1, -2}, {-2});
+    Function g("g", std::vector<SX>{Ad.data(), B.data()}, std::vector<SX>{Dd.data()});
+    assert(f.n_instructions()<g.n_instructions());
+  }
+
+  // Fixed-shape tensors contract like dynamic ones
+  {
+    FixedTensor<double, 3, 4, 2> A;
+    FixedTensor<double, 4, 5> B;
+    for (int i=0;i<A.numel;++i) A.data()[i] = i%7;
+    for (int i=0;i<B.numel;++i) B.data()[i] = i%5;
+
+    auto C = einstein< Labels<-1, -2, 1>, Labels<-2, -3>, Labels<-3, -1> >(A, B);
+    static_assert(std::is_same<decltype(C), FixedTensor<double, 5, 3> >::value, "Wrong result shape");
+    DT ref = DT(A).einstein(DT(B), {-1, -2, 1}, {-2, -3}, {-3, -1});
+    assert_equal(DT(C).data(), ref.data());
+    assert(C(4, 2)==ref.data().nonzeros()[4+5*2]);
+
+    FixedTensor<double, 5, 3> back(ref);
+    assert(back.data()==C.data());
+    AnyTensor any = DT(C);
+    assert((any.dims()==std::vector<int>{5, 3}));
+
+    FixedTensor<SXElem, 2, 2> S;
+    SX s = SX::sym("s", 4);
+    for (int i=0;i<4;++i) S.data()[i] = s.nonzeros()[i];
+    auto trace = einstein< Labels<-1, -1>, Labels<>, Labels<> >(S, FixedTensor<SXElem>(1.0));
+    Function f("f", std::vector<SX>{s}, std::vector<SX>{ST(trace).data()});
+    assert_equal(f(std::vector<DM>{DM(std::vector<double>{1, 2, 3, 4})})[0], DM(5));
+  }
+
+  // Batched evaluation matches evaluation per instance
+  {
+    ST x = ST::sym("x", {2});
+    ST P = ST::sym("P", {2, 3});
+    ST y = x.einstein(P, {-1}, {-1, -2}, {-2}).outer_product(x);
+    TensorFunction f("f", std::vector<ST>{x, P}, std::vector<ST>{y});
+    TensorFunction fm = f.map(4, "thread", 2);
+    assert(fm.n_batch()==4);
+
+    std::vector<DT> xs, ys;
+    DT Pv = DT(DM(std::vector<double>{1, 2, 3, 4, 5, 6}), {2, 3});
+    for (int i=0;i<4;++i) {
+      xs.push_back(DT(DM(std::vector<double>{1.0*i, 2.0-i}), {2}));
+      ys.push_back(f({xs.back(), Pv})[0]);
+    }
+    // P is shared by all instances
+    DT yb = fm({DT::pack(xs, 0), Pv})[0];
+    assert((yb.dims()==std::vector<int>{4, 3, 2}));
+    for (int i=0;i<4;++i) assert_equal(yb({i, -1, -1}).data(), ys[i].data());
+  }
+
+  // Elementwise chains are fused, and checked when built
+  {
+    std::vector<double> va, vb, vc, ref;
+    for (int i=0;i<3*7*31;++i) {
+      va.push_back(std::sin(i));
+      vb.push_back(std::cos(i));
+      vc.push_back(i%5);
+      ref.push_back(((va[i]+vb[i])*vc[i]-va[i])*(-vb[i])+vc[i]);
+    }
+    DT A = DT(DM(va), {3, 7, 31});
+    DT B = DT(DM(vb), {3, 7, 31});
+    DT C = DT(DM(vc), {3, 7, 31});
+    DT R = ((A+B)*C-A)*(-B)+C;
+    assert((R.dims()==std::vector<int>{3, 7, 31}));
+    assert(R.data().nonzeros()==ref);
+
+    ST As = ST::sym("A", {3, 7, 31});
+    ST Rs = ((As+B)*C-As)*(-ST(B))+C;
+    Function f("f", std::vector<SX>{As.data()}, std::vector<SX>{Rs.data()});
+    assert_equal(f(std::vector<DM>{A.data()})[0], R.data());
+
+    bool thrown = false;
+    try {
+      A+DT(DM(va), {7, 3, 31});
+    } catch (TensorException& e) {
+      thrown = true;
+    }
+    assert(thrown);
+
+    // Expressions read like tensors, evaluating on demand
+    assert((A+B).data().nonzeros()==DT(A+B).data().nonzeros());
+    assert_equal((A*B).einstein(C, {-1, -2, -3}, {-1, -2, -3}, {}).data(),
+      DT(A*B).einstein(C, {-1, -2, -3}, {-1, -2, -3}, {}).data());
+    assert_equal((A-B)({0, -1, 2}).data(), DT(A-B)({0, -1, 2}).data());
+    AnyTensor any = A+B;
+    assert(any.is_DT());
+    assert_equal(any.as_DT().data(), DT(A+B).data());
+  }
+
+  // Concatenation, packing and unpacking along any axis
+  {
+    std::vector<double> va, vb;
+    for (int i=0;i<2*3*4;++i) va.push_back(i);
+    for (int i=0;i<2*1*4;++i) vb.push_back(-i);
+    DT A = DT(DM(va), {2, 3, 4});
+    DT B = DT(DM(vb), {2, 1, 4});
+
+    DT C = DT::concat({A, B, A}, 1);
+    assert((C.dims()==std::vector<int>{2, 7, 4}));
+    for (int k=0;k<4;++k) {
+      assert_equal(C({-1, 1, k}).data(), A({-1, 1, k}).data());
+      assert_equal(C({-1, 3, k}).data(), B({-1, 0, k}).data());
+      assert_equal(C({-1, 6, k}).data(), A({-1, 2, k}).data());
+    }
+
+    for (int axis=0;axis<=3;++axis) {
+      DT P = DT::pack({A, -A}, axis);
+      std::vector<TensorView<DM> > views = DT::unpack(P, axis);
+      assert(views.size()==2);
+      assert(views[1].storage()==P.storage());
+      assert_equal(views[0].data(), A.data());
+      assert_equal(views[1].data(), DT(-A).data());
+    }
+
+    ST As = ST::sym("A", {2, 3, 4});
+    ST Cs = ST::concat({As, ST(B)}, 1);
+    Function f("f", std::vector<SX>{As.data()}, std::vector<SX>{Cs.data()});
+    assert_equal(f(std::vector<DM>{A.data()})[0], DT::concat({A, B}, 1).data());
+
+    std::vector<AnyTensor> u = unpack(AnyTensor(C), 2);
+    assert(u.size()==4);
+    assert_equal(u[3].as_DT().data(), C({-1, -1, 3}).data());
+    assert((concat(u, 0).dims()==std::vector<int>{8, 7}));
+  }
+
+  // Traced operations are recorded per thread and exported
+  {
+    TensorTrace::clear();
+    {
+      TensorTrace::Scope s("untraced", "DT");
+      assert(!s.active());
+    }
+    assert(TensorTrace::events().empty());
+
+    TensorTrace::set_enabled(true);
+    {
+      TensorTrace::Scope s("outer", "DT");
+      s.count(4, 8, 32);
+      TensorTrace::Scope inner("inner", "DT");
+    }
+    DT A = DT(DM(std::vector<double>{1, 2, 3, 4}), {2, 2});
+    DT C = A.einstein(A, {-1, -2}, {-2, -3}, {-1, -3});
+    TensorTrace::set_enabled(false);
+
+    std::vector<TraceEvent> ev = TensorTrace::events();
+    assert(ev.size()==(TensorTrace::compiled() ? 3 : 2));
+    assert(std::string(ev[0].op)=="outer");
+    assert(ev[0].numel==4 && ev[0].flops==8 && ev[0].bytes==32);
+    assert(ev[1].start>=ev[0].start);
+    assert(ev[1].start+ev[1].duration<=ev[0].start+ev[0].duration);
+    if (TensorTrace::compiled()) {
+      assert(std::string(ev[2].op)=="einstein" && std::string(ev[2].type)=="DT");
+      assert(ev[2].numel==4 && ev[2].flops==16);
+    }
+
+    std::stringstream chrome, table;
+    TensorTrace::write_chrome(chrome);
+    assert(chrome.str().find("\"name\": \"inner\"")!=std::string::npos);
+    TensorTrace::summary(table);
+    assert(table.str().find("outer")!=std::string::npos);
+
+    // The ring buffer keeps the most recent events
+    TensorTrace::set_capacity(2);
+    TensorTrace::set_enabled(true);
+    for (const char* op : {"a", "b", "c"}) TensorTrace::Scope s(op, "MT");
+    TensorTrace::set_enabled(false);
+    ev = TensorTrace::events();
+    assert(ev.size()==2 && std::string(ev[0].op)=="b" && std::string(ev[1].op)=="c");
+    TensorTrace::set_capacity(1<<16);
+  }
+
+  // Steady-state contraction loops do not allocate
+  {
+    std::vector<double> va, vb;
+    for (int i=0;i<6*5*7;++i) va.push_back(std::sin(i));
+    for (int i=0;i<7*5*6;++i) vb.push_back(std::cos(i));
+    DM a = DM(va);
+    DM b = DM(vb);
+    std::vector<int> dims_a = {6, 5, 7}, dims_b = {7, 5, 6};
+    std::vector<int> strides_a = contiguous_strides(dims_a), strides_b = contiguous_strides(dims_b);
+    std::vector<int> la = {-1, -2, -3};
+    // A transposed matrix product, and a walk with a summed label
+    std::vector< std::vector<int> > lb = {{-3, -2, -4}, {-3, -4, -1}};
+    std::vector< std::vector<int> > lc = {{-4, -1, -2}, {-1, -4}};
+
+    for (int i=0;i<lb.size();++i) {
+      DM ref = DT(a, dims_a).einstein(DT(b, dims_b), la, lb[i], lc[i]).data();
+      DM c = DM::zeros(ref.size());
+      long n_system = 0;
+      long n_alloc = 0;
+      for (int k=0;k<3;++k) {
+        // The first iteration warms up the arena and the plan cache
+        if (k==1) {
+          n_system = TensorArena::n_system_allocations();
+          n_alloc = n_allocations;
+        }
+        TensorArena scope;
+        std::shared_ptr<const ContractionPlan> plan =
+          ContractionPlan::get(dims_a, strides_a, dims_b, strides_b, la, lb[i], lc[i]);
+        std::fill(c.ptr(), c.ptr()+c.nnz(), 0);
+        dense_contract(*plan, a.ptr(), b.ptr(), c.ptr(), 1);
+      }
+      assert(n_allocations==n_alloc);
+      assert(TensorArena::n_system_allocations()==n_system);
+      assert(c.nonzeros()==ref.nonzeros());
+    }
+
+    // Scopes nest and release their memory when closed
+    std::size_t reserved = TensorArena::reserved();
+    ArenaVector<int> kept;
+    {
+      TensorArena outer;
+      ArenaVector<int> x(100, 1);
+      {
+        TensorArena inner;
+        ArenaVector<int> y(100, 2);
+        assert(x[99]==1 && y[99]==2);
+        // Copies get the heap, and may outlive the scope
+        kept = y;
+      }
+      ArenaVector<int> z(100, 3);
+      assert(x[99]==1 && z[99]==3);
+    }
+    assert(kept.size()==100 && kept[99]==2);
+    assert(TensorArena::reserved()>=reserved);
+    assert(TensorArena::current()==nullptr);
+
+    // A sparse contraction keeps one odometer, whatever its number of nonzeros
+    TensorArena::release();
+    DT(DM::eye(10), {10, 10}).einstein(DT(DM::ones(10, 1), {10}), {-1, -2}, {-2}, {-1});
+    reserved = TensorArena::reserved();
+    DT y = DT(DM::ones(Sparsity::lower(300)), {300, 300}).einstein(DT(DM::ones(300, 1), {300}),
+      {-1, -2}, {-2}, {-1});
+    assert(TensorArena::reserved()==reserved);
+    assert(static_cast<double>(y.data()(299))==300);
+  }
+
+  // Numeric tensors round-trip through .npy and .npz files, and map in place
+  {
+    std::vector<double> va;
+    for (int i=0;i<2*3*4;++i) va.push_back(std::sin(i));
+    DT A = DT(DM(va), {2, 3, 4});
+    DT B = DT(DM(std::vector<double>{1, 2, 3, 4}), {4});
+    DT S = DT(DM::eye(3), {3, 3});
+
+    A.save("test_tensor.npy");
+    DT L = DT::load("test_tensor.npy");
+    assert((L.dims()==A.dims()));
+    assert_equal(L.data(), A.data());
+
+    save_npz("test_tensor.npz", {{"A", A}, {"B", B}, {"S", S}});
+    std::map<std::string, MappedTensor> z = MappedTensor::load_npz("test_tensor.npz");
+    assert(z.size()==3);
+    const MappedTensor& M = z.at("A");
+    assert((M.dims()==A.dims()));
+    assert_equal(DT(M).data(), A.data());
+    assert_equal(DT(z.at("S")).data(), DM::eye(3));
+
+    // Contractions, slices and permutations read the mapping
+    assert_equal(M.einstein(B, {-1, -2, -3}, {-3}, {-1, -2}).data(),
+      A.einstein(B, {-1, -2, -3}, {-3}, {-1, -2}).data());
+    assert_equal(M.einstein(z.at("B"), {-1, -2, -3}, {-3}, {-2, -1}).data(),
+      A.einstein(B, {-1, -2, -3}, {-3}, {-2, -1}).data());
+    assert_equal(DT(M.index({1, -1, 2})).data(), A({1, -1, 2}).data());
+    assert_equal(DT(M.reorder_dims({2, 0, 1})).data(), DT(A.reorder_dims({2, 0, 1})).data());
+
+    bool thrown = false;
+    try {
+      ST::sym("x", {2}).save("test_tensor.npy");
+    } catch (std::exception& e) {
+      thrown = true;
+    }
+    assert(thrown);
+    std::remove("test_tensor.npy");
+    std::remove("test_tensor.npz");
+  }
+
+  // Constructed tensors are cached on disk, with their symbols
+  {
+    TensorCache::set_cache_dir("test_tensor_cache");
+    TensorCache::clear();
+    int built = 0;
+    std::function<std::vector<MT>()> build = [&]() {
+      built++;
+      MT x = MT::sym("x", {2, 3});
+      return std::vector<MT>{x, x.einstein(x, {-1, -2}, {-1, -3}, {-2, -3})};
+    };
+
+    std::vector<MT> a = TensorCache::cached<MX>("gram 2x3", build);
+    int hits = TensorCache::n_hits();
+    std::vector<MT> b = TensorCache::cached<MX>("gram 2x3", build);
+    assert(built==1 && TensorCache::n_hits()==hits+1);
+    assert((b[1].dims()==std::vector<int>{3, 3}));
+
+    // The deserialized result depends on the deserialized symbol
+    DM xv = DM(std::vector<double>{1, 2, 3, 4, 5, 6});
+    xv = reshape(xv, 2, 3);
+    Function fa("fa", std::vector<MX>{a[0].data()}, std::vector<MX>{a[1].data()});
+    Function fb("fb", std::vector<MX>{b[0].data()}, std::vector<MX>{b[1].data()});
+    assert_equal(fa(std::vector<DM>{xv})[0], fb(std::vector<DM>{xv})[0]);
+
+    // Other keys, types and versions build again
+    TensorCache::cached<MX>("gram 2x3, again", build);
+    assert(built==2);
+    std::vector<ST> c = TensorCache::cached<SX>("gram 2x3", [](){ return std::vector<ST>{ST::sym("y", {2})}; });
+    assert(c[0].dims()==std::vector<int>{2});
+    TensorCache::set_tag("other");
+    TensorCache::cached<MX>("gram 2x3", build);
+    assert(built==3);
+
+    // Entries beyond the size bound are evicted, but not files other processes are writing
+    std::string pending = TensorCache::cache_dir() + "/" + stable_hash(TensorCache::version()) +
+      "/0123456789abcdef.entry.Ab12Cd";
+    std::ofstream(pending) << "partial";
+    TensorCache::set_max_size(0);
+    TensorCache::cached<MX>("gram 2x3, evicted", build);
+    TensorCache::cached<MX>("gram 2x3, evicted", build);
+    assert(built==5);
+    assert(std::ifstream(pending).good());
+
+    // Nothing is left behind
+    TensorCache::set_max_size(-1);
+    TensorCache::clear();
+    TensorCache::set_tag("");
+    TensorCache::clear();
+    std::remove("test_tensor_cache/.tensortools-cache");
+    assert(std::remove("test_tensor_cache")==0);
+  }
+
+  // Out-of-core contractions stream tiles into a file, bit-identical to in memory
+  {
+    std::vector<double> va, vb;
+    for (int i=0;i<20*30*6;++i) va.push_back(std::sin(i));
+    for (int i=0;i<30*20*6;++i) vb.push_back(std::cos(i));
+    DT A = DT(DM(va), {20, 30, 6});
+    DT B = DT(DM(vb), {30, 20, 6});
+    A.save("test_tensor_a.npy");
+    B.save("test_tensor_b.npy");
+    MappedTensor MA("test_tensor_a.npy");
+    MappedTensor MB("test_tensor_b.npy");
+
+    // Whole, tiled along the batch label, and tiled along a free label with a scattered output
+    for (long budget : {1L << 30, 100000L}) {
+      DT C = MA.einstein(MB, {-1, -2, -3}, {-2, -4, -3}, {-1, -4, -3}, "test_tensor_c.npy", budget);
+      assert(C.data().nonzeros()==A.einstein(B, {-1, -2, -3}, {-2, -4, -3}, {-1, -4, -3}).data().nonzeros());
+      C = MA.einstein(MB, {-1, -2, -3}, {-2, -4, -3}, {-1, -4}, "test_tensor_c.npy", budget, -1);
+      assert(C.data().nonzeros()==A.einstein(B, {-1, -2, -3}, {-2, -4, -3}, {-1, -4}).data().nonzeros());
+      C = MA.einstein(MB, {-1, -2, -3}, {-2, -4, -5}, {-3, -4, -1}, "test_tensor_c.npy", budget, -4);
+      assert(C.data().nonzeros()==A.einstein(B, {-1, -2, -3}, {-2, -4, -5}, {-3, -4, -1}).data().nonzeros());
+    }
+    DT P = MA.partial_product(MB, "test_tensor_c.npy", 100000);
+    assert(P.data().nonzeros()==A.partial_product(B).data().nonzeros());
+
+    bool thrown = false;
+    try {
+      MA.einstein(MB, {-1, -2, -3}, {-2, -4, -3}, {-1, -4, -3}, "test_tensor_c.npy", 1000);
+    } catch (std::exception& e) {
+      thrown = true;
+    }
+    assert(thrown);
+
+    // Files in C order, numpy's default, are tiled alike; this is A as numpy would save it
+    {
+      DT(A.reorder_dims({2, 1, 0})).save("test_tensor_r.npy");
+      std::ifstream in("test_tensor_r.npy", std::ios::binary);
+      std::string npy((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+      in.close();
+      npy.replace(npy.find("True"), 4, "False");
+      npy.replace(npy.find("(6, 30, 20)"), 11, "(20, 30, 6)");
+      // One padding space less keeps the header length
+      npy.erase(npy.find(" \n"), 1);
+      std::ofstream("test_tensor_r.npy", std::ios::binary) << npy;
+    }
+    MappedTensor MC("test_tensor_r.npy");
+    assert((MC.dims()==std::vector<int>{20, 30, 6}));
+    DT C = MC.einstein(MB, {-1, -2, -3}, {-2, -4, -3}, {-1, -4, -3}, "test_tensor_c.npy", 100000);
+    assert_equal(C.data(), A.einstein(B, {-1, -2, -3}, {-2, -4, -3}, {-1, -4, -3}).data());
+    std::remove("test_tensor_r.npy");
+    std::remove("test_tensor_a.npy");
+    std::remove("test_tensor_b.npy");
+    std::remove("test_tensor_c.npy");
+  }
+
+  // Evaluation into preallocated outputs matches the allocating call
+  {
+    MT x = MT::sym("x", {3});
+    MT P = MT::sym("P", {3, 3});
+    MT y = P.einstein(x, {-1, -2}, {-2}, {-1});
+    TensorFunction f("f", std::vector<MT>{x, P}, std::vector<MT>{y, x.outer_product(y)});
+
+    DT xv = DT(DM(std::vector<double>{1, 2, 3}), {3});
+    DT Pv = DT(DM::eye(3)*2, {3, 3});
+    std::vector<DT> res;
+    f.eval({xv, Pv}, res);
+    const double* storage = res[1].data().ptr();
+    f.eval({xv, Pv}, res);
+    assert(res[1].data().ptr()==storage);
+    std::vector<DT> ref = f({xv, Pv});
+    for (int i=0;i<2;++i) {
+      assert(res[i].dims()==ref[i].dims());
+      assert(res[i].data().nonzeros()==ref[i].data().nonzeros());
+    }
+
+    // Steady-state evaluation does not allocate
+    std::vector<DT> args = {xv, Pv};
+    long before = n_allocations;
+    f.eval(args, res);
+    assert(n_allocations==before);
+
+    TensorFunction fm = f.map(2);
+    DT xs = DT::pack(std::vector<DT>{xv, DT(DM(std::vector<double>{2, 4, 6}), {3})}, 0);
+    fm.eval({xs, Pv}, res);
+    ref = fm({xs, Pv});
+    for (int i=0;i<2;++i) {
+      assert(res[i].dims()==ref[i].dims());
+      assert(res[i].data().nonzeros()==ref[i].data().nonzeros());
+    }
+
+    args = {xs, Pv};
+    before = n_allocations;
+    fm.eval(args, res);
+    assert(n_allocations==before);
+  }
+
+  // Memoized contractions return earlier results for identical operands and specs
+  {
+    EinsteinMemo::clear();
+    EinsteinMemo::set_enabled(true);
+    int hits = EinsteinMemo::n_hits();
+    int misses = EinsteinMemo::n_misses();
+
+    DT A = DT(DM(std::vector<double>{1, 2, 3, 4, 5, 6}), {2, 3});
+    DT A2 = DT(DM(std::vector<double>{1, 2, 3, 4, 5, 6}), {2, 3});
+    DT B = DT(DM(std::vector<double>{1, 2, 3}), {3});
+    DT C = A.einstein(B, {-1, -2}, {-2}, {-1});
+    // Equal values in other storage hit as well
+    assert_equal(A2.einstein(B, {-1, -2}, {-2}, {-1}).data(), C.data());
+    assert(EinsteinMemo::n_hits()==hits+1 && EinsteinMemo::n_misses()==misses+1);
+    A2.einstein(B, {-2, -1}, {-1}, {-2});
+    assert(EinsteinMemo::n_misses()==misses+2);
+
+    // Symbolic results share their subgraph
+    MT X = MT::sym("X", {3, 3, 2});
+    MT Y = MT::sym("Y", {3, 3, 2});
+    MT P = X.partial_product(Y);
+    MT P2 = MT(X.data(), X.dims()).partial_product(Y);
+    assert(is_equal(P.data(), P2.data()));
+    assert(EinsteinMemo::n_hits()==hits+2);
+    assert(!is_equal(Y.partial_product(X).data(), P.data()));
+
+    EinsteinMemo::set_capacity(1);
+    assert(EinsteinMemo::size()<=3);
+    EinsteinMemo::set_capacity(4096);
+    EinsteinMemo::set_enabled(false);
+    EinsteinMemo::clear();
+    assert(EinsteinMemo::size()==0);
+  }
+
   // Scalar
   expected = DM(5);
   got = DT(5.0).data();
@@ -209,12 +1046,12 @@ int main() {
 
   AnyScalar a = 1.5;
 
-  double w = a;
+  double w = static_cast<double>(a);
   assert_equal(1.5, w);
 
   {
     AnyScalar a = SX(1.5);
-    SX w = a;
+    SX w = static_cast<SX>(a);
     assert_equal(1.5, w);
   }
   
@@ -225,11 +1062,42 @@ int main() {
 
     //assert_equal(t, AnyTensor(DT(DM({{2, 3}}),{2})));
 
-    std::vector<double> d = AnyScalar::vector_double(v);
+    std::vector<double> d = AnyScalar::as_double(v);
 
     assert_equal(d, std::vector<double>{2, 3});
   }
 
+  // Double-valued AnyScalar arithmetic does not allocate
+  {
+    long before = n_allocations;
+    AnyScalar x = 2.0;
+    AnyScalar y = x;
+    AnyScalar z = x*y-x/y;
+    z += x;
+    y = z;
+    assert(n_allocations==before);
+    assert_equal(static_cast<double>(y), 5.0);
+
+    y = SX::sym("y");
+    assert(y.is_SX());
+    y = 1.0;
+    assert(y.is_double());
+
+    std::vector<AnyScalar> v = {1.0, SX::sym("a"), 3.0};
+    AnyTensor t = vertcat(v);
+    assert(t.is_ST());
+    assert((t.dims()==std::vector<int>{3}));
+
+    // Copies and moves of an empty scalar are empty
+    AnyScalar e;
+    AnyScalar f = e;
+    AnyScalar g = std::move(f);
+    assert(f.type()==TENSOR_NULL && g.type()==TENSOR_NULL);
+    g = 1.0;
+    g = e;
+    assert(g.type()==TENSOR_NULL);
+  }
+
   {
     AnyTensor a = AnyTensor::unity();
 
@@ -0,0 +1,86 @@
+#include "thread_pool.hpp"
+
+namespace {
+  thread_local bool inside_task = false;
+}
+
+ThreadPool::ThreadPool(int n_threads) : task_(0), n_tasks_(0), next_(0), n_finished_(0),
+    generation_(0), stop_(false) {
+  for (int i=1;i<n_threads;++i) workers_.push_back(std::thread(&ThreadPool::work, this));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (auto& w : workers_) w.join();
+}
+
+void ThreadPool::run(int n_tasks, const std::function<void(int)>& task) {
+  if (inside_task || workers_.empty() || n_tasks<=1) {
+    for (int i=0;i<n_tasks;++i) task(i);
+    return;
+  }
+
+  std::lock_guard<std::mutex> run_lock(run_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = &task;
+    n_tasks_ = n_tasks;
+    next_ = 0;
+    n_finished_ = 0;
+    generation_++;
+  }
+  wake_.notify_all();
+
+  drain();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return n_finished_==n_tasks_; });
+  task_ = 0;
+}
+
+void ThreadPool::drain() {
+  inside_task = true;
+  for (;;) {
+    int i;
+    const std::function<void(int)>* task;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (task_==0 || next_>=n_tasks_) break;
+      i = next_++;
+      task = task_;
+    }
+    (*task)(i);
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      last = ++n_finished_==n_tasks_;
+    }
+    if (last) done_.notify_all();
+  }
+  inside_task = false;
+}
+
+void ThreadPool::work() {
+  int seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [&] { return stop_ || generation_!=seen; });
+      if (stop_) return;
+      seen = generation_;
+    }
+    drain();
+  }
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::shared(int n_threads) {
+  static std::mutex m;
+  static std::shared_ptr<ThreadPool> pool;
+  std::lock_guard<std::mutex> lock(m);
+  if (!pool || pool->size()!=n_threads) pool = std::make_shared<ThreadPool>(n_threads);
+  return pool;
+}
@@ -0,0 +1,55 @@
+#ifndef THREAD_POOL_HPP_INCLUDE
+#define THREAD_POOL_HPP_INCLUDE
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/** \brief Fixed set of worker threads executing indexed tasks
+
+  run(n, task) executes task(0), ..., task(n-1) on the workers and the
+  calling thread, and returns when all of them have finished.
+  A call to run from within a task executes serially.
+*/
+class ThreadPool {
+  public:
+    explicit ThreadPool(int n_threads);
+    ~ThreadPool();
+
+    /// Number of threads taking part in run, including the caller
+    int size() const { return workers_.size()+1; }
+
+    void run(int n_tasks, const std::function<void(int)>& task);
+
+    /** \brief Pool shared by the numeric kernels
+    *
+    *   Recreated when a different size is requested; callers still
+    *   holding the previous pool keep it alive.
+    */
+    static std::shared_ptr<ThreadPool> shared(int n_threads);
+
+  private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    void work();
+    void drain();
+
+    std::vector<std::thread> workers_;
+    std::mutex run_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+
+    const std::function<void(int)>* task_;
+    int n_tasks_;
+    int next_;
+    int n_finished_;
+    int generation_;
+    bool stop_;
+};
+
+#endif